@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2012 Jeremy Pepper
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of message_queue nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "audio_pool.h"
+
+int audio_pool_init(struct audio_pool *pool, unsigned int frames_per_block, unsigned int blocks, int flags) {
+	pool->frames_per_block = frames_per_block;
+	return message_queue_init_flags(&pool->allocator,
+	                                sizeof(struct audio_block) + sizeof(float) * frames_per_block * 2,
+	                                blocks, flags | MESSAGE_QUEUE_ALIGNED);
+}
+
+struct audio_block *audio_pool_alloc(struct audio_pool *pool) {
+	struct audio_block *block = message_queue_message_alloc_blocking(&pool->allocator);
+	block->frames = 0;
+	return block;
+}
+
+struct audio_block *audio_pool_tryalloc(struct audio_pool *pool) {
+	struct audio_block *block = message_queue_message_alloc(&pool->allocator);
+	if(block)
+		block->frames = 0;
+	return block;
+}
+
+void audio_pool_free(struct audio_pool *pool, struct audio_block *block) {
+	message_queue_message_free(&pool->allocator, block);
+}
+
+void audio_pool_destroy(struct audio_pool *pool) {
+	message_queue_destroy(&pool->allocator);
+}
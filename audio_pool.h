@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2012 Jeremy Pepper
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of message_queue nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AUDIO_POOL_H
+#define AUDIO_POOL_H
+
+#include "message_queue.h"
+
+/**
+ * \brief A block of interleaved stereo audio from an audio_pool
+ *
+ * frames is the number of valid frames in samples, and is set by whoever
+ * fills the block. samples starts on a cache line boundary and has room for
+ * the pool's frames_per_block frames.
+ */
+struct audio_block {
+	unsigned int frames;
+	float samples[] __attribute__((aligned(CACHE_LINE_SIZE)));
+};
+
+/**
+ * \brief A fixed pool of preallocated audio blocks
+ *
+ * Blocks come from a message_queue's allocator, so they can be filled in
+ * place and handed between threads by pointer without copying or calling
+ * malloc once the pool is set up.
+ */
+struct audio_pool {
+	unsigned int frames_per_block;
+	struct message_queue allocator;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \brief Initialize an audio pool
+ *
+ * \param pool pointer to the pool to initialize
+ * \param frames_per_block the number of stereo frames each block can hold
+ * \param blocks the number of blocks. This will be rounded to the next
+ *        highest power of two.
+ * \param flags MESSAGE_QUEUE_HUGEPAGES to back the pool with huge pages, or 0
+ * \return 0 if successful, or nonzero if an error occured
+ */
+int audio_pool_init(struct audio_pool *pool, unsigned int frames_per_block, unsigned int blocks, int flags);
+
+/**
+ * \brief Take a block from the pool, waiting for one to be freed if needed
+ *
+ * \param pool pointer to the pool
+ * \return pointer to the block, with frames set to 0
+ */
+struct audio_block *audio_pool_alloc(struct audio_pool *pool);
+
+/**
+ * \brief Take a block from the pool if one is free
+ *
+ * \param pool pointer to the pool
+ * \return pointer to the block, with frames set to 0, or NULL if none is free
+ */
+struct audio_block *audio_pool_tryalloc(struct audio_pool *pool);
+
+/**
+ * \brief Return a block to the pool
+ *
+ * Any thread may free a block, not just the one that allocated it.
+ *
+ * \param pool pointer to the pool the block came from
+ * \param block the block to free
+ */
+void audio_pool_free(struct audio_pool *pool, struct audio_block *block);
+
+/**
+ * \brief Destroy an audio pool
+ *
+ * All blocks must have been freed first.
+ *
+ * \param pool pointer to the pool to destroy
+ */
+void audio_pool_destroy(struct audio_pool *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
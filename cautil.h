@@ -29,7 +29,22 @@
 
 #ifndef CAUTIL_H
 #define CAUTIL_H
+
+/*
+ * The player backend. On macOS it plays through CoreAudio (cautil.c).
+ * Elsewhere it decodes with libsndfile and calls the event handler from a
+ * simulated output device's clock (sfutil.c), timing each render event so
+ * the real-time path can be measured without audio hardware.
+ */
+#ifdef __APPLE__
 #include <AudioToolbox/AudioToolbox.h>
+#else
+#include <stdint.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sndfile.h>
+typedef int OSStatus;
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -38,8 +53,8 @@ extern "C" {
 struct PlayerEvent {
 	struct Player *player;
 	enum {
-		PLAYER_RENDER = 'rndr',
-		PLAYER_DONE = 'done'
+		PLAYER_RENDER,
+		PLAYER_DONE
 	} type;
 	float *left, *right;
 	unsigned int size;
@@ -47,12 +62,37 @@ struct PlayerEvent {
 
 typedef void (*PlayerEventHandler)(struct PlayerEvent *);
 
+#ifndef __APPLE__
+/* Render events are timed into power-of-two nanosecond buckets */
+#define PLAYER_TIMING_BUCKETS 32
+
+struct PlayerTiming {
+	unsigned long histogram[PLAYER_TIMING_BUCKETS];
+	unsigned long callbacks;
+	unsigned long overruns;
+	uint64_t total_ns;
+	uint64_t max_ns;
+};
+#endif
+
 struct Player {
+#ifdef __APPLE__
 	AUGraph graph;
 	AUNode outputNode;
 	AUNode fileNode;
 	AudioUnit fileAU;
 	AudioFileID audioFile;
+#else
+	SNDFILE *file;
+	pthread_t thread;
+	float *buffer, *left, *right;
+	int channels;
+	unsigned int bufferFrames;
+	int realtime;
+	int rendering;
+	volatile int stopping;
+	struct PlayerTiming timing;
+#endif
 	uintptr_t samples;
 	int samplerate;
 	int playing;
@@ -62,9 +102,25 @@ struct Player {
 
 OSStatus CAInitPlayer(struct Player *player, PlayerEventHandler eventHandler);
 OSStatus CAPlayFile(struct Player *player, const char *path);
+/* On the simulated device this stops and joins the render thread, if any */
 void CAStopPlayback(struct Player *player);
 void CADestroyPlayer(struct Player *player);
 
+#ifndef __APPLE__
+/*
+ * Sets up the simulated device: its sample rate, how many frames each render
+ * event asks for, and whether its clock follows the wall clock or runs as
+ * fast as the handler allows. Call before CAPlayFile.
+ */
+void CAConfigureSimulation(struct Player *player, int samplerate, unsigned int bufferFrames, int realtime);
+
+/*
+ * Prints the render event timing histogram and deadline headroom so far.
+ * This can still be called after CADestroyPlayer.
+ */
+void CAPrintTiming(struct Player *player, FILE *out);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2013 Jeremy Pepper
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of crossfeed nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+#include "crossfeed.h"
+
+#define BENCH_FRAMES 1024
+#define BENCH_MAX_TAPS 1024
+#define BENCH_STREAMS 1024
+#define BENCH_STREAM_FRAMES 256
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns millions of frames per second */
+static double bench(crossfeed_t *filter, float *input, float *output, double seconds) {
+	unsigned long frames = 0;
+	double start = now(), elapsed;
+	do {
+		for(unsigned int i=0;i<64;++i) {
+			crossfeed_filter(filter, input, output, BENCH_FRAMES);
+		}
+		frames += 64 * BENCH_FRAMES;
+		elapsed = now() - start;
+	} while(elapsed < seconds);
+	return frames / elapsed / 1e6;
+}
+
+/*
+ * Returns millions of frames per second filtering to packed 24-bit output,
+ * either in one pass with crossfeed_filter_convert or by filtering, clamping
+ * and converting in separate passes
+ */
+static double bench_convert(crossfeed_t *filter, float *input, float *output, int fused,
+                            double seconds) {
+	static unsigned char packed[BENCH_FRAMES*6];
+	struct crossfeed_output out;
+	unsigned long frames = 0;
+	double start = now(), elapsed;
+	crossfeed_output_init(&out, CROSSFEED_FORMAT_S24, 0);
+	do {
+		for(unsigned int i=0;i<64;++i) {
+			if(fused) {
+				crossfeed_filter_convert(filter, input, packed, BENCH_FRAMES, &out);
+				continue;
+			}
+			crossfeed_filter(filter, input, output, BENCH_FRAMES);
+			for(unsigned int j=0;j<BENCH_FRAMES*2;++j) {
+				output[j] = output[j] > 1 ? 1 : (output[j] < -1 ? -1 : output[j]);
+			}
+			for(unsigned int j=0;j<BENCH_FRAMES*2;++j) {
+				const long value = lrintf(output[j] * 0x7FFFFF);
+				packed[j*3] = value;
+				packed[j*3+1] = value >> 8;
+				packed[j*3+2] = value >> 16;
+			}
+		}
+		frames += 64 * BENCH_FRAMES;
+		elapsed = now() - start;
+	} while(elapsed < seconds);
+	return frames / elapsed / 1e6;
+}
+
+/*
+ * Returns millions of frames per second across BENCH_STREAMS streams, either
+ * filtered one by one or with crossfeed_filter_streams
+ */
+static double bench_streams(int samplerate, int batched, double seconds) {
+	crossfeed_t *filters = malloc(sizeof(crossfeed_t) * BENCH_STREAMS);
+	float *buffer = malloc(sizeof(float) * BENCH_STREAMS * BENCH_STREAM_FRAMES * 2);
+	float *buffers[BENCH_STREAMS];
+	unsigned long frames = 0;
+	double start, elapsed;
+	for(unsigned int s=0;s<BENCH_STREAMS;++s) {
+		crossfeed_init(&filters[s], samplerate);
+		buffers[s] = buffer + s * BENCH_STREAM_FRAMES * 2;
+	}
+	for(unsigned int i=0;i<BENCH_STREAMS*BENCH_STREAM_FRAMES*2;++i) {
+		buffer[i] = rand() / (float)RAND_MAX * 2 - 1;
+	}
+	start = now();
+	do {
+		if(batched) {
+			crossfeed_filter_streams(filters, BENCH_STREAMS, buffers, buffers, BENCH_STREAM_FRAMES);
+		} else {
+			for(unsigned int s=0;s<BENCH_STREAMS;++s) {
+				crossfeed_filter(&filters[s], buffers[s], buffers[s], BENCH_STREAM_FRAMES);
+			}
+		}
+		frames += BENCH_STREAMS * BENCH_STREAM_FRAMES;
+		elapsed = now() - start;
+	} while(elapsed < seconds);
+	free(buffer);
+	free(filters);
+	return frames / elapsed / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+	static const int rates[] = {44100, 48000, 88200, 96000, 192000};
+	static const unsigned int lengths[] = {129, 256, 512, BENCH_MAX_TAPS};
+	static float input[BENCH_FRAMES*2], output[BENCH_FRAMES*2], kernel[BENCH_MAX_TAPS];
+	double seconds = argc > 1 ? atof(argv[1]) : 1;
+	crossfeed_t filter;
+	if(seconds <= 0) {
+		fprintf(stderr, "Usage: %s [seconds per test]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	srand(1);
+	for(unsigned int i=0;i<BENCH_FRAMES*2;++i) {
+		input[i] = rand() / (float)RAND_MAX * 2 - 1;
+	}
+	for(unsigned int i=0;i<BENCH_MAX_TAPS;++i) {
+		kernel[i] = (i ? -0.5f : 1) * expf(-(float)i / 32);
+	}
+	printf("%-8s %8s %6s %14s\n", "isa", "rate", "taps", "Mframes/sec");
+	for(int isa = CROSSFEED_ISA_SCALAR; isa <= CROSSFEED_ISA_NEON; ++isa) {
+		if(crossfeed_set_isa(isa))
+			continue;
+		for(unsigned int r=0;r<sizeof(rates)/sizeof(rates[0]);++r) {
+			crossfeed_init(&filter, rates[r]);
+			printf("%-8s %8d %6u %14.1f\n", crossfeed_isa_name(isa), rates[r], filter.len,
+			       bench(&filter, input, output, seconds));
+			crossfeed_destroy(&filter);
+		}
+		crossfeed_init(&filter, 96000);
+		printf("%-8s %8d %6s %14.1f\n", crossfeed_isa_name(isa), 96000, "s24",
+		       bench_convert(&filter, input, output, 0, seconds));
+		printf("%-8s %8d %6s %14.1f\n", crossfeed_isa_name(isa), 96000, "fused",
+		       bench_convert(&filter, input, output, 1, seconds));
+		crossfeed_destroy(&filter);
+		for(unsigned int l=0;l<sizeof(lengths)/sizeof(lengths[0]);++l) {
+			if(crossfeed_init_kernel(&filter, kernel, lengths[l], 0))
+				continue;
+			printf("%-8s %8s %6u %14.1f\n", crossfeed_isa_name(isa), "fft", lengths[l],
+			       bench(&filter, input, output, seconds));
+			crossfeed_destroy(&filter);
+		}
+		for(unsigned int r=0;r<sizeof(rates)/sizeof(rates[0]);++r) {
+			printf("%-8s %8d %6s %14.1f\n", crossfeed_isa_name(isa), rates[r], "single",
+			       bench_streams(rates[r], 0, seconds));
+			printf("%-8s %8d %6s %14.1f\n", crossfeed_isa_name(isa), rates[r], "batch",
+			       bench_streams(rates[r], 1, seconds));
+		}
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,431 @@
+/*
+ * Copyright (c) 2013 Jeremy Pepper
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of crossfeed nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "crossfeed.h"
+
+#define CHECK_BLOCK 128
+#define CHECK_BLOCKS 40
+#define CHECK_FRAMES 4000
+#define CHECK_LONG_TAPS 500
+#define CHECK_IMPULSE 4096
+#define CHECK_STORE_DB 3
+#define CHECK_STORE_US 100
+
+/* Frames per call, uneven so that calls split blocks in different places */
+static const unsigned int check_sizes[] = {1, 37, 256, 300, 1000, 129};
+#define CHECK_SIZES (sizeof(check_sizes) / sizeof(check_sizes[0]))
+
+static void fill_random(float *samples, unsigned int count) {
+	for(unsigned int i=0;i<count;++i) {
+		samples[i] = rand() / (float)RAND_MAX * 2 - 1;
+	}
+}
+
+/* A slowly decaying kernel long enough to need the FFT tail */
+static void long_kernel(float *kernel, unsigned int len) {
+	for(unsigned int t=0;t<len;++t) {
+		kernel[t] = (rand() / (float)RAND_MAX - 0.5f) * expf(-(float)t / 100) * 0.2f;
+	}
+}
+
+/* Runs frames frames through filter check_sizes frames at a time */
+static void filter_uneven(crossfeed_t *filter, float *input, float *output, unsigned int frames) {
+	for(unsigned int i=0, pos=0;pos<frames;++i) {
+		unsigned int n = check_sizes[i % CHECK_SIZES];
+		n = n < frames - pos ? n : frames - pos;
+		crossfeed_filter(filter, input + pos*2, output + pos*2, n);
+		pos += n;
+	}
+}
+
+/* Largest difference between a block of a and scale times the same block of b */
+static float max_difference(const float *a, const float *b, float scale, unsigned int size) {
+	float max = 0;
+	for(unsigned int i=0;i<size;++i) {
+		const float d = fabsf(a[i] - b[i] * scale);
+		max = d > max ? d : max;
+	}
+	return max;
+}
+
+/*
+ * Changes the gain and bypass of a slowly decaying cascade and checks it
+ * against one left alone: once each fade is over, the two may only differ
+ * by the gain, and after the last one not at all. Running the cascade twice
+ * per block during a fade would leave its state off for good.
+ */
+static int check_iir_controls(void) {
+	static const float pole[5] = {1, 0, 0, -0.995f, 0};
+	static float input[CHECK_BLOCK*2], a[CHECK_BLOCK*2], b[CHECK_BLOCK*2];
+	crossfeed_t changed, reference;
+	int failed = 0;
+	if(crossfeed_init_iir(&changed, pole, 1, 2) || crossfeed_init_iir(&reference, pole, 1, 2)) {
+		fprintf(stderr, "iir controls: init failed\n");
+		return -1;
+	}
+	srand(1);
+	for(unsigned int block=0;block<CHECK_BLOCKS;++block) {
+		float scale = 1;
+		for(unsigned int i=0;i<CHECK_BLOCK*2;++i) {
+			input[i] = rand() / (float)RAND_MAX * 2 - 1;
+		}
+		switch(block) {
+		case 4:
+			crossfeed_set_gain(&changed, 0.5f);
+			break;
+		case 10:
+			crossfeed_set_bypass(&changed, 1);
+			break;
+		case 16:
+			crossfeed_set_bypass(&changed, 0);
+			break;
+		case 22:
+			crossfeed_set_gain(&changed, 1);
+			break;
+		}
+		crossfeed_filter(&changed, input, a, CHECK_BLOCK);
+		crossfeed_filter(&reference, input, b, CHECK_BLOCK);
+		if(block >= 7 && block < 10)
+			scale = 0.5f;
+		else if(block < 25)
+			continue;
+		if(max_difference(a, b, scale, CHECK_BLOCK*2) > 1e-6f) {
+			fprintf(stderr, "iir controls: block %u differs by %g\n", block,
+			        max_difference(a, b, scale, CHECK_BLOCK*2));
+			failed = 1;
+		}
+	}
+	crossfeed_destroy(&changed);
+	crossfeed_destroy(&reference);
+	return failed ? -1 : 0;
+}
+
+/*
+ * Converts to 16-bit with a gain other than 1, fading in and then steady,
+ * and checks the result against crossfeed_filter clamped, scaled and
+ * rounded separately, which the header promises it matches exactly.
+ */
+static int check_convert_gain(void) {
+	static float input[CHECK_BLOCK*2], filtered[CHECK_BLOCK*2];
+	static int16_t converted[CHECK_BLOCK*2];
+	crossfeed_t fused, separate;
+	struct crossfeed_output out;
+	unsigned int mismatches = 0;
+	if(crossfeed_init(&fused, 96000) || crossfeed_init(&separate, 96000)) {
+		fprintf(stderr, "convert gain: init failed\n");
+		return -1;
+	}
+	crossfeed_output_init(&out, CROSSFEED_FORMAT_S16, 0);
+	crossfeed_set_gain(&fused, 0.7f);
+	crossfeed_set_gain(&separate, 0.7f);
+	srand(2);
+	for(unsigned int block=0;block<CHECK_BLOCKS;++block) {
+		for(unsigned int i=0;i<CHECK_BLOCK*2;++i) {
+			input[i] = rand() / (float)RAND_MAX * 3 - 1.5f;
+		}
+		crossfeed_filter_convert(&fused, input, converted, CHECK_BLOCK, &out);
+		crossfeed_filter(&separate, input, filtered, CHECK_BLOCK);
+		for(unsigned int i=0;i<CHECK_BLOCK*2;++i) {
+			const float x = filtered[i] > 1 ? 1 : (filtered[i] < -1 ? -1 : filtered[i]);
+			mismatches += converted[i] != lrintf(x * 0x7FFF);
+		}
+	}
+	if(mismatches)
+		fprintf(stderr, "convert gain: %u samples differ\n", mismatches);
+	crossfeed_destroy(&fused);
+	crossfeed_destroy(&separate);
+	return mismatches ? -1 : 0;
+}
+
+/*
+ * Filters the same input with each supported ISA and with the scalar code,
+ * a different number of frames per call, through the built-in kernels, a
+ * kernel designed for another rate, and a long kernel with an FFT tail. All
+ * of them have to match the scalar output bit for bit.
+ */
+static int check_isa(void) {
+	static const int rates[] = {44100, 48000, 96000, 32000};
+	static float input[CHECK_FRAMES*2], expected[CHECK_FRAMES*2], actual[CHECK_FRAMES*2];
+	static float kernel[CHECK_LONG_TAPS];
+	const unsigned int kernels = sizeof(rates) / sizeof(rates[0]) + 1;
+	int failed = 0;
+	srand(4);
+	fill_random(input, CHECK_FRAMES*2);
+	long_kernel(kernel, CHECK_LONG_TAPS);
+	for(int isa=CROSSFEED_ISA_SCALAR+1;isa<=CROSSFEED_ISA_NEON;++isa) {
+		if(!crossfeed_isa_supported(isa))
+			continue;
+		for(unsigned int k=0;k<kernels;++k) {
+			crossfeed_t scalar, filter;
+			int rv;
+			crossfeed_set_isa(CROSSFEED_ISA_SCALAR);
+			rv = k < kernels - 1 ? crossfeed_init(&scalar, rates[k]) :
+			     crossfeed_init_kernel(&scalar, kernel, CHECK_LONG_TAPS, 3);
+			crossfeed_set_isa(isa);
+			rv |= k < kernels - 1 ? crossfeed_init(&filter, rates[k]) :
+			      crossfeed_init_kernel(&filter, kernel, CHECK_LONG_TAPS, 3);
+			if(rv) {
+				fprintf(stderr, "isa %s: init failed\n", crossfeed_isa_name(isa));
+				failed = 1;
+				continue;
+			}
+			crossfeed_filter(&scalar, input, expected, CHECK_FRAMES);
+			filter_uneven(&filter, input, actual, CHECK_FRAMES);
+			if(memcmp(expected, actual, sizeof(actual))) {
+				if(k < kernels - 1)
+					fprintf(stderr, "isa %s: %d Hz kernel differs from scalar\n",
+					        crossfeed_isa_name(isa), rates[k]);
+				else
+					fprintf(stderr, "isa %s: long kernel differs from scalar\n", crossfeed_isa_name(isa));
+				failed = 1;
+			}
+			crossfeed_destroy(&scalar);
+			crossfeed_destroy(&filter);
+		}
+	}
+	crossfeed_set_isa(CROSSFEED_ISA_AUTO);
+	return failed ? -1 : 0;
+}
+
+/*
+ * Runs kernels longer than CROSSFEED_MAX_LEN, which take the FFT tail, and
+ * checks them against a direct convolution in double precision. The tail
+ * rounds differently from a direct sum; the outputs come within about 4e-7
+ * of it, and are allowed 1e-5, which a wrong or misaligned partition would
+ * exceed by orders of magnitude.
+ */
+static int check_long_kernel(void) {
+	static const unsigned int lengths[] = {CROSSFEED_MAX_LEN + 1, CHECK_LONG_TAPS, 3000};
+	static float input[CHECK_FRAMES*2], output[CHECK_FRAMES*2], kernel[3000];
+	int failed = 0;
+	srand(5);
+	fill_random(input, CHECK_FRAMES*2);
+	for(unsigned int l=0;l<sizeof(lengths) / sizeof(lengths[0]);++l) {
+		const unsigned int len = lengths[l], delay = 7;
+		crossfeed_t filter;
+		double max = 0;
+		long_kernel(kernel, len);
+		if(crossfeed_init_kernel(&filter, kernel, len, delay)) {
+			fprintf(stderr, "long kernel: init failed for %u taps\n", len);
+			failed = 1;
+			continue;
+		}
+		filter_uneven(&filter, input, output, CHECK_FRAMES);
+		crossfeed_destroy(&filter);
+		for(unsigned int i=0;i<CHECK_FRAMES;++i) {
+			double mid = 0, side = 0;
+			if(i >= delay)
+				mid = ((double)input[(i-delay)*2] + input[(i-delay)*2+1]) / 2;
+			for(unsigned int t=0;t<len && t<=i;++t) {
+				side += ((double)input[(i-t)*2] - input[(i-t)*2+1]) / 2 * kernel[t];
+			}
+			max = fmax(max, fabs(output[i*2] - (mid + side)));
+			max = fmax(max, fabs(output[i*2+1] - (mid - side)));
+		}
+		if(max > 1e-5) {
+			fprintf(stderr, "long kernel: %u taps differ from direct convolution by %g\n", len, max);
+			failed = 1;
+		}
+	}
+	return failed ? -1 : 0;
+}
+
+#define CHECK_STREAMS 24
+
+/*
+ * Sets up stream s of check_streams: a run of eleven 44.1kHz streams, so
+ * that one batch is full and the next isn't, then 96kHz streams with a
+ * bypassed one, one fading to a new gain and one with a long kernel among
+ * them, which are filtered on their own.
+ */
+static int init_stream(crossfeed_t *filter, unsigned int s, const float *kernel) {
+	if(s == 20)
+		return crossfeed_init_kernel(filter, kernel, CHECK_LONG_TAPS, 0);
+	if(crossfeed_init(filter, s < 11 ? 44100 : 96000))
+		return -1;
+	if(s == 14)
+		crossfeed_set_bypass(filter, 1);
+	if(s == 17)
+		crossfeed_set_gain(filter, 0.5f);
+	return 0;
+}
+
+/*
+ * Filters the same streams with crossfeed_filter_streams and one by one
+ * with crossfeed_filter, on each supported ISA and over several calls of
+ * uneven sizes, which have to match bit for bit.
+ */
+static int check_streams(void) {
+	static crossfeed_t batched[CHECK_STREAMS], single[CHECK_STREAMS];
+	static float input[CHECK_STREAMS][CHECK_FRAMES*2];
+	static float expected[CHECK_STREAMS][CHECK_FRAMES*2], actual[CHECK_STREAMS][CHECK_FRAMES*2];
+	static float kernel[CHECK_LONG_TAPS];
+	float *in[CHECK_STREAMS], *out[CHECK_STREAMS];
+	int failed = 0;
+	srand(6);
+	long_kernel(kernel, CHECK_LONG_TAPS);
+	for(unsigned int s=0;s<CHECK_STREAMS;++s) {
+		fill_random(input[s], CHECK_FRAMES*2);
+	}
+	for(int isa=CROSSFEED_ISA_SCALAR;isa<=CROSSFEED_ISA_NEON;++isa) {
+		unsigned int pos = 0;
+		if(crossfeed_set_isa(isa))
+			continue;
+		for(unsigned int s=0;s<CHECK_STREAMS;++s) {
+			if(init_stream(&batched[s], s, kernel) || init_stream(&single[s], s, kernel)) {
+				fprintf(stderr, "streams: init failed\n");
+				crossfeed_set_isa(CROSSFEED_ISA_AUTO);
+				return -1;
+			}
+		}
+		for(unsigned int i=0;pos<CHECK_FRAMES;++i) {
+			unsigned int n = check_sizes[i % CHECK_SIZES];
+			n = n < CHECK_FRAMES - pos ? n : CHECK_FRAMES - pos;
+			for(unsigned int s=0;s<CHECK_STREAMS;++s) {
+				in[s] = input[s] + pos*2;
+				out[s] = actual[s] + pos*2;
+				crossfeed_filter(&single[s], in[s], expected[s] + pos*2, n);
+			}
+			crossfeed_filter_streams(batched, CHECK_STREAMS, in, out, n);
+			pos += n;
+		}
+		for(unsigned int s=0;s<CHECK_STREAMS;++s) {
+			if(memcmp(expected[s], actual[s], sizeof(actual[s]))) {
+				fprintf(stderr, "streams: isa %s stream %u differs from crossfeed_filter\n",
+				        crossfeed_isa_name(isa), s);
+				failed = 1;
+			}
+			crossfeed_destroy(&batched[s]);
+			crossfeed_destroy(&single[s]);
+		}
+	}
+	crossfeed_set_isa(CROSSFEED_ISA_AUTO);
+	return failed ? -1 : 0;
+}
+
+/* The right channel's response to an impulse on the left, so the crossfeed alone */
+static int crossfeed_impulse(int samplerate, float *impulse) {
+	static float buffer[CHECK_IMPULSE*2];
+	crossfeed_t filter;
+	if(crossfeed_init(&filter, samplerate))
+		return -1;
+	memset(buffer, 0, sizeof(buffer));
+	buffer[0] = 1;
+	crossfeed_filter(&filter, buffer, buffer, CHECK_IMPULSE);
+	crossfeed_destroy(&filter);
+	for(unsigned int i=0;i<CHECK_IMPULSE;++i) {
+		impulse[i] = buffer[i*2+1];
+	}
+	return 0;
+}
+
+/* Gain in dB of impulse at freq, and its phase delay in microseconds */
+static double impulse_gain(const float *impulse, double freq, int samplerate, double *delay) {
+	double re = 0, im = 0;
+	for(unsigned int t=0;t<CHECK_IMPULSE;++t) {
+		re += impulse[t] * cos(2 * M_PI * freq * t / samplerate);
+		im -= impulse[t] * sin(2 * M_PI * freq * t / samplerate);
+	}
+	*delay = -atan2(im, re) / (2 * M_PI * freq) * 1e6;
+	return 10 * log10(re*re + im*im);
+}
+
+/*
+ * Loads each store written by designer, of kernels or of biquad cascades,
+ * and checks that it crossfeeds each rate like the built-in kernel: within
+ * CHECK_STORE_DB of its gain an octave apart from 50Hz to 10kHz, and within
+ * CHECK_STORE_US of its delay at 50Hz. Anything fitted to the wrong
+ * response would widen the image or comb filter it instead.
+ */
+static int check_stores(char *const *paths, unsigned int count) {
+	static const int rates[3] = {44100, 48000, 96000};
+	static float builtin[3][CHECK_IMPULSE], stored[CHECK_IMPULSE];
+	int failed = 0;
+	/* a loaded store stays loaded, so the built-in kernels have to go first */
+	for(unsigned int r=0;r<3;++r) {
+		if(crossfeed_impulse(rates[r], builtin[r])) {
+			fprintf(stderr, "store: no built-in kernel for %d Hz\n", rates[r]);
+			return -1;
+		}
+	}
+	for(unsigned int p=0;p<count;++p) {
+		if(crossfeed_load_kernels(paths[p])) {
+			fprintf(stderr, "store: can't load `%s'\n", paths[p]);
+			failed = 1;
+			continue;
+		}
+		for(unsigned int r=0;r<3;++r) {
+			double builtin_delay, stored_delay;
+			if(crossfeed_impulse(rates[r], stored)) {
+				fprintf(stderr, "store: `%s' fails to init %d Hz\n", paths[p], rates[r]);
+				failed = 1;
+				continue;
+			}
+			if(!memcmp(builtin[r], stored, sizeof(stored))) {
+				fprintf(stderr, "store: `%s' has nothing for %d Hz\n", paths[p], rates[r]);
+				failed = 1;
+				continue;
+			}
+			for(double freq = 50;freq <= 10000;freq *= 2) {
+				const double expected = impulse_gain(builtin[r], freq, rates[r], &builtin_delay);
+				const double gain = impulse_gain(stored, freq, rates[r], &stored_delay);
+				if(fabs(gain - expected) > CHECK_STORE_DB) {
+					fprintf(stderr, "store: `%s' crossfeeds %d Hz by %.1f dB at %.0f Hz, "
+					        "not %.1f dB\n", paths[p], rates[r], gain, freq, expected);
+					failed = 1;
+				}
+				if(freq == 50 && fabs(stored_delay - builtin_delay) > CHECK_STORE_US) {
+					fprintf(stderr, "store: `%s' crossfeeds %d Hz %.0f us late, not %.0f us\n",
+					        paths[p], rates[r], stored_delay, builtin_delay);
+					failed = 1;
+				}
+			}
+		}
+	}
+	return failed ? -1 : 0;
+}
+
+/* Any arguments are stores from designer to check after everything else */
+int main(int argc, char *argv[]) {
+	int failed = 0;
+	failed |= check_isa();
+	failed |= check_long_kernel();
+	failed |= check_streams();
+	failed |= check_iir_controls();
+	failed |= check_convert_gain();
+	if(argc > 1)
+		failed |= check_stores(argv + 1, argc - 1);
+	printf("%s\n", failed ? "FAILED" : "ok");
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2013 Jeremy Pepper
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of crossfeed nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "crossfeed.hpp"
+
+#define CHECK_FRAMES 4000
+
+/* Frames per call, uneven so that calls split blocks in different places */
+static const unsigned int check_sizes[] = {1, 37, 256, 300, 1000};
+
+static float check_input[CHECK_FRAMES*2];
+
+/*
+ * Runs the built-in kernel for samplerate through engine<Taps> and through
+ * crossfeed_filter, a different number of frames per call, and checks the
+ * two are identical.
+ */
+template<unsigned int Taps>
+static int check_float(int samplerate) {
+	static float expected[CHECK_FRAMES*2], actual[CHECK_FRAMES*2];
+	crossfeed::engine<Taps> engine;
+	crossfeed_t filter;
+	unsigned int pos = 0;
+	if(crossfeed_init(&filter, samplerate) || engine.init(filter)) {
+		fprintf(stderr, "%d Hz: init failed\n", samplerate);
+		return -1;
+	}
+	crossfeed_filter(&filter, check_input, expected, CHECK_FRAMES);
+	for(unsigned int i=0;pos<CHECK_FRAMES;++i) {
+		unsigned int n = check_sizes[i % (sizeof(check_sizes) / sizeof(check_sizes[0]))];
+		n = n < CHECK_FRAMES - pos ? n : CHECK_FRAMES - pos;
+		engine.process(check_input + pos*2, actual + pos*2, n);
+		pos += n;
+	}
+	crossfeed_destroy(&filter);
+	if(memcmp(expected, actual, sizeof(actual))) {
+		fprintf(stderr, "%d Hz: %u taps differ from crossfeed_filter\n", samplerate, Taps);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Runs samples of SampleT through an engine and checks the output is the
+ * float engine's on the same samples, converted by sample_traits.
+ */
+template<typename SampleT>
+static int check_samples(const char *name) {
+	typedef crossfeed::sample_traits<SampleT> traits;
+	static SampleT input[CHECK_FRAMES*2], actual[CHECK_FRAMES*2];
+	static float loaded[CHECK_FRAMES*2], expected[CHECK_FRAMES*2];
+	crossfeed::engine_96000<SampleT> engine;
+	crossfeed::engine_96000<float> reference;
+	crossfeed_t filter;
+	if(crossfeed_init(&filter, 96000) || engine.init(filter) || reference.init(filter)) {
+		fprintf(stderr, "%s: init failed\n", name);
+		return -1;
+	}
+	crossfeed_destroy(&filter);
+	for(unsigned int i=0;i<CHECK_FRAMES*2;++i) {
+		input[i] = traits::store(check_input[i]);
+		loaded[i] = traits::load(input[i]);
+	}
+	engine.process(input, actual, CHECK_FRAMES);
+	reference.process(loaded, expected, CHECK_FRAMES);
+	for(unsigned int i=0;i<CHECK_FRAMES*2;++i) {
+		if(actual[i] != traits::store(expected[i])) {
+			fprintf(stderr, "%s: sample %u differs\n", name, i);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int main(void) {
+	int failed = 0;
+	srand(3);
+	/* a little over full scale, so that integer output clips */
+	for(unsigned int i=0;i<CHECK_FRAMES*2;++i) {
+		check_input[i] = rand() / (float)RAND_MAX * 2.4f - 1.2f;
+	}
+	failed |= check_float<CROSSFEED_TAPS_44100>(44100);
+	failed |= check_float<CROSSFEED_TAPS_48000>(48000);
+	failed |= check_float<CROSSFEED_TAPS_96000>(96000);
+	failed |= check_samples<float>("float");
+	failed |= check_samples<double>("double");
+	failed |= check_samples<int16_t>("int16_t");
+	failed |= check_samples<int32_t>("int32_t");
+	printf("%s\n", failed ? "FAILED" : "ok");
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -35,8 +35,14 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <limits.h>
+#include <unistd.h>
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#ifdef __APPLE__
 #include <CoreFoundation/CoreFoundation.h>
 #include <AudioToolbox/AudioToolbox.h>
+#endif
 #include <vector>
 #include <string>
 #include "cautil.h"
@@ -55,14 +61,14 @@ public:
 				char buf[PATH_MAX];
 				DIR *dir = opendir(file);
 				if(dir) {
-					struct dirent ent, *result;
-					while(!readdir_r(dir, &ent, &result) && result) {
-						if(strcmp(".", ent.d_name) == 0 ||
-						   strcmp("..", ent.d_name) == 0 ||
-						   strcmp(".DS_Store", ent.d_name) == 0 ||
-						   strncmp("._", ent.d_name, 2) == 0)
+					struct dirent *ent;
+					while((ent = readdir(dir))) {
+						if(strcmp(".", ent->d_name) == 0 ||
+						   strcmp("..", ent->d_name) == 0 ||
+						   strcmp(".DS_Store", ent->d_name) == 0 ||
+						   strncmp("._", ent->d_name, 2) == 0)
 							continue;
-						snprintf(buf, PATH_MAX, "%s/%s", file, ent.d_name);
+						snprintf(buf, PATH_MAX, "%s/%s", file, ent->d_name);
 						add(buf);
 					}
 					closedir(dir);
@@ -100,6 +106,13 @@ static float scale = 1;
 
 static crossfeed_t crossfeed;
 
+static struct Player player;
+#ifndef __APPLE__
+static int sim_samplerate = 44100;
+static unsigned int sim_buffer_frames = 512;
+static int sim_realtime = 1;
+#endif
+
 static message_queue cmq, acmq;
 
 static struct termios t_orig_params, t_params;
@@ -107,6 +120,7 @@ static struct termios t_orig_params, t_params;
 static void set_volume(float volume) {
 	scale_db = volume;
 	scale = pow(10, scale_db/20);
+	crossfeed_set_gain(&crossfeed, scale);
 }
 
 static void tell(message_queue *queue, char c) {
@@ -129,6 +143,9 @@ static void console_reset() {
 static void *conio_threadproc(void *data) {
 	while(true) {
 		int r = getchar();
+		/* without a terminal, keep playing until the playlist runs out */
+		if(r == EOF && !isatty(0))
+			break;
 		char c = r == EOF ? 'q' : r;
 		tell(&cmq, c);
 	}
@@ -139,10 +156,6 @@ static void event_handler(struct PlayerEvent *evt) {
 	switch(evt->type) {
 	case PlayerEvent::PLAYER_RENDER:
 		crossfeed_filter_inplace_noninterleaved(&crossfeed, evt->left, evt->right, evt->size);
-		for(unsigned int i=0;i<evt->size;++i) {
-			evt->left[i] *= scale;
-			evt->right[i] *= scale;
-		}
 		break;
 	case PlayerEvent::PLAYER_DONE:
 		tell(&acmq, '>');
@@ -169,13 +182,20 @@ static void play_next(Player *player, playlist *pl) {
 
 static void play_prev(Player *player, playlist *pl) {
 	const char *file = pl->prev();
+	if(!file) {
+		play_next(player, pl);
+		return;
+	}
 	fprintf(stderr, "Playing `%s'...\r\n", file);
-	CAPlayFile(player, file);
+	if(CAPlayFile(player, file)) {
+		fprintf(stderr, "Error playing `%s'\r\n", file);
+		pl->erase_current();
+		play_next(player, pl);
+	}
 }
 
 
 static void *audio_threadproc(void *data) {
-	struct Player player;
 	playlist *pl = (playlist *)data;
 	const char *file;
 	bool running = true;
@@ -183,10 +203,14 @@ static void *audio_threadproc(void *data) {
 		fprintf(stderr, "Error initializing audio output\n");
 		goto e_done;
 	}
+#ifndef __APPLE__
+	CAConfigureSimulation(&player, sim_samplerate, sim_buffer_frames, sim_realtime);
+#endif
 	if(crossfeed_init(&crossfeed, player.samplerate)) {
 		fprintf(stderr, "Filter not available for %dHz\n", player.samplerate);
 		goto e_destroy_player;
 	}
+	crossfeed_set_gain(&crossfeed, scale);
 	play_next(&player, pl);
 	while(running) {
 		char *msg = (char *)message_queue_read(&acmq);
@@ -206,7 +230,9 @@ static void *audio_threadproc(void *data) {
 			break;
 		}
 	}
+	/* the render thread may still be using the filter */
 	CADestroyPlayer(&player);
+	crossfeed_destroy(&crossfeed);
 	return data;
 e_destroy_player:
 	CADestroyPlayer(&player);
@@ -220,7 +246,14 @@ int main(int argc, char *argv[]) {
 	pthread_t conio, audio;
 	bool running = true;
 	if(argc < 2) {
+#ifdef __APPLE__
 		fprintf(stderr, "Usage: %s [-s] [-g dBFS] /foo/bar\n", argc == 1 ? argv[0] : "crossfeed-player");
+#else
+		fprintf(stderr, "Usage: %s [-s] [-g dBFS] [-r rate] [-b frames] [-x] /foo/bar\n"
+		        "  -r, -b  sample rate and buffer size of the simulated output device\n"
+		        "  -x      render as fast as possible instead of in real time\n",
+		        argc == 1 ? argv[0] : "crossfeed-player");
+#endif
 		return EXIT_FAILURE;
 	}
 	for(int i = 1; i < argc; ++i) {
@@ -230,6 +263,26 @@ int main(int argc, char *argv[]) {
 			set_volume(atof(argv[i]));
 		} else if(strcmp("-s", argv[i]) == 0) {
 			playlist.shuffle();
+#ifndef __APPLE__
+		} else if(strcmp("-r", argv[i]) == 0) {
+			if(++i >= argc)
+				break;
+			sim_samplerate = atoi(argv[i]);
+			if(sim_samplerate <= 0) {
+				fprintf(stderr, "Bad sample rate `%s'\n", argv[i]);
+				return EXIT_FAILURE;
+			}
+		} else if(strcmp("-b", argv[i]) == 0) {
+			if(++i >= argc)
+				break;
+			if(atoi(argv[i]) <= 0) {
+				fprintf(stderr, "Bad buffer size `%s'\n", argv[i]);
+				return EXIT_FAILURE;
+			}
+			sim_buffer_frames = atoi(argv[i]);
+		} else if(strcmp("-x", argv[i]) == 0) {
+			sim_realtime = 0;
+#endif
 		} else {
 			playlist.add(argv[i]);
 		}
@@ -259,8 +312,8 @@ int main(int argc, char *argv[]) {
 			tell(&acmq, c);
 			break;
 		case 'c':
-			crossfeed.bypass = crossfeed.bypass ? 0 : 1;
-			fprintf(stderr, "XFeed: %s    \r", crossfeed.bypass ? "Off" : "On");
+			crossfeed_set_bypass(&crossfeed, !crossfeed_get_bypass(&crossfeed));
+			fprintf(stderr, "XFeed: %s    \r", crossfeed_get_bypass(&crossfeed) ? "Off" : "On");
 			break;
 		}
 	}
@@ -268,6 +321,9 @@ int main(int argc, char *argv[]) {
 	pthread_detach(conio);
 	console_reset();
 	pthread_join(audio, NULL);
+#ifndef __APPLE__
+	CAPrintTiming(&player, stderr);
+#endif
 	message_queue_destroy(&acmq);
 	message_queue_destroy(&cmq);
 	return EXIT_SUCCESS;
@@ -28,74 +28,1385 @@
  */
 
 #include "crossfeed.h"
+#include "fft.h"
+#include "kernel_design.h"
+#include "kernel_store.h"
+#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <math.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CROSSFEED_X86
+#define CROSSFEED_TARGET(isa) __attribute__((target(isa)))
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define CROSSFEED_NEON
+#endif
 
-static const float kernel_96k[] = {
+static const float kernel_96k[CROSSFEED_TAPS_96000] = {
 	1-0.0073856832, -0.0075194174, -0.0077223326, -0.0078906622, -0.0081646387, -0.0083914027, -0.0087819435, -0.0091153709, -0.0097044604, -0.010244164, -0.01120129, -0.012166876, -0.013881951, -0.015828054, -0.019321838, -0.023897322, -0.032408956, -0.045482289, -0.070983656, -0.11206752, -0.16362341, -0.12102993
 };
 
-static const float kernel_48k[] = {
+static const float kernel_48k[CROSSFEED_TAPS_48000] = {
 	1-0.013584239, -0.014855062, -0.01510927, -0.017407341, -0.018212127, -0.023438375, -0.027174231, -0.044839676, -0.071772039, -0.19203754, -0.27824146
 };
 
-static const float kernel_44k[] = {
+static const float kernel_44k[CROSSFEED_TAPS_44100] = {
 	1-0.015422851, -0.0155861, -0.017845599, -0.018381938, -0.02341632, -0.026318349, -0.043148093, -0.066815346, -0.18979733, -0.29786113
 };
 
-int crossfeed_init(crossfeed_t *filter, int samplerate) {
+/*
+ * All FIR kernels compute oside[i] = sum(side[i - t*stride] * kernel[t]) for
+ * t = 0..len-1, accumulating the taps in order with separate multiplies and
+ * adds, so every implementation produces bit-identical output. The SIMD
+ * versions compute several consecutive outputs per vector instead of
+ * reducing across taps. A stride above 1 filters that many interleaved
+ * streams at once.
+ *
+ * The SIMD implementations are written as always-inlined bodies, and
+ * FIR_SPECIALIZE wraps each in a function that instantiates it with the
+ * built-in kernels' tap counts as constants, so that the tap loop unrolls
+ * completely and the coefficients can stay in registers across the block.
+ * Other lengths and strides run the generic instantiation. The scalar
+ * version is left generic, as unrolling it only slows it down. The wrappers
+ * are never inlined, since the AVX2 one would otherwise be inlined into the
+ * AVX-512 one for its tail, where FMA is enabled and its multiplies and adds
+ * would be contracted.
+ */
+#define FIR_SPECIALIZE_LEN(name, stride) \
+	switch(len) { \
+	case CROSSFEED_TAPS_44100: \
+		name##_body(side, kernel, CROSSFEED_TAPS_44100, stride, oside, size); \
+		return; \
+	case CROSSFEED_TAPS_48000: \
+		name##_body(side, kernel, CROSSFEED_TAPS_48000, stride, oside, size); \
+		return; \
+	case CROSSFEED_TAPS_96000: \
+		name##_body(side, kernel, CROSSFEED_TAPS_96000, stride, oside, size); \
+		return; \
+	}
+
+#define FIR_SPECIALIZE(name, target) \
+	target __attribute__((noinline)) static void name(const float *side, const float *kernel, unsigned int len, \
+	                        unsigned int stride, float *oside, unsigned int size) { \
+		if(stride == 1) { \
+			FIR_SPECIALIZE_LEN(name, 1) \
+		} else if(stride == CROSSFEED_STREAM_LANES) { \
+			FIR_SPECIALIZE_LEN(name, CROSSFEED_STREAM_LANES) \
+		} \
+		name##_body(side, kernel, len, stride, oside, size); \
+	}
+
+static void fir_scalar(const float *side, const float *kernel, unsigned int len,
+                       unsigned int stride, float *oside, unsigned int size) {
+	for(unsigned int i=0;i<size;++i) {
+		oside[i] = 0;
+	}
+	for(unsigned int t=0;t<len;++t) {
+		const float *x = side - t*stride;
+		const float c = kernel[t];
+		for(unsigned int i=0;i<size;++i) {
+			oside[i] += x[i] * c;
+		}
+	}
+}
+
+static void split_scalar(const float *input, float *mid, float *side, unsigned int size) {
+	for(unsigned int i=0;i<size;++i) {
+		mid[i] = (input[i*2] + input[i*2+1]) / 2;
+		side[i] = (input[i*2] - input[i*2+1]) / 2;
+	}
+}
+
+static void merge_scalar(const float *mid, const float *oside, float *output, unsigned int size) {
+	for(unsigned int i=0;i<size;++i) {
+		output[i*2] = mid[i] + oside[i];
+		output[i*2+1] = mid[i] - oside[i];
+	}
+}
+
+/*
+ * Moves a block of interleaved stereo frames between each stream's buffer
+ * and the mid/side buffers, where streams are interleaved sample by sample.
+ * These are always inlined so the full-width versions get a constant lane
+ * count.
+ */
+static inline __attribute__((always_inline))
+void lanes_split(float *const *input, float *mid, float *side, unsigned int lanes,
+                 unsigned int size) {
+	for(unsigned int i=0;i<size;++i) {
+		for(unsigned int s=0;s<lanes;++s) {
+			mid[i*lanes + s] = (input[s][i*2] + input[s][i*2+1]) / 2;
+			side[i*lanes + s] = (input[s][i*2] - input[s][i*2+1]) / 2;
+		}
+	}
+}
+
+static inline __attribute__((always_inline))
+void lanes_merge(const float *mid, const float *oside, float *const *output, unsigned int lanes,
+                 unsigned int size) {
+	for(unsigned int i=0;i<size;++i) {
+		for(unsigned int s=0;s<lanes;++s) {
+			output[s][i*2] = mid[i*lanes + s] + oside[i*lanes + s];
+			output[s][i*2+1] = mid[i*lanes + s] - oside[i*lanes + s];
+		}
+	}
+}
+
+static void split_lanes_scalar(float *const *input, float *mid, float *side, unsigned int size) {
+	lanes_split(input, mid, side, CROSSFEED_STREAM_LANES, size);
+}
+
+static void merge_lanes_scalar(const float *mid, const float *oside, float *const *output,
+                               unsigned int size) {
+	lanes_merge(mid, oside, output, CROSSFEED_STREAM_LANES, size);
+}
+
+#ifdef CROSSFEED_X86
+CROSSFEED_TARGET("sse2")
+static inline __attribute__((always_inline))
+void fir_sse2_body(const float *side, const float *kernel, unsigned int len,
+                   unsigned int stride, float *oside, unsigned int size) {
+	unsigned int i = 0;
+	for(;i+8<=size;i+=8) {
+		__m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+		for(unsigned int t=0;t<len;++t) {
+			const float *x = side + i - t*stride;
+			const __m128 c = _mm_set1_ps(kernel[t]);
+			acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(x), c));
+			acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(x + 4), c));
+		}
+		_mm_storeu_ps(oside + i, acc0);
+		_mm_storeu_ps(oside + i + 4, acc1);
+	}
+	fir_scalar(side + i, kernel, len, stride, oside + i, size - i);
+}
+
+FIR_SPECIALIZE(fir_sse2, CROSSFEED_TARGET("sse2"))
+
+CROSSFEED_TARGET("sse2")
+static void split_sse2(const float *input, float *mid, float *side, unsigned int size) {
+	const __m128 half = _mm_set1_ps(0.5f);
+	unsigned int i = 0;
+	for(;i+4<=size;i+=4) {
+		const __m128 a = _mm_loadu_ps(input + i*2);
+		const __m128 b = _mm_loadu_ps(input + i*2 + 4);
+		const __m128 l = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+		const __m128 r = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+		_mm_storeu_ps(mid + i, _mm_mul_ps(_mm_add_ps(l, r), half));
+		_mm_storeu_ps(side + i, _mm_mul_ps(_mm_sub_ps(l, r), half));
+	}
+	split_scalar(input + i*2, mid + i, side + i, size - i);
+}
+
+CROSSFEED_TARGET("sse2")
+static void merge_sse2(const float *mid, const float *oside, float *output, unsigned int size) {
+	unsigned int i = 0;
+	for(;i+4<=size;i+=4) {
+		const __m128 m = _mm_loadu_ps(mid + i);
+		const __m128 s = _mm_loadu_ps(oside + i);
+		const __m128 l = _mm_add_ps(m, s);
+		const __m128 r = _mm_sub_ps(m, s);
+		_mm_storeu_ps(output + i*2, _mm_unpacklo_ps(l, r));
+		_mm_storeu_ps(output + i*2 + 4, _mm_unpackhi_ps(l, r));
+	}
+	merge_scalar(mid + i, oside + i, output + i*2, size - i);
+}
+
+/*
+ * Eight streams as two groups of four, four frames at a time: each stream's
+ * frames are deinterleaved as in split_sse2, and a 4x4 transpose turns four
+ * streams' vectors into one vector of those streams per frame.
+ */
+CROSSFEED_TARGET("sse2")
+static void split_lanes_sse2(float *const *input, float *mid, float *side, unsigned int size) {
+	const __m128 half = _mm_set1_ps(0.5f);
+	unsigned int i = 0;
+	for(;i+4<=size;i+=4) {
+		for(unsigned int g=0;g<8;g+=4) {
+			__m128 m[4], d[4];
+			for(unsigned int s=0;s<4;++s) {
+				const __m128 a = _mm_loadu_ps(input[g+s] + i*2);
+				const __m128 b = _mm_loadu_ps(input[g+s] + i*2 + 4);
+				const __m128 l = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+				const __m128 r = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+				m[s] = _mm_mul_ps(_mm_add_ps(l, r), half);
+				d[s] = _mm_mul_ps(_mm_sub_ps(l, r), half);
+			}
+			_MM_TRANSPOSE4_PS(m[0], m[1], m[2], m[3]);
+			_MM_TRANSPOSE4_PS(d[0], d[1], d[2], d[3]);
+			for(unsigned int f=0;f<4;++f) {
+				_mm_storeu_ps(mid + (i + f)*8 + g, m[f]);
+				_mm_storeu_ps(side + (i + f)*8 + g, d[f]);
+			}
+		}
+	}
+	for(;i<size;++i) {
+		for(unsigned int s=0;s<8;++s) {
+			mid[i*8 + s] = (input[s][i*2] + input[s][i*2+1]) / 2;
+			side[i*8 + s] = (input[s][i*2] - input[s][i*2+1]) / 2;
+		}
+	}
+}
+
+/* The reverse: left and right per frame are transposed back to each stream */
+CROSSFEED_TARGET("sse2")
+static void merge_lanes_sse2(const float *mid, const float *oside, float *const *output,
+                             unsigned int size) {
+	unsigned int i = 0;
+	for(;i+4<=size;i+=4) {
+		for(unsigned int g=0;g<8;g+=4) {
+			__m128 l[4], r[4];
+			for(unsigned int f=0;f<4;++f) {
+				const __m128 m = _mm_loadu_ps(mid + (i + f)*8 + g);
+				const __m128 o = _mm_loadu_ps(oside + (i + f)*8 + g);
+				l[f] = _mm_add_ps(m, o);
+				r[f] = _mm_sub_ps(m, o);
+			}
+			_MM_TRANSPOSE4_PS(l[0], l[1], l[2], l[3]);
+			_MM_TRANSPOSE4_PS(r[0], r[1], r[2], r[3]);
+			for(unsigned int s=0;s<4;++s) {
+				_mm_storeu_ps(output[g+s] + i*2, _mm_unpacklo_ps(l[s], r[s]));
+				_mm_storeu_ps(output[g+s] + i*2 + 4, _mm_unpackhi_ps(l[s], r[s]));
+			}
+		}
+	}
+	for(;i<size;++i) {
+		for(unsigned int s=0;s<8;++s) {
+			output[s][i*2] = mid[i*8 + s] + oside[i*8 + s];
+			output[s][i*2+1] = mid[i*8 + s] - oside[i*8 + s];
+		}
+	}
+}
+
+CROSSFEED_TARGET("avx2")
+static inline __attribute__((always_inline))
+void fir_avx2_body(const float *side, const float *kernel, unsigned int len,
+                   unsigned int stride, float *oside, unsigned int size) {
+	unsigned int i = 0;
+	for(;i+32<=size;i+=32) {
+		__m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+		__m256 acc2 = _mm256_setzero_ps(), acc3 = _mm256_setzero_ps();
+		for(unsigned int t=0;t<len;++t) {
+			const float *x = side + i - t*stride;
+			const __m256 c = _mm256_set1_ps(kernel[t]);
+			acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(_mm256_loadu_ps(x), c));
+			acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(_mm256_loadu_ps(x + 8), c));
+			acc2 = _mm256_add_ps(acc2, _mm256_mul_ps(_mm256_loadu_ps(x + 16), c));
+			acc3 = _mm256_add_ps(acc3, _mm256_mul_ps(_mm256_loadu_ps(x + 24), c));
+		}
+		_mm256_storeu_ps(oside + i, acc0);
+		_mm256_storeu_ps(oside + i + 8, acc1);
+		_mm256_storeu_ps(oside + i + 16, acc2);
+		_mm256_storeu_ps(oside + i + 24, acc3);
+	}
+	for(;i+8<=size;i+=8) {
+		__m256 acc = _mm256_setzero_ps();
+		for(unsigned int t=0;t<len;++t) {
+			acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(side + i - t*stride),
+			                                       _mm256_set1_ps(kernel[t])));
+		}
+		_mm256_storeu_ps(oside + i, acc);
+	}
+	fir_scalar(side + i, kernel, len, stride, oside + i, size - i);
+}
+
+FIR_SPECIALIZE(fir_avx2, CROSSFEED_TARGET("avx2"))
+
+CROSSFEED_TARGET("avx2")
+static void split_avx2(const float *input, float *mid, float *side, unsigned int size) {
+	const __m256 half = _mm256_set1_ps(0.5f);
+	unsigned int i = 0;
+	for(;i+8<=size;i+=8) {
+		const __m256 a = _mm256_loadu_ps(input + i*2);
+		const __m256 b = _mm256_loadu_ps(input + i*2 + 8);
+		/* shuffle_ps leaves the 64-bit pairs as 0 2 1 3; permute restores order */
+		const __m256 l = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(
+			_mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0))), _MM_SHUFFLE(3, 1, 2, 0)));
+		const __m256 r = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(
+			_mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))), _MM_SHUFFLE(3, 1, 2, 0)));
+		_mm256_storeu_ps(mid + i, _mm256_mul_ps(_mm256_add_ps(l, r), half));
+		_mm256_storeu_ps(side + i, _mm256_mul_ps(_mm256_sub_ps(l, r), half));
+	}
+	split_sse2(input + i*2, mid + i, side + i, size - i);
+}
+
+CROSSFEED_TARGET("avx2")
+static void merge_avx2(const float *mid, const float *oside, float *output, unsigned int size) {
+	unsigned int i = 0;
+	for(;i+8<=size;i+=8) {
+		const __m256 m = _mm256_loadu_ps(mid + i);
+		const __m256 s = _mm256_loadu_ps(oside + i);
+		const __m256 l = _mm256_add_ps(m, s);
+		const __m256 r = _mm256_sub_ps(m, s);
+		const __m256 lo = _mm256_unpacklo_ps(l, r);
+		const __m256 hi = _mm256_unpackhi_ps(l, r);
+		_mm256_storeu_ps(output + i*2, _mm256_permute2f128_ps(lo, hi, 0x20));
+		_mm256_storeu_ps(output + i*2 + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+	}
+	merge_sse2(mid + i, oside + i, output + i*2, size - i);
+}
+
+/*
+ * Eight streams, four frames at a time: hadd/hsub form l+r and l-r for two
+ * streams at once, and the shuffles transpose the result to one vector of
+ * all eight streams per frame.
+ */
+CROSSFEED_TARGET("avx2")
+static void split_lanes_avx2(float *const *input, float *mid, float *side, unsigned int size) {
+	const __m256 half = _mm256_set1_ps(0.5f);
+	unsigned int i = 0;
+	for(;i+4<=size;i+=4) {
+		__m256 a[8], m[4], d[4];
+		for(unsigned int s=0;s<8;++s) {
+			a[s] = _mm256_loadu_ps(input[s] + i*2);
+		}
+		for(unsigned int s=0;s<4;++s) {
+			m[s] = _mm256_hadd_ps(a[s*2], a[s*2+1]);
+			d[s] = _mm256_hsub_ps(a[s*2], a[s*2+1]);
+		}
+		const __m256 m0 = _mm256_shuffle_ps(m[0], m[1], _MM_SHUFFLE(2, 0, 2, 0));
+		const __m256 m1 = _mm256_shuffle_ps(m[0], m[1], _MM_SHUFFLE(3, 1, 3, 1));
+		const __m256 m2 = _mm256_shuffle_ps(m[2], m[3], _MM_SHUFFLE(2, 0, 2, 0));
+		const __m256 m3 = _mm256_shuffle_ps(m[2], m[3], _MM_SHUFFLE(3, 1, 3, 1));
+		const __m256 d0 = _mm256_shuffle_ps(d[0], d[1], _MM_SHUFFLE(2, 0, 2, 0));
+		const __m256 d1 = _mm256_shuffle_ps(d[0], d[1], _MM_SHUFFLE(3, 1, 3, 1));
+		const __m256 d2 = _mm256_shuffle_ps(d[2], d[3], _MM_SHUFFLE(2, 0, 2, 0));
+		const __m256 d3 = _mm256_shuffle_ps(d[2], d[3], _MM_SHUFFLE(3, 1, 3, 1));
+		_mm256_storeu_ps(mid + i*8, _mm256_mul_ps(_mm256_permute2f128_ps(m0, m2, 0x20), half));
+		_mm256_storeu_ps(mid + i*8 + 8, _mm256_mul_ps(_mm256_permute2f128_ps(m1, m3, 0x20), half));
+		_mm256_storeu_ps(mid + i*8 + 16, _mm256_mul_ps(_mm256_permute2f128_ps(m0, m2, 0x31), half));
+		_mm256_storeu_ps(mid + i*8 + 24, _mm256_mul_ps(_mm256_permute2f128_ps(m1, m3, 0x31), half));
+		_mm256_storeu_ps(side + i*8, _mm256_mul_ps(_mm256_permute2f128_ps(d0, d2, 0x20), half));
+		_mm256_storeu_ps(side + i*8 + 8, _mm256_mul_ps(_mm256_permute2f128_ps(d1, d3, 0x20), half));
+		_mm256_storeu_ps(side + i*8 + 16, _mm256_mul_ps(_mm256_permute2f128_ps(d0, d2, 0x31), half));
+		_mm256_storeu_ps(side + i*8 + 24, _mm256_mul_ps(_mm256_permute2f128_ps(d1, d3, 0x31), half));
+	}
+	for(;i<size;++i) {
+		for(unsigned int s=0;s<8;++s) {
+			mid[i*8 + s] = (input[s][i*2] + input[s][i*2+1]) / 2;
+			side[i*8 + s] = (input[s][i*2] - input[s][i*2+1]) / 2;
+		}
+	}
+}
+
+/* An 8x8 transpose of rows l0 r0 l1 r1 l2 r2 l3 r3 into one vector per stream */
+CROSSFEED_TARGET("avx2")
+static void merge_lanes_avx2(const float *mid, const float *oside, float *const *output,
+                             unsigned int size) {
+	unsigned int i = 0;
+	for(;i+4<=size;i+=4) {
+		__m256 r[8], t[8], u[8];
+		for(unsigned int f=0;f<4;++f) {
+			const __m256 m = _mm256_loadu_ps(mid + (i + f)*8);
+			const __m256 o = _mm256_loadu_ps(oside + (i + f)*8);
+			r[f*2] = _mm256_add_ps(m, o);
+			r[f*2+1] = _mm256_sub_ps(m, o);
+		}
+		for(unsigned int k=0;k<8;k+=2) {
+			t[k] = _mm256_unpacklo_ps(r[k], r[k+1]);
+			t[k+1] = _mm256_unpackhi_ps(r[k], r[k+1]);
+		}
+		for(unsigned int k=0;k<8;k+=4) {
+			u[k] = _mm256_shuffle_ps(t[k], t[k+2], _MM_SHUFFLE(1, 0, 1, 0));
+			u[k+1] = _mm256_shuffle_ps(t[k], t[k+2], _MM_SHUFFLE(3, 2, 3, 2));
+			u[k+2] = _mm256_shuffle_ps(t[k+1], t[k+3], _MM_SHUFFLE(1, 0, 1, 0));
+			u[k+3] = _mm256_shuffle_ps(t[k+1], t[k+3], _MM_SHUFFLE(3, 2, 3, 2));
+		}
+		for(unsigned int s=0;s<4;++s) {
+			_mm256_storeu_ps(output[s] + i*2, _mm256_permute2f128_ps(u[s], u[s+4], 0x20));
+			_mm256_storeu_ps(output[s+4] + i*2, _mm256_permute2f128_ps(u[s], u[s+4], 0x31));
+		}
+	}
+	for(;i<size;++i) {
+		for(unsigned int s=0;s<8;++s) {
+			output[s][i*2] = mid[i*8 + s] + oside[i*8 + s];
+			output[s][i*2+1] = mid[i*8 + s] - oside[i*8 + s];
+		}
+	}
+}
+
+/*
+ * GCC implements _mm512_add_ps/_mm512_mul_ps as plain vector arithmetic, which
+ * it will contract into FMAs under avx512f. The explicit-rounding forms keep
+ * the multiply and add separate.
+ */
+#define avx512_add(a, b) _mm512_add_round_ps((a), (b), _MM_FROUND_CUR_DIRECTION)
+#define avx512_mul(a, b) _mm512_mul_round_ps((a), (b), _MM_FROUND_CUR_DIRECTION)
+
+CROSSFEED_TARGET("avx512f")
+static inline __attribute__((always_inline))
+void fir_avx512_body(const float *side, const float *kernel, unsigned int len,
+                     unsigned int stride, float *oside, unsigned int size) {
+	unsigned int i = 0;
+	for(;i+64<=size;i+=64) {
+		__m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+		__m512 acc2 = _mm512_setzero_ps(), acc3 = _mm512_setzero_ps();
+		for(unsigned int t=0;t<len;++t) {
+			const float *x = side + i - t*stride;
+			const __m512 c = _mm512_set1_ps(kernel[t]);
+			acc0 = avx512_add(acc0, avx512_mul(_mm512_loadu_ps(x), c));
+			acc1 = avx512_add(acc1, avx512_mul(_mm512_loadu_ps(x + 16), c));
+			acc2 = avx512_add(acc2, avx512_mul(_mm512_loadu_ps(x + 32), c));
+			acc3 = avx512_add(acc3, avx512_mul(_mm512_loadu_ps(x + 48), c));
+		}
+		_mm512_storeu_ps(oside + i, acc0);
+		_mm512_storeu_ps(oside + i + 16, acc1);
+		_mm512_storeu_ps(oside + i + 32, acc2);
+		_mm512_storeu_ps(oside + i + 48, acc3);
+	}
+	for(;i+16<=size;i+=16) {
+		__m512 acc = _mm512_setzero_ps();
+		for(unsigned int t=0;t<len;++t) {
+			acc = avx512_add(acc, avx512_mul(_mm512_loadu_ps(side + i - t*stride),
+			                                 _mm512_set1_ps(kernel[t])));
+		}
+		_mm512_storeu_ps(oside + i, acc);
+	}
+	fir_avx2(side + i, kernel, len, stride, oside + i, size - i);
+}
+FIR_SPECIALIZE(fir_avx512, CROSSFEED_TARGET("avx512f"))
+
+#endif
+
+#ifdef CROSSFEED_NEON
+static inline __attribute__((always_inline))
+void fir_neon_body(const float *side, const float *kernel, unsigned int len,
+                   unsigned int stride, float *oside, unsigned int size) {
+	unsigned int i = 0;
+	for(;i+16<=size;i+=16) {
+		float32x4_t acc0 = vdupq_n_f32(0), acc1 = vdupq_n_f32(0);
+		float32x4_t acc2 = vdupq_n_f32(0), acc3 = vdupq_n_f32(0);
+		for(unsigned int t=0;t<len;++t) {
+			const float *x = side + i - t*stride;
+			const float32x4_t c = vdupq_n_f32(kernel[t]);
+			acc0 = vaddq_f32(acc0, vmulq_f32(vld1q_f32(x), c));
+			acc1 = vaddq_f32(acc1, vmulq_f32(vld1q_f32(x + 4), c));
+			acc2 = vaddq_f32(acc2, vmulq_f32(vld1q_f32(x + 8), c));
+			acc3 = vaddq_f32(acc3, vmulq_f32(vld1q_f32(x + 12), c));
+		}
+		vst1q_f32(oside + i, acc0);
+		vst1q_f32(oside + i + 4, acc1);
+		vst1q_f32(oside + i + 8, acc2);
+		vst1q_f32(oside + i + 12, acc3);
+	}
+	fir_scalar(side + i, kernel, len, stride, oside + i, size - i);
+}
+
+FIR_SPECIALIZE(fir_neon, )
+
+static void split_neon(const float *input, float *mid, float *side, unsigned int size) {
+	const float32x4_t half = vdupq_n_f32(0.5f);
+	unsigned int i = 0;
+	for(;i+4<=size;i+=4) {
+		const float32x4x2_t lr = vld2q_f32(input + i*2);
+		vst1q_f32(mid + i, vmulq_f32(vaddq_f32(lr.val[0], lr.val[1]), half));
+		vst1q_f32(side + i, vmulq_f32(vsubq_f32(lr.val[0], lr.val[1]), half));
+	}
+	split_scalar(input + i*2, mid + i, side + i, size - i);
+}
+
+static void merge_neon(const float *mid, const float *oside, float *output, unsigned int size) {
+	unsigned int i = 0;
+	for(;i+4<=size;i+=4) {
+		const float32x4_t m = vld1q_f32(mid + i);
+		const float32x4_t s = vld1q_f32(oside + i);
+		float32x4x2_t lr;
+		lr.val[0] = vaddq_f32(m, s);
+		lr.val[1] = vsubq_f32(m, s);
+		vst2q_f32(output + i*2, lr);
+	}
+	merge_scalar(mid + i, oside + i, output + i*2, size - i);
+}
+#endif
+
+static const struct crossfeed_ops crossfeed_ops[] = {
+	[CROSSFEED_ISA_SCALAR] = {CROSSFEED_ISA_SCALAR, fir_scalar, split_scalar, merge_scalar,
+	                          split_lanes_scalar, merge_lanes_scalar},
+#ifdef CROSSFEED_X86
+	[CROSSFEED_ISA_SSE2] = {CROSSFEED_ISA_SSE2, fir_sse2, split_sse2, merge_sse2,
+	                        split_lanes_sse2, merge_lanes_sse2},
+	[CROSSFEED_ISA_AVX2] = {CROSSFEED_ISA_AVX2, fir_avx2, split_avx2, merge_avx2,
+	                        split_lanes_avx2, merge_lanes_avx2},
+	[CROSSFEED_ISA_AVX512] = {CROSSFEED_ISA_AVX512, fir_avx512, split_avx2, merge_avx2,
+	                          split_lanes_avx2, merge_lanes_avx2},
+#endif
+#ifdef CROSSFEED_NEON
+	[CROSSFEED_ISA_NEON] = {CROSSFEED_ISA_NEON, fir_neon, split_neon, merge_neon, NULL, NULL},
+#endif
+};
+
+static enum crossfeed_isa forced_isa = CROSSFEED_ISA_AUTO;
+
+int crossfeed_isa_supported(enum crossfeed_isa isa) {
+	switch(isa) {
+	case CROSSFEED_ISA_AUTO:
+	case CROSSFEED_ISA_SCALAR:
+		return 1;
+#ifdef CROSSFEED_X86
+	case CROSSFEED_ISA_SSE2:
+		return __builtin_cpu_supports("sse2");
+	case CROSSFEED_ISA_AVX2:
+		return __builtin_cpu_supports("avx2");
+	case CROSSFEED_ISA_AVX512:
+		return __builtin_cpu_supports("avx512f");
+#endif
+#ifdef CROSSFEED_NEON
+	case CROSSFEED_ISA_NEON:
+		return 1;
+#endif
+	default:
+		return 0;
+	}
+}
+
+const char *crossfeed_isa_name(enum crossfeed_isa isa) {
+	static const char *names[] = {"auto", "scalar", "sse2", "avx2", "avx512", "neon"};
+	return (unsigned int)isa < sizeof(names)/sizeof(names[0]) ? names[isa] : "unknown";
+}
+
+int crossfeed_set_isa(enum crossfeed_isa isa) {
+	if(!crossfeed_isa_supported(isa))
+		return -1;
+	forced_isa = isa;
+	return 0;
+}
+
+static const struct crossfeed_ops *crossfeed_select_ops(void) {
+	enum crossfeed_isa isa = forced_isa;
+	if(isa == CROSSFEED_ISA_AUTO) {
+		for(isa = CROSSFEED_ISA_NEON; isa > CROSSFEED_ISA_SCALAR; --isa) {
+			if(crossfeed_isa_supported(isa))
+				break;
+		}
+	}
+	return &crossfeed_ops[isa];
+}
+
+#define PARTITION CROSSFEED_MAX_LEN
+#define PARTITION_LOG2 7
+
+/*
+ * Spectra are 2*PARTITION-point real transforms in fft_real_forward's packed
+ * layout, PARTITION values each.
+ */
+struct crossfeed_fft {
+	struct fft fft;
+	unsigned int partitions;
+	unsigned int newest;
+	unsigned int phase;
+	float *kernel_re, *kernel_im;
+	float *input_re, *input_im;
+	float segment[2*PARTITION];
+	float tail[PARTITION];
+	float re[PARTITION], im[PARTITION];
+	float work[2*PARTITION];
+};
+
+static int crossfeed_fft_init(crossfeed_t *filter, const float *kernel, unsigned int len) {
+	const unsigned int partitions = (len - 1) / PARTITION;
+	struct crossfeed_fft *fft = calloc(1, sizeof(struct crossfeed_fft));
+	if(!fft)
+		return -1;
+	fft->partitions = partitions;
+	fft->kernel_re = calloc(4 * partitions * PARTITION, sizeof(float));
+	if(!fft->kernel_re || fft_init(&fft->fft, PARTITION_LOG2)) {
+		free(fft->kernel_re);
+		free(fft);
+		return -1;
+	}
+	fft->kernel_im = fft->kernel_re + partitions * PARTITION;
+	fft->input_re = fft->kernel_im + partitions * PARTITION;
+	fft->input_im = fft->input_re + partitions * PARTITION;
+	for(unsigned int p=0;p<partitions;++p) {
+		const unsigned int start = (p + 1) * PARTITION;
+		for(unsigned int i=0;i<2*PARTITION;++i) {
+			fft->work[i] = i < PARTITION && start + i < len ? kernel[start + i] : 0;
+		}
+		fft_real_forward(&fft->fft, fft->work, fft->kernel_re + p * PARTITION,
+		                 fft->kernel_im + p * PARTITION);
+	}
+	filter->fft = fft;
+	return 0;
+}
+
+/*
+ * Called once a full partition of input has been collected. Transforms the
+ * last two partitions of input and computes the kernel tail's contribution
+ * to the next PARTITION outputs, all of which depends only on input that has
+ * already been seen.
+ */
+static void crossfeed_fft_partition(struct crossfeed_fft *fft) {
+	const float scale = 1.f / (2*PARTITION);
+	float *re = fft->re, *im = fft->im;
+	fft->newest = (fft->newest + 1) % fft->partitions;
+	fft_real_forward(&fft->fft, fft->segment, fft->input_re + fft->newest * PARTITION,
+	                 fft->input_im + fft->newest * PARTITION);
+	memset(re, 0, sizeof(fft->re));
+	memset(im, 0, sizeof(fft->im));
+	for(unsigned int p=0;p<fft->partitions;++p) {
+		const unsigned int x = (fft->newest + fft->partitions - p) % fft->partitions;
+		const float *xr = fft->input_re + x * PARTITION, *xi = fft->input_im + x * PARTITION;
+		const float *hr = fft->kernel_re + p * PARTITION, *hi = fft->kernel_im + p * PARTITION;
+		const float dc = re[0] + xr[0] * hr[0], nyquist = im[0] + xi[0] * hi[0];
+		for(unsigned int k=0;k<PARTITION;++k) {
+			re[k] += xr[k] * hr[k] - xi[k] * hi[k];
+			im[k] += xr[k] * hi[k] + xi[k] * hr[k];
+		}
+		re[0] = dc;
+		im[0] = nyquist;
+	}
+	fft_real_inverse(&fft->fft, re, im, fft->work);
+	for(unsigned int i=0;i<PARTITION;++i) {
+		fft->tail[i] = fft->work[PARTITION + i] * scale;
+	}
+	memcpy(fft->segment, fft->segment + PARTITION, PARTITION * sizeof(float));
+}
+
+int crossfeed_init_kernel(crossfeed_t *filter, const float *kernel, unsigned int len,
+                          unsigned int delay) {
 	memset(filter, 0, sizeof(crossfeed_t));
+	if(!len || delay >= len || delay >= CROSSFEED_MAX_LEN)
+		return -1;
+	if(len > CROSSFEED_MAX_LEN && crossfeed_fft_init(filter, kernel, len))
+		return -1;
+	filter->filter = kernel;
+	filter->delay = delay;
+	filter->len = len > CROSSFEED_MAX_LEN ? CROSSFEED_MAX_LEN : len;
+	filter->ops = crossfeed_select_ops();
+	filter->gain = filter->gain_target = filter->fade_gain = 1;
+	return 0;
+}
+
+/*
+ * A biquad cascade in transposed direct form II. Its input is the side
+ * channel delayed by the filter's len - 1 samples, which the history buffer
+ * already keeps, so no separate delay line is needed. history is how long
+ * the impulse response takes to decay below 2^-24.
+ */
+struct crossfeed_iir {
+	unsigned int sections;
+	unsigned int history;
+	float coefficients[CROSSFEED_MAX_SECTIONS][5];
+	float state[CROSSFEED_MAX_SECTIONS][2];
+};
+
+/*
+ * Fails unless every section is stable, and otherwise returns the number of
+ * samples for the slowest pole to decay by 2^-24.
+ */
+static int crossfeed_iir_history(const float *coefficients, unsigned int sections,
+                                 unsigned int *history) {
+	double radius = 0;
+	for(unsigned int s=0;s<sections;++s) {
+		const double a1 = coefficients[s*5+3], a2 = coefficients[s*5+4];
+		const double discriminant = a1*a1 - 4*a2;
+		double r;
+		/* the stability triangle */
+		if(!(fabs(a2) < 1 && fabs(a1) < 1 + a2))
+			return -1;
+		if(discriminant < 0)
+			r = sqrt(a2);
+		else
+			r = (fabs(a1) + sqrt(discriminant)) / 2;
+		if(r > radius)
+			radius = r;
+	}
+	*history = radius > 0 ? (unsigned int)ceil(log(1. / (1 << 24)) / log(radius)) : 0;
+	return 0;
+}
+
+int crossfeed_init_iir(crossfeed_t *filter, const float *coefficients, unsigned int sections,
+                       unsigned int delay) {
+	struct crossfeed_iir *iir;
+	unsigned int history;
+	memset(filter, 0, sizeof(crossfeed_t));
+	if(!sections || sections > CROSSFEED_MAX_SECTIONS || delay >= CROSSFEED_MAX_LEN ||
+	   crossfeed_iir_history(coefficients, sections, &history))
+		return -1;
+	iir = calloc(1, sizeof(struct crossfeed_iir));
+	if(!iir)
+		return -1;
+	iir->sections = sections;
+	iir->history = history;
+	memcpy(iir->coefficients, coefficients, sizeof(float) * 5 * sections);
+	filter->iir = iir;
+	filter->len = delay + 1;
+	filter->ops = crossfeed_select_ops();
+	filter->gain = filter->gain_target = filter->fade_gain = 1;
+	return 0;
+}
+
+/*
+ * Runs every section for each sample in turn rather than each section over
+ * the block, so the sections' recursions overlap instead of adding up.
+ */
+static void crossfeed_iir_block(struct crossfeed_iir *iir, const float *side, float *oside,
+                                unsigned int size) {
+	const unsigned int sections = iir->sections;
+	for(unsigned int i=0;i<size;++i) {
+		float x = side[i];
+		for(unsigned int s=0;s<sections;++s) {
+			const float *c = iir->coefficients[s];
+			float *z = iir->state[s];
+			const float y = c[0] * x + z[0];
+			z[0] = c[1] * x - c[3] * y + z[1];
+			z[1] = c[2] * x - c[4] * y;
+			x = y;
+		}
+		oside[i] = x;
+	}
+}
+
+/*
+ * Kernels designed for other sample rates. Entries are never freed, since
+ * filters keep pointing at them.
+ */
+struct crossfeed_kernel {
+	struct crossfeed_kernel *next;
+	int samplerate;
+	unsigned int len;
+	float kernel[];
+};
+
+static struct crossfeed_kernel *kernel_cache;
+static pthread_mutex_t kernel_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct kernel_store kernel_store;
+
+int crossfeed_load_kernels(const char *path) {
+	struct kernel_store store;
+	if(kernel_store_open(&store, path))
+		return -1;
+	/* any previous store stays mapped, since filters may still use its kernels */
+	kernel_store = store;
+	return 0;
+}
+
+/*
+ * Returns the kernel for samplerate, designing it from the 96kHz one on first
+ * use. The lock is held while designing so each rate is only designed once.
+ */
+static const struct crossfeed_kernel *crossfeed_kernel_lookup(int samplerate) {
+	const unsigned int reference_len = sizeof(kernel_96k)/sizeof(float);
+	struct crossfeed_kernel *entry;
+	unsigned int len;
+	if(samplerate < CROSSFEED_MIN_SAMPLERATE || samplerate > CROSSFEED_MAX_SAMPLERATE)
+		return NULL;
+	pthread_mutex_lock(&kernel_cache_lock);
+	for(entry = kernel_cache; entry; entry = entry->next) {
+		if(entry->samplerate == samplerate)
+			goto done;
+	}
+	/* keep the reference kernel's length in time */
+	len = (samplerate * (long long)reference_len + 48000) / 96000;
+	entry = malloc(sizeof(struct crossfeed_kernel) + sizeof(float) * len);
+	if(!entry)
+		goto done;
+	if(kernel_design(entry->kernel, len, samplerate, kernel_96k, reference_len, 96000) < 0) {
+		free(entry);
+		entry = NULL;
+		goto done;
+	}
+	entry->samplerate = samplerate;
+	entry->len = len;
+	entry->next = kernel_cache;
+	kernel_cache = entry;
+done:
+	pthread_mutex_unlock(&kernel_cache_lock);
+	return entry;
+}
+
+int crossfeed_init(crossfeed_t *filter, int samplerate) {
+	const struct kernel_store_entry *stored;
+	const struct crossfeed_kernel *entry;
+	if(kernel_store.map && (stored = kernel_store_find(&kernel_store, samplerate, 0, 0))) {
+		if(stored->sections)
+			return crossfeed_init_iir(filter, kernel_store_taps(&kernel_store, stored),
+			                          stored->sections, stored->delay);
+		return crossfeed_init_kernel(filter, kernel_store_taps(&kernel_store, stored),
+		                             stored->len, stored->delay);
+	}
 	switch(samplerate) {
 	case 44100:
-		filter->filter = kernel_44k;
-		filter->delay = 0;
-		filter->len = sizeof(kernel_44k)/sizeof(float);
-		break;
+		return crossfeed_init_kernel(filter, kernel_44k, sizeof(kernel_44k)/sizeof(float), 0);
 	case 48000:
-		filter->filter = kernel_48k;
-		filter->delay = 0;
-		filter->len = sizeof(kernel_48k)/sizeof(float);
-		break;
+		return crossfeed_init_kernel(filter, kernel_48k, sizeof(kernel_48k)/sizeof(float), 0);
 	case 96000:
-		filter->filter = kernel_96k;
-		filter->delay = 0;
-		filter->len = sizeof(kernel_96k)/sizeof(float);
-		break;
+		return crossfeed_init_kernel(filter, kernel_96k, sizeof(kernel_96k)/sizeof(float), 0);
 	default:
-		return -1;
+		entry = crossfeed_kernel_lookup(samplerate);
+		if(!entry) {
+			memset(filter, 0, sizeof(crossfeed_t));
+			return -1;
+		}
+		return crossfeed_init_kernel(filter, entry->kernel, entry->len, 0);
 	}
+}
+
+unsigned int crossfeed_history(const crossfeed_t *filter) {
+	if(filter->fft)
+		return (filter->fft->partitions + 1) * PARTITION - 1;
+	if(filter->iir)
+		return filter->len - 1 + filter->iir->history;
+	return filter->len - 1;
+}
+
+void crossfeed_destroy(crossfeed_t *filter) {
+	if(filter->fft) {
+		fft_destroy(&filter->fft->fft);
+		free(filter->fft->kernel_re);
+		free(filter->fft);
+		filter->fft = NULL;
+	}
+	free(filter->iir);
+	filter->iir = NULL;
+}
+
+enum crossfeed_isa crossfeed_get_isa(const crossfeed_t *filter) {
+	return filter->ops->isa;
+}
+
+void crossfeed_set_gain(crossfeed_t *filter, float gain) {
+	__atomic_store(&filter->gain_target, &gain, __ATOMIC_RELEASE);
+}
+
+void crossfeed_set_bypass(crossfeed_t *filter, int bypass) {
+	__atomic_store_n(&filter->bypass_target, bypass ? 1 : 0, __ATOMIC_RELEASE);
+}
+
+int crossfeed_get_bypass(const crossfeed_t *filter) {
+	return __atomic_load_n(&filter->bypass_target, __ATOMIC_ACQUIRE);
+}
+
+int crossfeed_publish(crossfeed_t *filter, crossfeed_t *next) {
+	if(filter->swapping)
+		return -1;
+	filter->swapping = 1;
+	__atomic_store_n(&filter->pending, next, __ATOMIC_RELEASE);
 	return 0;
 }
 
-static inline void crossfeed_process_sample(crossfeed_t *filter, float left, float right,
-                                            float *oleft, float *oright) {
-	float mid = (left + right) / 2;
-	float side = (left - right) / 2;
-	float oside = 0;
-	filter->mid[(filter->pos + filter->delay) % filter->len] = mid;
-	filter->side[filter->pos] = side;
-	if(!filter->bypass) {
-		for(unsigned int i=0;i<filter->len;++i) {
-			oside += filter->side[(filter->pos + filter->len - i) % filter->len] * filter->filter[i];
+crossfeed_t *crossfeed_reclaim(crossfeed_t *filter) {
+	crossfeed_t *retired = __atomic_exchange_n(&filter->retired, NULL, __ATOMIC_ACQ_REL);
+	if(retired)
+		filter->swapping = 0;
+	return retired;
+}
+
+/* Moves the last from samples of history so that the last to samples end at index to */
+static void crossfeed_relocate(float *history, unsigned int from, unsigned int to) {
+	if(to > from) {
+		memmove(history + to - from, history, from * sizeof(float));
+		memset(history, 0, (to - from) * sizeof(float));
+	} else {
+		memmove(history, history + from - to, to * sizeof(float));
+	}
+}
+
+/*
+ * Trades kernels with next, which keeps a copy of the history so that the
+ * old kernel can keep running until the fade is over.
+ */
+static void crossfeed_swap(crossfeed_t *filter, crossfeed_t *next) {
+	const float *kernel = next->filter;
+	const struct crossfeed_ops *ops = next->ops;
+	struct crossfeed_fft *fft = next->fft;
+	struct crossfeed_iir *iir = next->iir;
+	const unsigned char len = next->len, delay = next->delay;
+	next->filter = filter->filter;
+	next->ops = filter->ops;
+	next->fft = filter->fft;
+	next->iir = filter->iir;
+	next->len = filter->len;
+	next->delay = filter->delay;
+	memcpy(next->mid, filter->mid, (filter->len - 1) * sizeof(float));
+	memcpy(next->side, filter->side, (filter->len - 1) * sizeof(float));
+	crossfeed_relocate(filter->mid, filter->len - 1, len - 1);
+	crossfeed_relocate(filter->side, filter->len - 1, len - 1);
+	filter->filter = kernel;
+	filter->ops = ops;
+	filter->fft = fft;
+	filter->iir = iir;
+	filter->len = len;
+	filter->delay = delay;
+	filter->fading = next;
+}
+
+/* Picks up control changes at a block boundary, unless a fade is still running */
+static inline void crossfeed_control(crossfeed_t *filter) {
+	crossfeed_t *next = NULL;
+	unsigned char bypass;
+	float gain;
+	if(filter->fade)
+		return;
+	__atomic_load(&filter->gain_target, &gain, __ATOMIC_ACQUIRE);
+	bypass = __atomic_load_n(&filter->bypass_target, __ATOMIC_ACQUIRE);
+	if(__atomic_load_n(&filter->pending, __ATOMIC_RELAXED))
+		next = __atomic_exchange_n(&filter->pending, NULL, __ATOMIC_ACQ_REL);
+	if(gain == filter->gain && bypass == filter->bypass && !next)
+		return;
+	filter->fade_gain = filter->gain;
+	filter->fade_bypass = filter->bypass;
+	filter->gain = gain;
+	filter->bypass = bypass;
+	if(next)
+		crossfeed_swap(filter, next);
+	filter->fade = CROSSFEED_FADE_FRAMES;
+}
+
+/* True if a filter has no fade running and no control changes waiting */
+static inline int crossfeed_settled(const crossfeed_t *filter) {
+	float gain;
+	__atomic_load(&filter->gain_target, &gain, __ATOMIC_RELAXED);
+	return !filter->fade && filter->gain == 1 && gain == 1 &&
+	       __atomic_load_n(&filter->bypass_target, __ATOMIC_RELAXED) == filter->bypass &&
+	       !__atomic_load_n(&filter->pending, __ATOMIC_RELAXED);
+}
+
+/*
+ * FFT mode blocks must not cross a partition boundary, and blocks during a
+ * fade must not run past its end.
+ */
+static inline unsigned int crossfeed_block_size(const crossfeed_t *filter, unsigned int size) {
+	unsigned int max = filter->fft ? PARTITION - filter->fft->phase : CROSSFEED_BLOCK_SIZE;
+	if(filter->fade) {
+		const crossfeed_t *from = filter->fading;
+		if(filter->fade < max)
+			max = filter->fade;
+		if(from && from->fft && PARTITION - from->fft->phase < max)
+			max = PARTITION - from->fft->phase;
+	}
+	return size < max ? size : max;
+}
+
+/*
+ * The side channel output for the block in side, filtered or passed through.
+ * An IIR cascade runs even when bypassed, so that its state is current when
+ * it is faded back in.
+ */
+static void crossfeed_side(const crossfeed_t *filter, int bypass, float *oside, unsigned int size) {
+	const float *side = filter->side + filter->len - 1;
+	struct crossfeed_fft *fft = filter->fft;
+	if(filter->iir) {
+		crossfeed_iir_block(filter->iir, filter->side, oside, size);
+		if(!bypass)
+			return;
+	} else if(!bypass) {
+		filter->ops->fir(side, filter->filter, filter->len, 1, oside, size);
+		if(fft) {
+			for(unsigned int i=0;i<size;++i) {
+				oside[i] += fft->tail[fft->phase + i];
+			}
 		}
+		return;
+	}
+	memcpy(oside, side - filter->delay, size * sizeof(float));
+}
+
+static void crossfeed_feed_fft(crossfeed_t *filter, unsigned int size) {
+	struct crossfeed_fft *fft = filter->fft;
+	if(fft) {
+		memcpy(fft->segment + PARTITION + fft->phase, filter->side + filter->len - 1,
+		       size * sizeof(float));
+		fft->phase += size;
+		if(fft->phase == PARTITION) {
+			crossfeed_fft_partition(fft);
+			fft->phase = 0;
+		}
+	}
+}
+
+static inline void crossfeed_advance(crossfeed_t *filter, unsigned int size) {
+	const unsigned int hist = filter->len - 1;
+	memmove(filter->mid, filter->mid + size, hist * sizeof(float));
+	memmove(filter->side, filter->side + size, hist * sizeof(float));
+}
+
+/*
+ * Computes the side output for a block and returns the delayed mid channel
+ * to merge it with. While fading, both are mixed from the settings before
+ * and after the change into oside and tmid; a gain other than 1 is applied
+ * the same way, unless gain is given, in which case it is returned there for
+ * the caller to fold into the merge.
+ */
+static const float *crossfeed_process_block(crossfeed_t *filter, float *oside, float *tmid,
+                                            unsigned int size, float *gain) {
+	const float *mid = filter->mid + filter->len - 1;
+	const float *omid = mid - filter->delay;
+	crossfeed_t *from = filter->fading ? filter->fading : filter;
+	float fside[CROSSFEED_BLOCK_SIZE];
+	if(filter->fade && from == filter && filter->iir) {
+		/*
+		 * A gain or bypass fade on a cascade takes both sides of the fade
+		 * from one run of it, as every run moves its state on
+		 */
+		const float *side = filter->side + filter->len - 1 - filter->delay;
+		crossfeed_iir_block(filter->iir, filter->side, oside, size);
+		memcpy(fside, filter->fade_bypass ? side : oside, size * sizeof(float));
+		if(filter->bypass)
+			memcpy(oside, side, size * sizeof(float));
 	} else {
-		oside = filter->side[(filter->pos + filter->len - filter->delay) % filter->len];
+		crossfeed_side(filter, filter->bypass, oside, size);
 	}
-	*oleft = filter->mid[filter->pos] + oside;
-	*oright = filter->mid[filter->pos] - oside;
-	filter->pos = (filter->pos + 1) % filter->len;
+	if(filter->fade) {
+		const float step = 1.f / CROSSFEED_FADE_FRAMES;
+		float w = (CROSSFEED_FADE_FRAMES - filter->fade) * step;
+		const float *fmid;
+		if(from != filter) {
+			memcpy(from->mid + from->len - 1, mid, size * sizeof(float));
+			memcpy(from->side + from->len - 1, filter->side + filter->len - 1, size * sizeof(float));
+		}
+		fmid = from->mid + from->len - 1 - from->delay;
+		if(from != filter || !filter->iir)
+			crossfeed_side(from, filter->fade_bypass, fside, size);
+		for(unsigned int i=0;i<size;++i) {
+			float a, b;
+			w += step;
+			a = filter->fade_gain * (1 - w);
+			b = filter->gain * w;
+			tmid[i] = fmid[i] * a + omid[i] * b;
+			oside[i] = fside[i] * a + oside[i] * b;
+		}
+		if(from != filter) {
+			crossfeed_feed_fft(from, size);
+			crossfeed_advance(from, size);
+		}
+		filter->fade -= size;
+		if(!filter->fade && filter->fading) {
+			__atomic_store_n(&filter->retired, filter->fading, __ATOMIC_RELEASE);
+			filter->fading = NULL;
+		}
+		omid = tmid;
+	} else if(gain) {
+		*gain = filter->gain;
+	} else if(filter->gain != 1) {
+		for(unsigned int i=0;i<size;++i) {
+			tmid[i] = omid[i] * filter->gain;
+			oside[i] *= filter->gain;
+		}
+		omid = tmid;
+	}
+	crossfeed_feed_fft(filter, size);
+	return omid;
 }
 
 void crossfeed_filter(crossfeed_t *filter, float *input, float *output, unsigned int size) {
-	for(unsigned int i=0;i<size;++i) {
-		crossfeed_process_sample(filter, input[i*2], input[i*2+1], &output[i*2],
-		                         &output[i*2+1]);
+	float oside[CROSSFEED_BLOCK_SIZE], tmid[CROSSFEED_BLOCK_SIZE];
+	while(size) {
+		unsigned int n;
+		const float *omid;
+		crossfeed_control(filter);
+		n = crossfeed_block_size(filter, size);
+		filter->ops->split(input, filter->mid + filter->len - 1, filter->side + filter->len - 1, n);
+		omid = crossfeed_process_block(filter, oside, tmid, n, NULL);
+		filter->ops->merge(omid, oside, output, n);
+		crossfeed_advance(filter, n);
+		input += n*2;
+		output += n*2;
+		size -= n;
 	}
 }
 
 void crossfeed_filter_inplace_noninterleaved(crossfeed_t *filter, float *left, float *right,
                                              unsigned int size) {
-	for(unsigned int i=0;i<size;++i) {
-		crossfeed_process_sample(filter, left[i], right[i], &left[i],
-		                         &right[i]);
+	float oside[CROSSFEED_BLOCK_SIZE], tmid[CROSSFEED_BLOCK_SIZE];
+	while(size) {
+		unsigned int n;
+		float *mid, *side, gain = 1;
+		const float *omid;
+		crossfeed_control(filter);
+		n = crossfeed_block_size(filter, size);
+		mid = filter->mid + filter->len - 1;
+		side = filter->side + filter->len - 1;
+		for(unsigned int i=0;i<n;++i) {
+			mid[i] = (left[i] + right[i]) / 2;
+			side[i] = (left[i] - right[i]) / 2;
+		}
+		omid = crossfeed_process_block(filter, oside, tmid, n, &gain);
+		if(gain == 1) {
+			for(unsigned int i=0;i<n;++i) {
+				left[i] = omid[i] + oside[i];
+				right[i] = omid[i] - oside[i];
+			}
+		} else {
+			for(unsigned int i=0;i<n;++i) {
+				left[i] = (omid[i] + oside[i]) * gain;
+				right[i] = (omid[i] - oside[i]) * gain;
+			}
+		}
+		crossfeed_advance(filter, n);
+		left += n;
+		right += n;
+		size -= n;
+	}
+}
+
+/*
+ * Full scale, the largest magnitude that survives conversion, and bytes per
+ * sample for each output format. Full scale for 32 bits rounds up to 2^31
+ * as a float, so its limit is the largest float below that.
+ */
+static const struct crossfeed_format_info {
+	float scale;
+	float limit;
+	unsigned int size;
+} crossfeed_formats[] = {
+	[CROSSFEED_FORMAT_FLOAT] = {1, 1, 4},
+	[CROSSFEED_FORMAT_S16] = {0x7FFF, 0x7FFF, 2},
+	[CROSSFEED_FORMAT_S24] = {0x7FFFFF, 0x7FFFFF, 3},
+	[CROSSFEED_FORMAT_S32] = {2147483648.f, 2147483520.f, 4}
+};
+
+void crossfeed_output_init(struct crossfeed_output *output, enum crossfeed_format format,
+                           int dither) {
+	output->format = format;
+	output->dither = format != CROSSFEED_FORMAT_FLOAT && dither;
+	crossfeed_output_seed(output, 0);
+}
+
+/*
+ * The position goes through the splitmix64 finalizer, so neighbouring
+ * positions start far apart in the dither sequence. A zero state would
+ * stick, so that one is replaced.
+ */
+void crossfeed_output_seed(struct crossfeed_output *output, unsigned long long position) {
+	uint64_t x = position + 0x9E3779B97F4A7C15ull;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+	x ^= x >> 31;
+	output->seed = (uint32_t)(x ^ (x >> 32));
+	if(!output->seed)
+		output->seed = 0x2545F491;
+}
+
+unsigned int crossfeed_format_size(enum crossfeed_format format) {
+	return crossfeed_formats[format].size;
+}
+
+/* Rounds to nearest like lrintf, which isn't inlined where it may set errno */
+static inline long crossfeed_round(float x) {
+#ifdef __SSE__
+	return _mm_cvtss_si32(_mm_set_ss(x));
+#else
+	return lrintf(x);
+#endif
+}
+
+/* One xorshift32 step, returning the top 16 bits */
+static inline uint32_t crossfeed_random(uint32_t *seed) {
+	uint32_t x = *seed;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*seed = x;
+	return x >> 16;
+}
+
+/*
+ * Scales, dithers, clips and stores one sample. The dither is the
+ * difference of two successive draws, which has a triangular distribution
+ * spanning one LSB either side.
+ */
+static inline __attribute__((always_inline))
+void crossfeed_store(unsigned char *dst, float x, enum crossfeed_format format, int dither,
+                     uint32_t *seed) {
+	const float limit = crossfeed_formats[format].limit;
+	long value;
+	if(dither) {
+		const int a = crossfeed_random(seed);
+		x += (a - (int)crossfeed_random(seed)) * (1.f / 65536);
+	}
+	x = x > limit ? limit : (x < -limit ? -limit : x);
+	if(format == CROSSFEED_FORMAT_FLOAT) {
+		memcpy(dst, &x, sizeof(float));
+		return;
+	}
+	value = crossfeed_round(x);
+	switch(format) {
+	case CROSSFEED_FORMAT_S16:
+		*(int16_t *)dst = value;
+		break;
+	case CROSSFEED_FORMAT_S24:
+		dst[0] = value;
+		dst[1] = value >> 8;
+		dst[2] = value >> 16;
+		break;
+	default:
+		*(int32_t *)dst = value;
+		break;
+	}
+}
+
+/*
+ * The mid/side merge for crossfeed_filter_convert, specialized per format.
+ * The gain goes on before the merge, as crossfeed_process_block applies it,
+ * so that the result rounds the same as crossfeed_filter's.
+ */
+static inline __attribute__((always_inline))
+void crossfeed_convert_block(const float *omid, const float *oside, float gain, unsigned char *dst,
+                             unsigned int size, enum crossfeed_format format, int dither,
+                             uint32_t *seed) {
+	const float scale = crossfeed_formats[format].scale;
+	const unsigned int bytes = crossfeed_formats[format].size;
+	uint32_t state = *seed;
+	for(unsigned int i=0;i<size;++i, dst+=bytes*2) {
+		const float mid = omid[i] * gain, side = oside[i] * gain;
+		crossfeed_store(dst, (mid + side) * scale, format, dither, &state);
+		crossfeed_store(dst + bytes, (mid - side) * scale, format, dither, &state);
+	}
+	*seed = state;
+}
+
+static void crossfeed_convert_merge(const float *omid, const float *oside, float gain,
+                                    unsigned char *dst, unsigned int size,
+                                    struct crossfeed_output *out) {
+	uint32_t seed = out->seed;
+	switch(out->format) {
+	case CROSSFEED_FORMAT_FLOAT:
+		crossfeed_convert_block(omid, oside, gain, dst, size, CROSSFEED_FORMAT_FLOAT, 0, &seed);
+		break;
+#define CONVERT(format) \
+	case format: \
+		if(out->dither) \
+			crossfeed_convert_block(omid, oside, gain, dst, size, format, 1, &seed); \
+		else \
+			crossfeed_convert_block(omid, oside, gain, dst, size, format, 0, &seed); \
+		break;
+	CONVERT(CROSSFEED_FORMAT_S16)
+	CONVERT(CROSSFEED_FORMAT_S24)
+	CONVERT(CROSSFEED_FORMAT_S32)
+#undef CONVERT
+	}
+	out->seed = seed;
+}
+
+/* The same for interleaved samples that are already stereo */
+static inline __attribute__((always_inline))
+void crossfeed_convert_interleaved(const float *input, unsigned char *dst, unsigned int size,
+                                   enum crossfeed_format format, int dither, uint32_t *seed) {
+	const float scale = crossfeed_formats[format].scale;
+	const unsigned int bytes = crossfeed_formats[format].size;
+	uint32_t state = *seed;
+	for(unsigned int i=0;i<size*2;++i, dst+=bytes) {
+		crossfeed_store(dst, input[i] * scale, format, dither, &state);
+	}
+	*seed = state;
+}
+
+void crossfeed_convert(const float *input, void *output, unsigned int size,
+                       struct crossfeed_output *out) {
+	uint32_t seed = out->seed;
+	switch(out->format) {
+	case CROSSFEED_FORMAT_FLOAT:
+		crossfeed_convert_interleaved(input, output, size, CROSSFEED_FORMAT_FLOAT, 0, &seed);
+		break;
+#define CONVERT(format) \
+	case format: \
+		if(out->dither) \
+			crossfeed_convert_interleaved(input, output, size, format, 1, &seed); \
+		else \
+			crossfeed_convert_interleaved(input, output, size, format, 0, &seed); \
+		break;
+	CONVERT(CROSSFEED_FORMAT_S16)
+	CONVERT(CROSSFEED_FORMAT_S24)
+	CONVERT(CROSSFEED_FORMAT_S32)
+#undef CONVERT
+	}
+	out->seed = seed;
+}
+
+void crossfeed_filter_convert(crossfeed_t *filter, const float *input, void *output,
+                              unsigned int size, struct crossfeed_output *out) {
+	float oside[CROSSFEED_BLOCK_SIZE], tmid[CROSSFEED_BLOCK_SIZE];
+	const unsigned int frame = crossfeed_formats[out->format].size * 2;
+	unsigned char *dst = output;
+	while(size) {
+		unsigned int n;
+		float gain = 1;
+		const float *omid;
+		crossfeed_control(filter);
+		n = crossfeed_block_size(filter, size);
+		filter->ops->split(input, filter->mid + filter->len - 1, filter->side + filter->len - 1, n);
+		omid = crossfeed_process_block(filter, oside, tmid, n, &gain);
+		crossfeed_convert_merge(omid, oside, gain, dst, n, out);
+		crossfeed_advance(filter, n);
+		input += n*2;
+		dst += n*frame;
+		size -= n;
+	}
+}
+
+#define STREAM_LANES CROSSFEED_STREAM_LANES
+#define STREAM_BLOCK 64
+
+static inline int crossfeed_stream_compatible(const crossfeed_t *a, const crossfeed_t *b) {
+	return !b->fft && !b->iir && !b->bypass && crossfeed_settled(b) && a->filter == b->filter &&
+	       a->len == b->len && a->delay == b->delay;
+}
+
+/*
+ * Filters lanes streams sharing a kernel. Their histories are interleaved
+ * sample by sample, so the FIR runs with a stride of lanes and each vector
+ * covers several streams at the same point in time.
+ */
+static void crossfeed_filter_lanes(crossfeed_t *filters, unsigned int lanes, float **input,
+                                   float **output, unsigned int size) {
+	float mid[(CROSSFEED_MAX_LEN - 1 + STREAM_BLOCK) * STREAM_LANES];
+	float side[(CROSSFEED_MAX_LEN - 1 + STREAM_BLOCK) * STREAM_LANES];
+	float oside[STREAM_BLOCK * STREAM_LANES];
+	float *in[STREAM_LANES], *out[STREAM_LANES];
+	const unsigned int hist = filters->len - 1;
+	float *bmid = mid + hist * lanes, *bside = side + hist * lanes;
+	const float *omid = bmid - filters->delay * lanes;
+	for(unsigned int s=0;s<lanes;++s) {
+		for(unsigned int t=0;t<hist;++t) {
+			mid[t*lanes + s] = filters[s].mid[t];
+			side[t*lanes + s] = filters[s].side[t];
+		}
+	}
+	for(unsigned int pos=0;pos<size;pos+=STREAM_BLOCK) {
+		const unsigned int n = size - pos < STREAM_BLOCK ? size - pos : STREAM_BLOCK;
+		for(unsigned int s=0;s<lanes;++s) {
+			in[s] = input[s] + pos*2;
+			out[s] = output[s] + pos*2;
+		}
+		if(lanes == STREAM_LANES)
+			filters->ops->split_lanes(in, bmid, bside, n);
+		else
+			lanes_split(in, bmid, bside, lanes, n);
+		filters->ops->fir(bside, filters->filter, filters->len, lanes, oside, n * lanes);
+		if(lanes == STREAM_LANES)
+			filters->ops->merge_lanes(omid, oside, out, n);
+		else
+			lanes_merge(omid, oside, out, lanes, n);
+		memmove(mid, mid + n * lanes, hist * lanes * sizeof(float));
+		memmove(side, side + n * lanes, hist * lanes * sizeof(float));
+	}
+	for(unsigned int s=0;s<lanes;++s) {
+		for(unsigned int t=0;t<hist;++t) {
+			filters[s].mid[t] = mid[t*lanes + s];
+			filters[s].side[t] = side[t*lanes + s];
+		}
+	}
+}
+
+void crossfeed_filter_streams(crossfeed_t *filters, unsigned int count, float **input,
+                              float **output, unsigned int size) {
+	unsigned int i = 0;
+	while(i < count) {
+		unsigned int lanes = 1;
+		if(filters[i].ops->split_lanes && !filters[i].fft && !filters[i].iir &&
+		   !filters[i].bypass && crossfeed_settled(&filters[i])) {
+			while(lanes < STREAM_LANES && i + lanes < count &&
+			      crossfeed_stream_compatible(&filters[i], &filters[i + lanes]))
+				++lanes;
+		}
+		if(lanes > 1)
+			crossfeed_filter_lanes(filters + i, lanes, input + i, output + i, size);
+		else
+			crossfeed_filter(filters + i, input[i], output[i], size);
+		i += lanes;
 	}
 }
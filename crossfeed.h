@@ -34,19 +34,216 @@
 extern "C" {
 #endif
 
+/*
+ * Kernels up to CROSSFEED_MAX_LEN taps run as a direct-form FIR. Longer ones
+ * run the first CROSSFEED_MAX_LEN taps directly and the rest through a
+ * uniformly partitioned overlap-save convolution with CROSSFEED_MAX_LEN-sized
+ * partitions, which adds no latency.
+ */
+#define CROSSFEED_MAX_LEN 128
+#define CROSSFEED_BLOCK_SIZE 256
+#define CROSSFEED_STREAM_LANES 8
+#define CROSSFEED_MIN_SAMPLERATE 8000
+#define CROSSFEED_MAX_SAMPLERATE 768000
+#define CROSSFEED_FADE_FRAMES 256
+#define CROSSFEED_MAX_SECTIONS 8
+
+/* Tap counts of the built-in kernels */
+#define CROSSFEED_TAPS_44100 10
+#define CROSSFEED_TAPS_48000 11
+#define CROSSFEED_TAPS_96000 22
+
+enum crossfeed_isa {
+	CROSSFEED_ISA_AUTO,
+	CROSSFEED_ISA_SCALAR,
+	CROSSFEED_ISA_SSE2,
+	CROSSFEED_ISA_AVX2,
+	CROSSFEED_ISA_AVX512,
+	CROSSFEED_ISA_NEON
+};
+
+struct crossfeed_ops {
+	enum crossfeed_isa isa;
+	void (*fir)(const float *side, const float *kernel, unsigned int len, unsigned int stride,
+	            float *oside, unsigned int size);
+	void (*split)(const float *input, float *mid, float *side, unsigned int size);
+	void (*merge)(const float *mid, const float *oside, float *output, unsigned int size);
+	/*
+	 * split and merge for CROSSFEED_STREAM_LANES streams interleaved sample by
+	 * sample, or NULL where batching doesn't pay for the transposes, in which
+	 * case crossfeed_filter_streams filters each stream on its own
+	 */
+	void (*split_lanes)(float *const *input, float *mid, float *side, unsigned int size);
+	void (*merge_lanes)(const float *mid, const float *oside, float *const *output,
+	                    unsigned int size);
+};
+
+/*
+ * Sample formats crossfeed_filter_convert writes. CROSSFEED_FORMAT_S24 is
+ * packed little-endian three-byte samples, as stored in WAV files; the
+ * others are native floats and integers.
+ */
+enum crossfeed_format {
+	CROSSFEED_FORMAT_FLOAT,
+	CROSSFEED_FORMAT_S16,
+	CROSSFEED_FORMAT_S24,
+	CROSSFEED_FORMAT_S32
+};
+
+/* Output stage settings and the dither generator's state, one per stream */
+struct crossfeed_output {
+	enum crossfeed_format format;
+	int dither;
+	unsigned int seed;
+};
+
+struct crossfeed_fft;
+struct crossfeed_iir;
+
+/*
+ * mid[] and side[] are linear history buffers: the first len-1 entries carry
+ * over the tail of the previous block, followed by up to CROSSFEED_BLOCK_SIZE
+ * new samples.
+ *
+ * pending, gain_target and bypass_target are written by the control calls
+ * below and read by the filtering thread at block boundaries; the rest of the
+ * live state belongs to the filtering thread. fading holds the previous
+ * kernel while a swap fades out, and is handed back through retired.
+ */
 typedef struct crossfeed_s {
-	float mid[25];
-	float side[25];
+	float mid[CROSSFEED_MAX_LEN - 1 + CROSSFEED_BLOCK_SIZE];
+	float side[CROSSFEED_MAX_LEN - 1 + CROSSFEED_BLOCK_SIZE];
 	const float *filter;
+	const struct crossfeed_ops *ops;
+	struct crossfeed_fft *fft;
+	struct crossfeed_iir *iir;
+	struct crossfeed_s *pending;
+	struct crossfeed_s *retired;
+	struct crossfeed_s *fading;
+	float gain, gain_target, fade_gain;
+	unsigned short fade;
 	unsigned char delay;
 	unsigned char len;
-	unsigned char pos;
 	unsigned char bypass;
+	unsigned char bypass_target;
+	unsigned char fade_bypass;
+	unsigned char swapping;
 } crossfeed_t;
 
+/*
+ * Kernels for 44.1, 48 and 96kHz are built in. Kernels for other rates from
+ * CROSSFEED_MIN_SAMPLERATE to CROSSFEED_MAX_SAMPLERATE are designed from the
+ * 96kHz one the first time the rate is used, and shared by every filter in
+ * the process after that. Kernels in a store loaded with crossfeed_load_kernels
+ * take precedence over both.
+ */
 int crossfeed_init(crossfeed_t *filter, int samplerate);
+/*
+ * Maps a kernel store written by designer for crossfeed_init to use. Call it
+ * before creating filters; the store stays mapped for the life of the
+ * process.
+ */
+int crossfeed_load_kernels(const char *path);
+/*
+ * Initializes a filter with a caller-supplied side-channel kernel, which must
+ * outlive the filter. The mid channel is delayed by delay samples, which must
+ * be less than both len and CROSSFEED_MAX_LEN.
+ */
+int crossfeed_init_kernel(crossfeed_t *filter, const float *kernel, unsigned int len,
+                          unsigned int delay);
+/*
+ * Initializes a filter whose side channel runs through a cascade of
+ * sections biquads instead of a FIR, for a cost per frame that doesn't
+ * depend on the kernel's length. coefficients holds b0, b1, b2, a1 and a2
+ * for each section, with a0 normalized to 1, and is copied. The side
+ * channel is delayed by delay samples, less than CROSSFEED_MAX_LEN, ahead
+ * of the cascade; the mid channel isn't delayed. designer -i fits these.
+ */
+int crossfeed_init_iir(crossfeed_t *filter, const float *coefficients, unsigned int sections,
+                       unsigned int delay);
+void crossfeed_destroy(crossfeed_t *filter);
+/*
+ * Number of past frames the output depends on. Running a freshly
+ * initialized filter over this many frames of input leaves it in the same
+ * state as one that has processed the whole stream up to that point (to
+ * within rounding for kernels using the FFT engine, and until the impulse
+ * response has decayed below 2^-24 for IIR filters).
+ */
+unsigned int crossfeed_history(const crossfeed_t *filter);
+
+/*
+ * Live control. These may be called from one control thread while another
+ * thread is filtering, and never block or allocate on the filtering side.
+ * Changes are picked up at the next block boundary and faded in over
+ * CROSSFEED_FADE_FRAMES frames; changes made during a fade wait for it to
+ * finish.
+ *
+ * crossfeed_publish swaps in the kernel of next, a filter the control thread
+ * has set up with crossfeed_init or crossfeed_init_kernel. next is kept
+ * (holding the old kernel) until the fade is over, and then returned by
+ * crossfeed_reclaim, after which the control thread should destroy it. Only
+ * one swap can be outstanding; crossfeed_publish fails until the previous
+ * one has been reclaimed. The new kernel's history starts from the old one's,
+ * and for kernels using the FFT engine its tail starts empty, so it is only
+ * exact once the fade is over.
+ */
+void crossfeed_set_gain(crossfeed_t *filter, float gain);
+void crossfeed_set_bypass(crossfeed_t *filter, int bypass);
+int crossfeed_get_bypass(const crossfeed_t *filter);
+int crossfeed_publish(crossfeed_t *filter, crossfeed_t *next);
+crossfeed_t *crossfeed_reclaim(crossfeed_t *filter);
+
 void crossfeed_filter(crossfeed_t *filter, float *input, float *output, unsigned int size);
 void crossfeed_filter_inplace_noninterleaved(crossfeed_t *filter, float *left, float *right, unsigned int size);
+/* Sets up an output stage; dither only applies to the integer formats */
+void crossfeed_output_init(struct crossfeed_output *output, enum crossfeed_format format,
+                           int dither);
+/*
+ * Restarts the dither sequence from a stream position. Parts of a stream
+ * that are converted separately, such as chunks filtered on different
+ * threads, should each be seeded with their first frame, so that their
+ * dither isn't the same sequence repeated. crossfeed_output_init seeds
+ * with position 0.
+ */
+void crossfeed_output_seed(struct crossfeed_output *output, unsigned long long position);
+unsigned int crossfeed_format_size(enum crossfeed_format format);
+/*
+ * Filters interleaved float input straight into output in the given format,
+ * applying the filter's gain, clipping to full scale and, for integer
+ * formats with dither set, TPDF dither of one LSB, all in the same pass as
+ * the mid/side merge. Without dither the result matches crossfeed_filter
+ * followed by clamping to [-1, 1] and scaling by the format's maximum with
+ * round-to-nearest, at any gain.
+ */
+void crossfeed_filter_convert(crossfeed_t *filter, const float *input, void *output,
+                              unsigned int size, struct crossfeed_output *out);
+/*
+ * The output stage of crossfeed_filter_convert on its own, for audio that has
+ * been through crossfeed_filter and further processing since. It shares the
+ * dither state in out.
+ */
+void crossfeed_convert(const float *input, void *output, unsigned int size,
+                       struct crossfeed_output *out);
+/*
+ * Runs size frames of interleaved input[i] through filters[i] for count
+ * streams. Neighbouring streams that share a kernel are filtered together,
+ * with the SIMD lanes running across streams, so keep streams using the same
+ * sample rate next to each other in the array. Output is identical to
+ * calling crossfeed_filter on each stream.
+ */
+void crossfeed_filter_streams(crossfeed_t *filters, unsigned int count, float **input,
+                              float **output, unsigned int size);
+
+/*
+ * The FIR implementation is picked by crossfeed_init from what the CPU
+ * supports. crossfeed_set_isa forces a particular one for filters initialized
+ * afterwards (CROSSFEED_ISA_AUTO restores detection), and fails if the CPU
+ * can't run it.
+ */
+int crossfeed_set_isa(enum crossfeed_isa isa);
+int crossfeed_isa_supported(enum crossfeed_isa isa);
+enum crossfeed_isa crossfeed_get_isa(const crossfeed_t *filter);
+const char *crossfeed_isa_name(enum crossfeed_isa isa);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2013 Jeremy Pepper
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of crossfeed nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CROSSFEED_HPP
+#define CROSSFEED_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+#include "crossfeed.h"
+
+/*
+ * Header-only C++ crossfeed for kernels with a tap count known at compile
+ * time, such as the built-in ones. The FIR is unrolled completely, and
+ * samples are converted from and to the caller's type as they are split and
+ * merged, so integer and double streams need no separate conversion pass.
+ * There is no live control or FFT tail; use crossfeed_t for those.
+ */
+namespace crossfeed {
+
+/*
+ * Conversion between a sample type and floats in [-1, 1]. Integers are read
+ * with full scale at 2^(bits-1) and written clipped with full scale at
+ * 2^(bits-1)-1 and rounding to nearest, as sndfile-crossfeed does.
+ */
+template<typename SampleT> struct sample_traits;
+
+template<> struct sample_traits<float> {
+	static float load(float x) { return x; }
+	static float store(float x) { return x; }
+};
+
+template<> struct sample_traits<double> {
+	static float load(double x) { return x; }
+	static double store(float x) { return x; }
+};
+
+inline long round_sample(float x) {
+#ifdef __SSE__
+	return _mm_cvtss_si32(_mm_set_ss(x));
+#else
+	return lrintf(x);
+#endif
+}
+
+template<> struct sample_traits<int16_t> {
+	static float load(int16_t x) { return x * (1.f / 0x8000); }
+	static int16_t store(float x) {
+		x *= 0x7FFF;
+		return round_sample(x > 0x7FFF ? 0x7FFF : (x < -0x7FFF ? -0x7FFF : x));
+	}
+};
+
+template<> struct sample_traits<int32_t> {
+	static float load(int32_t x) { return x * (1.f / 0x80000000); }
+	/* 2^31-1 rounds up to 2^31 as a float, so the limit is the largest float below it */
+	static int32_t store(float x) {
+		const float limit = 2147483520.f;
+		x *= 2147483648.f;
+		return round_sample(x > limit ? limit : (x < -limit ? -limit : x));
+	}
+};
+
+namespace detail {
+
+/*
+ * Sums side[-t] * kernel[t] for t = T..Taps-1 onto acc in order, with
+ * separate multiplies and adds, matching the C FIR kernels bit for bit.
+ */
+template<unsigned int T, unsigned int Taps> struct fir {
+	static inline float run(const float *side, const float *kernel, float acc) {
+		return fir<T + 1, Taps>::run(side, kernel, acc + side[-(int)T] * kernel[T]);
+	}
+};
+
+template<unsigned int Taps> struct fir<Taps, Taps> {
+	static inline float run(const float *, const float *, float acc) {
+		return acc;
+	}
+};
+
+}
+
+/*
+ * A stereo crossfeed filter with a Taps-tap side kernel, filtering
+ * interleaved SampleT frames. For float samples the output is identical to
+ * crossfeed_filter with the same kernel and delay.
+ */
+template<unsigned int Taps, typename SampleT = float>
+class engine {
+public:
+	static const unsigned int taps = Taps;
+
+	engine() : _delay(0) {
+		memset(_kernel, 0, sizeof(_kernel));
+		reset();
+	}
+
+	/* Copies a kernel of Taps taps; the mid channel is delayed by delay < Taps samples */
+	int init(const float *kernel, unsigned int delay) {
+		if(delay >= Taps)
+			return -1;
+		memcpy(_kernel, kernel, sizeof(_kernel));
+		_delay = delay;
+		reset();
+		return 0;
+	}
+
+	/*
+	 * Takes the kernel of a filter set up by crossfeed_init or
+	 * crossfeed_init_kernel, and fails unless it is a plain FIR of Taps taps.
+	 */
+	int init(const crossfeed_t &filter) {
+		if(filter.len != Taps || filter.fft || filter.iir)
+			return -1;
+		return init(filter.filter, filter.delay);
+	}
+
+	void reset() {
+		memset(_mid, 0, sizeof(_mid));
+		memset(_side, 0, sizeof(_side));
+	}
+
+	void process(const SampleT *input, SampleT *output, unsigned int size) {
+		typedef sample_traits<SampleT> traits;
+		float *mid = _mid + Taps - 1, *side = _side + Taps - 1;
+		const float *dmid = mid - _delay;
+		while(size) {
+			const unsigned int n = size < CROSSFEED_BLOCK_SIZE ? size : CROSSFEED_BLOCK_SIZE;
+			for(unsigned int i=0;i<n;++i) {
+				const float l = traits::load(input[i*2]), r = traits::load(input[i*2+1]);
+				mid[i] = (l + r) / 2;
+				side[i] = (l - r) / 2;
+			}
+			for(unsigned int i=0;i<n;++i) {
+				const float oside = detail::fir<0, Taps>::run(side + i, _kernel, 0.f);
+				const float omid = dmid[i];
+				output[i*2] = traits::store(omid + oside);
+				output[i*2+1] = traits::store(omid - oside);
+			}
+			memmove(_mid, _mid + n, (Taps - 1) * sizeof(float));
+			memmove(_side, _side + n, (Taps - 1) * sizeof(float));
+			input += n*2;
+			output += n*2;
+			size -= n;
+		}
+	}
+
+private:
+	float _mid[Taps - 1 + CROSSFEED_BLOCK_SIZE];
+	float _side[Taps - 1 + CROSSFEED_BLOCK_SIZE];
+	float _kernel[Taps];
+	unsigned int _delay;
+};
+
+/* Engines for the built-in kernels, set up with init on a filter from crossfeed_init */
+template<typename SampleT = float> using engine_44100 = engine<CROSSFEED_TAPS_44100, SampleT>;
+template<typename SampleT = float> using engine_48000 = engine<CROSSFEED_TAPS_48000, SampleT>;
+template<typename SampleT = float> using engine_96000 = engine<CROSSFEED_TAPS_96000, SampleT>;
+
+}
+
+#endif
@@ -31,94 +31,400 @@
 #include <fstream>
 #include <iomanip>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#ifdef __APPLE__
 #include <Accelerate/Accelerate.h>
+#endif
+#ifdef HAVE_FFTW
+#include <fftw3.h>
+#endif
+#include "fft.h"
+#include "kernel_store.h"
+#include "crossfeed.h"
 using namespace std;
 
-static FFTSetup fft_context;
+/*
+ * A 512-point real forward FFT producing 256 bins packed the way
+ * vDSP_fft_zrip does (DC in re[0], Nyquist in im[0]) and scaled like it
+ * too, by twice the plain DFT.
+ *
+ * adjoint applies the transpose of forward, which takes derivatives with
+ * respect to the bins back to derivatives with respect to the samples. It's
+ * an unscaled inverse transform with the two packed bins doubled, and may
+ * overwrite re and im.
+ */
+class fft_backend {
+public:
+	virtual ~fft_backend() {}
+	virtual const char *name() const = 0;
+	virtual void forward(const float *input, float *re, float *im) = 0;
+	virtual void adjoint(float *re, float *im, float *output) = 0;
+};
 
-struct magic {
-	int samplerate;
-	int delay;
-	int len;
-	int offset;
-	int limit;
+/* The radix-2 FFT from fft.c, which needs nothing outside this repository */
+class builtin_fft : public fft_backend {
+public:
+	builtin_fft() { fft_init(&context, 8); }
+	~builtin_fft() { fft_destroy(&context); }
+	const char *name() const { return "builtin"; }
+	void forward(const float *input, float *re, float *im) {
+		fft_real_forward(&context, input, re, im);
+		for(unsigned int i=0;i<256;++i) {
+			re[i] *= 2;
+			im[i] *= 2;
+		}
+	}
+	void adjoint(float *re, float *im, float *output) {
+		re[0] *= 2;
+		im[0] *= 2;
+		fft_real_inverse(&context, re, im, output);
+	}
+private:
+	struct fft context;
 };
 
-static float transfer_function(float x) {
-	return pow(10, (x <= 1500 ? 2 : 2 * log2(x/750)) / -20);
-}
+#ifdef __APPLE__
+class accelerate_fft : public fft_backend {
+public:
+	accelerate_fft() : context(vDSP_create_fftsetup(9, 2)) {}
+	~accelerate_fft() { vDSP_destroy_fftsetup(context); }
+	const char *name() const { return "accelerate"; }
+	void forward(const float *input, float *re, float *im) {
+		DSPSplitComplex response = {re, im};
+		vDSP_ctoz((const DSPComplex *)input, 2, &response, 1, 256);
+		vDSP_fft_zrip(context, &response, 1, 9, FFT_FORWARD);
+	}
+	void adjoint(float *re, float *im, float *output) {
+		DSPSplitComplex response = {re, im};
+		re[0] *= 2;
+		im[0] *= 2;
+		vDSP_fft_zrip(context, &response, 1, 9, FFT_INVERSE);
+		vDSP_ztoc(&response, 1, (DSPComplex *)output, 2, 256);
+	}
+private:
+	FFTSetup context;
+};
+#endif
+
+#ifdef HAVE_FFTW
+/* Only fftwf_execute is thread safe, so planning goes through this */
+static mutex fftw_planner;
+
+class fftw_fft : public fft_backend {
+public:
+	fftw_fft() {
+		lock_guard<mutex> lock(fftw_planner);
+		in = fftwf_alloc_real(512);
+		out = fftwf_alloc_complex(257);
+		plan = fftwf_plan_dft_r2c_1d(512, in, out, FFTW_MEASURE);
+		inverse = fftwf_plan_dft_c2r_1d(512, out, in, FFTW_MEASURE);
+	}
+	~fftw_fft() {
+		lock_guard<mutex> lock(fftw_planner);
+		fftwf_destroy_plan(inverse);
+		fftwf_destroy_plan(plan);
+		fftwf_free(out);
+		fftwf_free(in);
+	}
+	const char *name() const { return "fftw"; }
+	void forward(const float *input, float *re, float *im) {
+		memcpy(in, input, sizeof(float) * 512);
+		fftwf_execute(plan);
+		/* FFTW's exponent sign matches vDSP's, so only the packing differs */
+		re[0] = 2 * out[0][0];
+		im[0] = 2 * out[256][0];
+		for(unsigned int i=1;i<256;++i) {
+			re[i] = 2 * out[i][0];
+			im[i] = 2 * out[i][1];
+		}
+	}
+	void adjoint(float *re, float *im, float *output) {
+		out[0][0] = 2 * re[0];
+		out[0][1] = 0;
+		out[256][0] = 2 * im[0];
+		out[256][1] = 0;
+		for(unsigned int i=1;i<256;++i) {
+			out[i][0] = re[i];
+			out[i][1] = im[i];
+		}
+		fftwf_execute(inverse);
+		memcpy(output, in, sizeof(float) * 512);
+	}
+private:
+	float *in;
+	fftwf_complex *out;
+	fftwf_plan plan;
+	fftwf_plan inverse;
+};
+#endif
 
-static void compute_mono_response(float *result, float *filter, const struct magic *magic) {
-	vDSP_vclr(result, 1, 512);
-	for(unsigned i=0;i<magic->len;++i) {
-		result[i+magic->offset] = filter[i] / 2;
+template<class T> static fft_backend *new_backend() { return new T(); }
+
+/* Every backend compiled in, preferred one first */
+static const struct {
+	const char *name;
+	fft_backend *(*create)();
+} fft_backend_list[] = {
+#ifdef __APPLE__
+	{"accelerate", new_backend<accelerate_fft>},
+#endif
+#ifdef HAVE_FFTW
+	{"fftw", new_backend<fftw_fft>},
+#endif
+	{"builtin", new_backend<builtin_fft>},
+};
+
+/*
+ * Returns a new instance of the named backend, or of the preferred one if
+ * name is NULL, without building any other. Each design thread has its
+ * own, since backends keep scratch buffers.
+ */
+static fft_backend *create_fft_backend(const char *name) {
+	for(unsigned int b=0;b<sizeof(fft_backend_list)/sizeof(fft_backend_list[0]);++b) {
+		if(!name || strcmp(name, fft_backend_list[b].name) == 0)
+			return fft_backend_list[b].create();
 	}
+	return NULL;
 }
 
-static void compute_crossfeed_response(float *result, float *filter, const struct magic *magic) {
-	for(unsigned i=0;i<magic->len;++i) {
-		result[i+magic->offset] = -filter[i] / 2;
+static thread_local fft_backend *fft_context;
+
+struct magic {
+	unsigned int samplerate;
+	unsigned int itd;
+	unsigned int corner;
+	unsigned int delay;
+	unsigned int len;
+	unsigned int limit;
+};
+
+/* A side channel kernel's target response, packed like fft_backend's output */
+struct target {
+	float re[256];
+	float im[256];
+};
+
+/* 2dB down to the corner frequency, then 2dB more per octave */
+static float transfer_function(float x, float corner) {
+	return pow(10, (x <= corner ? 2 : 2 * log2(x/(corner/2))) / -20);
+}
+
+/*
+ * The error at one bin of the crossfeed response a kernel with response k
+ * gives, half of one minus k, against the one the target t gives, and its
+ * derivatives with respect to k. With gain_only, the phase isn't judged.
+ */
+static float bin_error(float k_re, float k_im, float t_re, float t_im, bool gain_only,
+                       float &d_re, float &d_im) {
+	if(!gain_only) {
+		float err_re = (k_re - t_re) / 2, err_im = (k_im - t_im) / 2;
+		d_re = err_re;
+		d_im = err_im;
+		return err_re*err_re + err_im*err_im;
 	}
-	result[magic->offset] += 0.5;
+	float magnitude = hypot(1 - k_re, k_im);
+	float err = (magnitude - hypot(1 - t_re, t_im)) / 2;
+	d_re = magnitude > 0 ? -err * (1 - k_re) / magnitude : 0;
+	d_im = magnitude > 0 ? err * k_im / magnitude : 0;
+	return err*err;
 }
 
-static double compute_error(float *filter, float *transfer_fn, const struct magic *magic) {
+/*
+ * Returns the error of a side channel kernel against the target, as
+ * crossfeed_init_kernel runs it with the mid channel undelayed: the mean
+ * squared difference between the crossfeed response it gives and the one
+ * it should. Above the corner only the crossfeed's gain is judged, since
+ * the interaural delay stops mattering around there, and following its
+ * phase further would cost a biquad cascade everything below. If gradient
+ * isn't NULL, it also receives the error's gradient with respect to each
+ * tap, found by running the derivatives with respect to each bin back
+ * through the transpose of the FFT.
+ */
+static double compute_error(const float *filter, const struct target *target,
+                            const struct magic *magic, float *gradient = NULL) {
+	const float bin_width = magic->samplerate / 512.;
 	float result[512];
-	float response_memory[512];
-	float response_interleaved[512];
-	DSPSplitComplex response = {response_memory, response_memory + 256};
-	float crossfeed_error = 0, mono_error = 0;
-	compute_mono_response(result, filter, magic);
-	vDSP_ctoz((DSPComplex *)result, 2, &response, 1, 256);
-	vDSP_fft_zrip(fft_context, &response, 1, 9, FFT_FORWARD);
-	vDSP_ztoc(&response, 1, (DSPComplex *)response_interleaved, 2, 256);
-	vDSP_polar(response_interleaved, 2, response_interleaved, 2, 256);
-	for(unsigned int i=0;i<256;++i) {
-		float err = 1 - 0.5 * response_interleaved[2*i];
-		mono_error += err*err;
-	}
-	compute_crossfeed_response(result, filter, magic);
-	vDSP_ctoz((DSPComplex *)result, 2, &response, 1, 256);
-	vDSP_fft_zrip(fft_context, &response, 1, 9, FFT_FORWARD);
-	vDSP_ztoc(&response, 1, (DSPComplex *)response_interleaved, 2, 256);
-	for(unsigned int i=0;i<magic->limit;++i) {
-		float freq = (i * magic->samplerate) / 512.;
-		float delay = (magic->delay * 1000000.) / magic->samplerate - (0.5*transfer_fn[i] - pow(10, -2./20)) * 500;
-		float phase = 2*M_PI*((magic->delay / 1000000.) / (1. / freq));		
-		float err_s = transfer_fn[i]*sin(phase) - 0.5 * response_interleaved[2*i];
-		float err_c = transfer_fn[i]*sin(phase) - 0.5 * response_interleaved[2*i+1];
-		crossfeed_error += (err_s*err_s + err_c*err_c) / 2;
-	}
-	return (mono_error / 256) + (crossfeed_error / magic->limit);
+	float re[256], im[256];
+	float error = 0, d_re, d_im, d_nyquist;
+	copy(filter, filter + magic->len, result);
+	fill(result + magic->len, result + 512, 0.f);
+	fft_context->forward(result, re, im);
+	/* the forward transform is twice the DFT, and packs Nyquist in with DC */
+	error += bin_error(0.5 * re[0], 0, target->re[0], 0, false, d_re, d_im);
+	error += bin_error(0.5 * im[0], 0, target->im[0], 0, 256 * bin_width > magic->corner,
+	                   d_nyquist, d_im);
+	re[0] = 0.5 * d_re / magic->limit;
+	im[0] = 0.5 * d_nyquist / magic->limit;
+	for(unsigned int i=1;i<256;++i) {
+		if(i < magic->limit) {
+			error += bin_error(0.5 * re[i], 0.5 * im[i], target->re[i], target->im[i],
+			                   i * bin_width > magic->corner, d_re, d_im);
+		} else {
+			d_re = d_im = 0;
+		}
+		re[i] = 0.5 * d_re / magic->limit;
+		im[i] = 0.5 * d_im / magic->limit;
+	}
+	if(gradient) {
+		fft_context->adjoint(re, im, result);
+		copy(result, result + magic->len, gradient);
+	}
+	return error / magic->limit;
 }
 
 static double window_fn(int i, int N) {
 	return 0.42 - 0.5 * cos((2*M_PI*i)/(N-1)) + 0.08 * cos((4*M_PI*i)/(N-1));
 }
 
-int main(int argc, char *argv[]) {
-	ios_base::sync_with_stdio(false);
-	float filter[74] = {0};
-	float slope[74];
-	float weight[74];
-	float transfer_fn[256];
-	float mu = 0.2;
-	float err;
-	unsigned int pass = 0;
-	const float delta = 0.00001;
-	struct magic magic;
-	magic.samplerate = argc > 1 ? atoi(argv[1]) : 96000;
-	magic.delay = (magic.samplerate * 250) / 1000000;
+/*
+ * The crossfeed response aimed for is half the transfer function, where the
+ * built-in kernels sit, delayed by the interaural delay, so the kernel
+ * should be one minus twice that.
+ */
+static void init_magic(struct magic &magic, struct target *target, int samplerate, int itd,
+                       int corner) {
+	magic.samplerate = samplerate;
+	magic.itd = itd;
+	magic.corner = corner;
+	magic.delay = ((long long)magic.samplerate * itd) / 1000000;
 	magic.len = 3 * magic.delay + 2;
-	magic.offset = 256 - magic.len / 2;
 	magic.limit = 256;
-	if(magic.limit > 256)
-		magic.limit = 256;
-	for(unsigned int i=0;i<256;++i) {
-		transfer_fn[i] = transfer_function((i * magic.samplerate) / 512.);
+	for(unsigned int i=0;i<=256;++i) {
+		float freq = (i * magic.samplerate) / 512.;
+		float phase = 2*M_PI*freq*(itd / 1000000.);
+		float gain = transfer_function(freq, magic.corner);
+		/* Nyquist is real, and packed into the imaginary part of DC */
+		if(i == 256) {
+			target->im[0] = 1 - gain * cos(phase);
+		} else {
+			target->re[i] = 1 - gain * cos(phase);
+			if(i)
+				target->im[i] = gain * sin(phase);
+		}
+	}
+}
+
+/* Starts from a kernel that doesn't crossfeed at all */
+static void init_filter(vector<float> &filter, const struct magic &magic) {
+	filter.assign(magic.len, 0);
+	filter[0] = 1;
+}
+
+static double dot(const vector<float> &a, const vector<float> &b) {
+	double sum = 0;
+	for(unsigned int i=0;i<a.size();++i) {
+		sum += a[i] * b[i];
+	}
+	return sum;
+}
+
+/*
+ * Minimizes error(x, gradient), which returns the error at x and its
+ * gradient, with L-BFGS starting from x, and returns the final error. weight
+ * is the diagonal of the initial inverse Hessian, and each step is found by
+ * backtracking until the error drops by a fraction of what the gradient
+ * predicts.
+ */
+template<typename Error>
+static float minimize(vector<float> &x, const vector<float> &weight, Error error, bool verbose) {
+	const unsigned int history = 8, n = x.size();
+	float err;
+	unsigned int pass = 0;
+	vector<float> gradient(n), direction(n);
+	vector<float> new_x(n), new_gradient(n);
+	vector<vector<float> > s, y;
+	vector<double> rho, alpha(history);
+	err = error(&x[0], &gradient[0]);
+	while(err >= 1. / (1 << 24)) {
+		/* two-loop recursion for direction = -H * gradient */
+		direction = gradient;
+		for(int j=s.size()-1;j>=0;--j) {
+			alpha[j] = rho[j] * dot(s[j], direction);
+			for(unsigned int i=0;i<n;++i) {
+				direction[i] -= alpha[j] * y[j][i];
+			}
+		}
+		for(unsigned int i=0;i<n;++i) {
+			direction[i] *= weight[i] * (s.empty() ? 0.2 : dot(s.back(), y.back()) / dot(y.back(), y.back()));
+		}
+		for(unsigned int j=0;j<s.size();++j) {
+			double beta = rho[j] * dot(y[j], direction);
+			for(unsigned int i=0;i<n;++i) {
+				direction[i] += (alpha[j] - beta) * s[j][i];
+			}
+		}
+		for(unsigned int i=0;i<n;++i) {
+			direction[i] = -direction[i];
+		}
+		double slope = dot(gradient, direction);
+		if(slope >= 0)
+			break;
+		float step = 1, new_err;
+		while(true) {
+			for(unsigned int i=0;i<n;++i) {
+				new_x[i] = x[i] + step * direction[i];
+			}
+			new_err = error(&new_x[0], &new_gradient[0]);
+			if(new_err <= err + 0.0001 * step * slope || step < 1. / (1 << 24))
+				break;
+			step /= 2;
+		}
+		if(new_err >= err)
+			break;
+		if(s.size() == history) {
+			s.erase(s.begin());
+			y.erase(y.begin());
+			rho.erase(rho.begin());
+		}
+		s.push_back(vector<float>(n));
+		y.push_back(vector<float>(n));
+		for(unsigned int i=0;i<n;++i) {
+			s.back()[i] = new_x[i] - x[i];
+			y.back()[i] = new_gradient[i] - gradient[i];
+		}
+		double curvature = dot(s.back(), y.back());
+		if(curvature > 0) {
+			rho.push_back(1 / curvature);
+		} else {
+			/* not a useful curvature pair, so restart from the window */
+			s.clear();
+			y.clear();
+			rho.clear();
+		}
+		x = new_x;
+		gradient = new_gradient;
+		err = new_err;
+		if(verbose && pass % 100 == 0) {
+			cout << "Pass " << pass << ", error: " << pow(10, err/20) << "dBFS" << endl;
+		}
+		++pass;
 	}
-	filter[magic.delay] = 1;
-	filter[2*magic.delay+1] = -1;
+	if(verbose)
+		cout << "Pass " << pass << ", error: " << pow(10, err/20) << "dBFS" << endl;
+	return err;
+}
+
+/*
+ * Runs L-BFGS for one sample rate and returns the kernel's error. The
+ * window that used to scale each tap's step serves as the initial inverse
+ * Hessian.
+ */
+static float design(vector<float> &filter, struct magic &magic, bool verbose) {
+	struct target target;
+	init_magic(magic, &target, magic.samplerate, magic.itd, magic.corner);
+	vector<float> weight(magic.len);
+	init_filter(filter, magic);
 	for(unsigned int i=0;i<magic.len;++i) {
 		if(i < magic.delay) {
 			weight[i] = window_fn(i, 2*magic.delay+1);
@@ -128,37 +434,509 @@ int main(int argc, char *argv[]) {
 			weight[i] = weight[magic.len - i];
 		}
 	}
-	fft_context = vDSP_create_fftsetup(9, 2);
-	err = compute_error(filter, transfer_fn, &magic);
-	while(true) {
-		if(err < 1. / (1 << 24) || mu < 1. / (1 << 24))
-			break;
-		float new_filter[74];
-		memcpy(new_filter, filter, 74*sizeof(float));
-		for(unsigned int i=0; i<magic.len; ++i) {
-			new_filter[i] += delta;
-			slope[i] = (compute_error(new_filter, transfer_fn, &magic) - err) / delta;
-			new_filter[i] = filter[i];
-		}
-		for(unsigned int i=0; i<magic.len; ++i) {
-			new_filter[i] -= slope[i] * weight[i] * mu;
-		}
-		float new_err = compute_error(new_filter, transfer_fn, &magic);
-		if(new_err < err) {
-			memcpy(filter, new_filter, 74*sizeof(float));
-			err = new_err;
+	return minimize(filter, weight, [&](const float *taps, float *gradient) {
+		return compute_error(taps, &target, &magic, gradient);
+	}, verbose);
+}
+
+/*
+ * Biquad cascades are optimized over five parameters per section: b0, b1
+ * and b2 as they are, and two that tanh maps onto every a1 and a2 with both
+ * poles inside IIR_MAX_RADIUS. Every step is then stable, and the impulse
+ * response decays by about 2^-12 within the FFT window, so cutting it off
+ * there changes little.
+ */
+#define IIR_MAX_RADIUS 0.97
+#define IIR_STARTS 4
+
+/*
+ * Fills in b0, b1, b2, a1, a2 for each section, and if derivatives isn't
+ * NULL, da2/dp, da1/dp and da1/dq for the two pole parameters p and q.
+ */
+static void iir_coefficients(const float *params, unsigned int sections, double *coefficients,
+                             double *derivatives = NULL) {
+	const double r2 = IIR_MAX_RADIUS * IIR_MAX_RADIUS;
+	for(unsigned int s=0;s<sections;++s) {
+		const float *p = &params[s*5];
+		double *c = &coefficients[s*5];
+		const double tp = tanh(p[3]), tq = tanh(p[4]);
+		c[0] = p[0];
+		c[1] = p[1];
+		c[2] = p[2];
+		c[4] = r2 * tp;
+		c[3] = IIR_MAX_RADIUS * (1 + c[4] / r2) * tq;
+		if(derivatives) {
+			derivatives[s*3] = r2 * (1 - tp*tp);
+			derivatives[s*3+1] = IIR_MAX_RADIUS * tq * (1 - tp*tp);
+			derivatives[s*3+2] = IIR_MAX_RADIUS * (1 + c[4] / r2) * (1 - tq*tq);
+		}
+	}
+}
+
+/* Runs x through a section in place, or through just its poles */
+static void run_section(const double *c, vector<double> &x, bool poles_only) {
+	double x1 = 0, x2 = 0, y1 = 0, y2 = 0;
+	for(unsigned int i=0;i<x.size();++i) {
+		const double in = x[i];
+		const double y = (poles_only ? in : c[0] * in + c[1] * x1 + c[2] * x2) - c[3] * y1 - c[4] * y2;
+		x2 = x1;
+		x1 = in;
+		y2 = y1;
+		y1 = y;
+		x[i] = y;
+	}
+}
+
+/*
+ * Returns the error of a cascade against the target crossfeed response as
+ * crossfeed_init_iir runs it, on the side channel delayed by delay samples
+ * with the mid channel undelayed, judging its impulse response over
+ * magic->len taps like a FIR kernel's. If gradient isn't NULL, it also receives the
+ * error's gradient with respect to each parameter: the impulse response's
+ * derivative with respect to a section's b_j is the response of the other
+ * sections and that section's poles, delayed by j, and with respect to its
+ * a_j, the whole response through that section's poles again, delayed by j
+ * and negated.
+ */
+static double compute_iir_error(const float *params, unsigned int sections, unsigned int delay,
+                                const struct target *target, const struct magic *magic,
+                                float *gradient = NULL) {
+	const unsigned int len = magic->len;
+	vector<double> coefficients(sections * 5), derivatives(sections * 3);
+	vector<double> response(len, 0);
+	vector<float> taps(len), taps_gradient(len);
+	double err;
+	iir_coefficients(params, sections, &coefficients[0], &derivatives[0]);
+	response[delay] = 1;
+	for(unsigned int s=0;s<sections;++s) {
+		run_section(&coefficients[s*5], response, false);
+	}
+	for(unsigned int i=0;i<len;++i) {
+		taps[i] = response[i];
+	}
+	err = compute_error(&taps[0], target, magic, gradient ? &taps_gradient[0] : NULL);
+	if(!gradient)
+		return err;
+	for(unsigned int s=0;s<sections;++s) {
+		vector<double> others(len, 0), again(response);
+		double db[3] = {0}, da[2] = {0};
+		others[delay] = 1;
+		for(unsigned int o=0;o<sections;++o) {
+			run_section(&coefficients[o*5], others, o == s);
+		}
+		run_section(&coefficients[s*5], again, true);
+		for(unsigned int j=0;j<3;++j) {
+			for(unsigned int t=j;t<len;++t) {
+				db[j] += taps_gradient[t] * others[t-j];
+				if(j)
+					da[j-1] -= taps_gradient[t] * again[t-j];
+			}
+		}
+		gradient[s*5] = db[0];
+		gradient[s*5+1] = db[1];
+		gradient[s*5+2] = db[2];
+		gradient[s*5+3] = da[1] * derivatives[s*3] + da[0] * derivatives[s*3+1];
+		gradient[s*5+4] = da[0] * derivatives[s*3+2];
+	}
+	return err;
+}
+
+/* A biquad cascade fitted to the same target as a kernel */
+struct iir_fit {
+	unsigned int delay;
+	vector<float> params;
+	vector<float> coefficients;
+	float error;
+};
+
+/*
+ * Fits a cascade of sections biquads to the crossfeed response magic
+ * describes, judged over the whole FFT window rather than the kernel's
+ * length. Cascades are fitted from a few starting points for each side
+ * channel delay up to the kernel's length, and the best one kept. Fails if
+ * none of them came out with a finite error.
+ */
+static bool design_iir(struct iir_fit &fit, unsigned int sections, const struct magic &magic) {
+	struct target target;
+	struct magic window = magic;
+	unsigned int seed = 1;
+	init_magic(window, &target, magic.samplerate, magic.itd, magic.corner);
+	window.len = 512;
+	vector<float> weight(sections * 5, 1);
+	fit.delay = 0;
+	fit.params.clear();
+	fit.coefficients.clear();
+	fit.error = numeric_limits<float>::infinity();
+	for(unsigned int delay=0;delay<magic.len;delay+=(magic.delay+3)/4) {
+		for(unsigned int start=0;start<IIR_STARTS;++start) {
+			vector<float> params(sections * 5);
+			float err;
+			/* pass-through sections with poles scattered around the circle */
+			for(unsigned int s=0;s<sections;++s) {
+				seed = seed * 1664525 + 1013904223;
+				params[s*5] = s ? 1 : 0.5;
+				params[s*5+3] = (seed >> 16) / 65536. - 0.5;
+				params[s*5+4] = (seed & 0xFFFF) / 65536. * 2 - 1;
+			}
+			err = minimize(params, weight, [&](const float *p, float *gradient) {
+				return compute_iir_error(p, sections, delay, &target, &window, gradient);
+			}, false);
+			if(err < fit.error) {
+				fit.error = err;
+				fit.delay = delay;
+				fit.params = params;
+			}
+		}
+	}
+	if(fit.params.empty())
+		return false;
+	vector<double> coefficients(sections * 5);
+	iir_coefficients(&fit.params[0], sections, &coefficients[0]);
+	fit.coefficients.assign(coefficients.begin(), coefficients.end());
+	return true;
+}
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Times each backend's FFT, and compute_error with and without the gradient.
+ * A design pass costs one gradient evaluation plus one more for each step
+ * the line search backs off.
+ */
+static void benchmark(int samplerate) {
+	struct magic magic;
+	struct target target;
+	vector<float> filter, gradient;
+	init_magic(magic, &target, samplerate, 250, 1500);
+	init_filter(filter, magic);
+	gradient.resize(magic.len);
+	cout << "backend        error     ns/fft    ns/call    ns/grad" << endl;
+	for(unsigned int b=0;b<sizeof(fft_backend_list)/sizeof(fft_backend_list[0]);++b) {
+		float input[512] = {1}, re[256], im[256];
+		double start, elapsed, fft_time, call_time, err = 0;
+		unsigned long calls = 0;
+		fft_context = fft_backend_list[b].create();
+		start = now();
+		do {
+			for(unsigned int i=0;i<1000;++i) {
+				fft_context->forward(input, re, im);
+			}
+			calls += 1000;
+		} while((elapsed = now() - start) < 1);
+		fft_time = elapsed / calls;
+		start = now();
+		calls = 0;
+		do {
+			for(unsigned int i=0;i<1000;++i) {
+				err = compute_error(&filter[0], &target, &magic);
+			}
+			calls += 1000;
+		} while((elapsed = now() - start) < 1);
+		call_time = elapsed / calls;
+		start = now();
+		calls = 0;
+		do {
+			for(unsigned int i=0;i<1000;++i) {
+				compute_error(&filter[0], &target, &magic, &gradient[0]);
+			}
+			calls += 1000;
+		} while((elapsed = now() - start) < 1);
+		cout << left << setw(10) << fft_context->name() << right << fixed
+		     << setprecision(6) << setw(11) << err
+		     << setprecision(1) << setw(11) << fft_time * 1e9
+		     << setw(11) << call_time * 1e9
+		     << setw(11) << elapsed * 1e9 / calls << endl;
+		delete fft_context;
+	}
+}
+
+/* One point of the design grid */
+struct design_job {
+	struct magic magic;
+	vector<float> filter;
+	float error;
+	struct iir_fit iir;
+	double seconds;
+};
+
+/* Adds the comma-separated numbers in list to values */
+static bool parse_list(const char *list, vector<int> &values) {
+	while(*list) {
+		char *end;
+		long value = strtol(list, &end, 10);
+		if(end == list || value <= 0 || (*end && *end != ','))
+			return false;
+		values.push_back(value);
+		list = *end ? end + 1 : end;
+	}
+	return true;
+}
+
+/*
+ * Designs jobs in parallel, each thread taking the next undesigned job and
+ * printing its error and time as it finishes. With sections above 0, each
+ * job also gets a cascade of that many biquads.
+ */
+static bool run_jobs(vector<design_job> &jobs, unsigned int threads, const char *backend_name,
+                     unsigned int sections) {
+	atomic<unsigned int> next(0);
+	mutex output_lock;
+	vector<thread> workers;
+	bool ok = true;
+	for(unsigned int t=0;t<threads;++t) {
+		workers.push_back(thread([&]() {
+			fft_context = create_fft_backend(backend_name);
+			if(!fft_context) {
+				ok = false;
+				return;
+			}
+			for(unsigned int j;(j = next++) < jobs.size();) {
+				double start = now();
+				jobs[j].error = design(jobs[j].filter, jobs[j].magic, jobs.size() == 1);
+				if(sections && !design_iir(jobs[j].iir, sections, jobs[j].magic)) {
+					lock_guard<mutex> lock(output_lock);
+					cerr << jobs[j].magic.samplerate << " Hz: no biquad cascade converged" << endl;
+					ok = false;
+					continue;
+				}
+				jobs[j].seconds = now() - start;
+				lock_guard<mutex> lock(output_lock);
+				cout << setw(7) << jobs[j].magic.samplerate << " Hz "
+				     << setw(5) << jobs[j].magic.itd << " us "
+				     << setw(6) << jobs[j].magic.corner << " Hz  "
+				     << setw(3) << jobs[j].magic.len << " taps  error "
+				     << fixed << setprecision(6) << jobs[j].error << "  ";
+				if(sections) {
+					cout << sections << " biquads, delay " << setw(2) << jobs[j].iir.delay
+					     << "  error " << jobs[j].iir.error << "  ";
+				}
+				cout << setprecision(1) << jobs[j].seconds * 1000 << " ms" << endl;
+			}
+			delete fft_context;
+		}));
+	}
+	for(unsigned int t=0;t<threads;++t) {
+		workers[t].join();
+	}
+	return ok;
+}
+
+/*
+ * Returns what filtering costs per frame: TSC cycles on x86, and
+ * nanoseconds elsewhere. Takes the best of several runs.
+ */
+static double runtime_cost(crossfeed_t *filter) {
+	static float buffer[1024*2];
+	double best = numeric_limits<double>::infinity();
+	for(unsigned int i=0;i<1024*2;++i) {
+		buffer[i] = (i * 7919 % 2003) / 1001.5f - 1;
+	}
+	for(unsigned int run=0;run<16;++run) {
+#if defined(__x86_64__) || defined(__i386__)
+		const unsigned long long start = __rdtsc();
+#else
+		const double start = now() * 1e9;
+#endif
+		for(unsigned int i=0;i<64;++i) {
+			crossfeed_filter(filter, buffer, buffer, 1024);
+		}
+#if defined(__x86_64__) || defined(__i386__)
+		const double cost = (double)(__rdtsc() - start) / (64 * 1024);
+#else
+		const double cost = (now() * 1e9 - start) / (64 * 1024);
+#endif
+		if(cost < best)
+			best = cost;
+	}
+	return best;
+}
+
+/*
+ * Compares each job's cascade with its kernel: the error of both against
+ * the target, and what each costs to run through crossfeed_filter, with the
+ * kernel on the FIR implementation picked for this CPU and on the scalar one.
+ */
+static void compare_iir(const vector<design_job> &jobs, unsigned int sections) {
+#if defined(__x86_64__) || defined(__i386__)
+	const char *unit = "cycles/frame";
+#else
+	const char *unit = "ns/frame";
+#endif
+	cout << "   rate  taps  FIR error  IIR error      FIR   scalar      IIR  (" << unit << ")" << endl;
+	for(unsigned int j=0;j<jobs.size();++j) {
+		const design_job &job = jobs[j];
+		crossfeed_t fir, scalar, iir;
+		double fir_cost = 0, scalar_cost = 0, iir_cost = 0;
+		if(!crossfeed_init_kernel(&fir, &job.filter[0], job.filter.size(), 0)) {
+			fir_cost = runtime_cost(&fir);
+			crossfeed_destroy(&fir);
+		}
+		crossfeed_set_isa(CROSSFEED_ISA_SCALAR);
+		if(!crossfeed_init_kernel(&scalar, &job.filter[0], job.filter.size(), 0)) {
+			scalar_cost = runtime_cost(&scalar);
+			crossfeed_destroy(&scalar);
+		}
+		crossfeed_set_isa(CROSSFEED_ISA_AUTO);
+		if(!crossfeed_init_iir(&iir, &job.iir.coefficients[0], sections, job.iir.delay)) {
+			iir_cost = runtime_cost(&iir);
+			crossfeed_destroy(&iir);
+		}
+		cout << setw(7) << job.magic.samplerate << setw(6) << job.magic.len
+		     << fixed << setprecision(6) << setw(11) << job.error << setw(11) << job.iir.error
+		     << setprecision(1) << setw(9) << fir_cost << setw(9) << scalar_cost
+		     << setw(9) << iir_cost << endl;
+	}
+}
+
+/*
+ * Usage: designer [-f backend] [-b] [-j threads] [-i sections] [-o store]
+ *                 [-r rates] [-d itds] [-c corners] [samplerate...]
+ *
+ * Designs a kernel for every combination of sample rate (96000 by default),
+ * interaural delay in microseconds (-d, 250 by default) and transfer
+ * function corner frequency (-c, 1500Hz by default), each given as a
+ * comma-separated list, on -j threads (all cores by default). Kernels are
+ * side channel kernels to run with the mid channel undelayed, like the
+ * built-in ones. Without -o the last kernel is written to filter.txt; with
+ * it, all of them are written to a kernel store for crossfeed_load_kernels,
+ * where the first delay and corner listed are what crossfeed_init picks for
+ * each rate. -f picks the FFT
+ * backend, and -b benchmarks every backend on the first rate instead of
+ * designing.
+ *
+ * -i also fits a cascade of that many biquads to each target for
+ * crossfeed_init_iir, and compares its error and cost with the kernel's.
+ * The cascades then take the kernels' place in the store, or in filter.txt
+ * as the side channel delay followed by b0, b1, b2, a1 and a2 for each
+ * section.
+ */
+int main(int argc, char *argv[]) {
+	ios_base::sync_with_stdio(false);
+	const char *store_path = NULL;
+	const char *backend_name = NULL;
+	bool bench = false;
+	unsigned int threads = thread::hardware_concurrency();
+	unsigned int sections = 0;
+	vector<int> rates, itds, corners;
+	vector<design_job> jobs;
+	vector<struct kernel_store_entry> entries;
+	vector<const float *> taps;
+	double start;
+	for(int i=1;i<argc;++i) {
+		bool ok = true;
+		if(strcmp("-o", argv[i]) == 0 && i + 1 < argc) {
+			store_path = argv[++i];
+		} else if(strcmp("-f", argv[i]) == 0 && i + 1 < argc) {
+			backend_name = argv[++i];
+		} else if(strcmp("-j", argv[i]) == 0 && i + 1 < argc) {
+			threads = atoi(argv[++i]);
+		} else if(strcmp("-i", argv[i]) == 0 && i + 1 < argc) {
+			sections = atoi(argv[++i]);
+			ok = sections >= 1 && sections <= CROSSFEED_MAX_SECTIONS;
+		} else if(strcmp("-r", argv[i]) == 0 && i + 1 < argc) {
+			ok = parse_list(argv[++i], rates);
+		} else if(strcmp("-d", argv[i]) == 0 && i + 1 < argc) {
+			ok = parse_list(argv[++i], itds);
+		} else if(strcmp("-c", argv[i]) == 0 && i + 1 < argc) {
+			ok = parse_list(argv[++i], corners);
+		} else if(strcmp("-b", argv[i]) == 0) {
+			bench = true;
 		} else {
-			mu /= 2;
+			ok = parse_list(argv[i], rates);
 		}
-		if(pass % 100 == 0) {
-			cout << "Pass " << pass << ", error: " << pow(10, err/20) << "dBFS" << endl;
+		if(!ok) {
+			cerr << "Bad argument " << argv[i] << endl;
+			return 1;
 		}
-		++pass;
+	}
+	if(rates.empty())
+		rates.push_back(96000);
+	if(itds.empty())
+		itds.push_back(250);
+	if(corners.empty())
+		corners.push_back(1500);
+	if(!threads)
+		threads = 1;
+	if(bench) {
+		benchmark(rates[0]);
+		return 0;
+	}
+	if(backend_name) {
+		fft_backend *backend = create_fft_backend(backend_name);
+		if(!backend) {
+			cerr << "Unknown FFT backend " << backend_name << endl;
+			return 1;
+		}
+		delete backend;
+	}
+	for(unsigned int r=0;r<rates.size();++r) {
+		for(unsigned int d=0;d<itds.size();++d) {
+			for(unsigned int c=0;c<corners.size();++c) {
+				design_job job = design_job();
+				job.magic.samplerate = rates[r];
+				job.magic.itd = itds[d];
+				job.magic.corner = corners[c];
+				/* the kernel and its response have to fit in the 512-point FFT */
+				long long delay = ((long long)rates[r] * itds[d]) / 1000000;
+				if(delay < 1 || 3 * delay + 2 > 256) {
+					cerr << "Skipping " << rates[r] << " Hz with " << itds[d]
+					     << " us delay, which needs 1 to 84 samples of delay" << endl;
+					continue;
+				}
+				jobs.push_back(job);
+			}
+		}
+	}
+	if(jobs.empty())
+		return 1;
+	if(threads > jobs.size())
+		threads = jobs.size();
+	start = now();
+	if(!run_jobs(jobs, threads, backend_name, sections))
+		return 1;
+	if(jobs.size() > 1) {
+		cout << jobs.size() << " designs on " << threads << " threads in "
+		     << setprecision(2) << now() - start << " s" << endl;
+	}
+	if(sections)
+		compare_iir(jobs, sections);
+	if(store_path) {
+		for(unsigned int j=0;j<jobs.size();++j) {
+			struct kernel_store_entry entry = {0};
+			entry.samplerate = jobs[j].magic.samplerate;
+			entry.itd = jobs[j].magic.itd;
+			entry.corner = jobs[j].magic.corner;
+			if(sections) {
+				entry.delay = jobs[j].iir.delay;
+				entry.len = sections * 5;
+				entry.sections = sections;
+				taps.push_back(&jobs[j].iir.coefficients[0]);
+			} else {
+				entry.len = jobs[j].magic.len;
+				taps.push_back(&jobs[j].filter[0]);
+			}
+			entries.push_back(entry);
+		}
+		if(kernel_store_write(store_path, &entries[0], &taps[0], entries.size())) {
+			cerr << "Error writing " << store_path << endl;
+			return 1;
+		}
+		return 0;
 	}
 	ofstream output("filter.txt");
 	output << setprecision(numeric_limits<float>::digits10+2);
-	for(unsigned int i=0;i<magic.len;++i) {
-		output << filter[i] << '\n';
+	if(sections) {
+		output << jobs.back().iir.delay << '\n';
+		for(unsigned int i=0;i<sections*5;++i) {
+			output << jobs.back().iir.coefficients[i] << (i % 5 == 4 ? '\n' : ' ');
+		}
+		return 0;
+	}
+	for(unsigned int i=0;i<jobs.back().filter.size();++i) {
+		output << jobs.back().filter[i] << '\n';
 	}
-	vDSP_destroy_fftsetup(fft_context);
 }
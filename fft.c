@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2013 Jeremy Pepper
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of crossfeed nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "fft.h"
+#include <stdlib.h>
+#include <math.h>
+
+/*
+ * Twiddle factors are stored per stage: the half butterflies of the stage
+ * combining blocks of size 2*half use cos[half..2*half-1] and
+ * sin[half..2*half-1], so the inner loop reads them contiguously. The
+ * negated sines follow at sin[n..2*n-1] for the forward transform.
+ */
+int fft_init(struct fft *fft, unsigned int log2n) {
+	const unsigned int n = 1u << log2n;
+	fft->n = n;
+	fft->log2n = log2n;
+	fft->cos = malloc(sizeof(float) * n);
+	fft->sin = malloc(sizeof(float) * 2 * n);
+	fft->rcos = malloc(sizeof(float) * n);
+	fft->rsin = malloc(sizeof(float) * n);
+	fft->bitrev = malloc(sizeof(unsigned int) * n);
+	if(!fft->cos || !fft->sin || !fft->rcos || !fft->rsin || !fft->bitrev) {
+		fft_destroy(fft);
+		return -1;
+	}
+	for(unsigned int half=1;half<n;half*=2) {
+		for(unsigned int k=0;k<half;++k) {
+			fft->cos[half + k] = cos((M_PI*k)/half);
+			fft->sin[half + k] = sin((M_PI*k)/half);
+			fft->sin[n + half + k] = -fft->sin[half + k];
+		}
+	}
+	for(unsigned int k=0;k<n;++k) {
+		fft->rcos[k] = cos((M_PI*k)/n);
+		fft->rsin[k] = sin((M_PI*k)/n);
+	}
+	for(unsigned int i=0;i<n;++i) {
+		unsigned int r = 0;
+		for(unsigned int b=0;b<log2n;++b) {
+			r |= ((i >> b) & 1) << (log2n - 1 - b);
+		}
+		fft->bitrev[i] = r;
+	}
+	return 0;
+}
+
+static void fft_transform(const struct fft *fft, float *restrict re, float *restrict im,
+                          const float *restrict sin) {
+	const unsigned int n = fft->n;
+	const float *restrict cos = fft->cos;
+	for(unsigned int i=0;i<n;++i) {
+		const unsigned int j = fft->bitrev[i];
+		if(i < j) {
+			float t = re[i]; re[i] = re[j]; re[j] = t;
+			t = im[i]; im[i] = im[j]; im[j] = t;
+		}
+	}
+	for(unsigned int i=0;i<n;i+=2) {
+		const float tr = re[i+1], ti = im[i+1];
+		re[i+1] = re[i] - tr;
+		im[i+1] = im[i] - ti;
+		re[i] += tr;
+		im[i] += ti;
+	}
+	for(unsigned int half=2;half<n;half*=2) {
+		const float *restrict wr = cos + half, *restrict wi = sin + half;
+		for(unsigned int start=0;start<n;start+=2*half) {
+			float *restrict ar = re + start, *restrict ai = im + start;
+			float *restrict br = ar + half, *restrict bi = ai + half;
+			for(unsigned int k=0;k<half;++k) {
+				const float tr = br[k] * wr[k] - bi[k] * wi[k];
+				const float ti = br[k] * wi[k] + bi[k] * wr[k];
+				br[k] = ar[k] - tr;
+				bi[k] = ai[k] - ti;
+				ar[k] += tr;
+				ai[k] += ti;
+			}
+		}
+	}
+}
+
+void fft_forward(const struct fft *fft, float *re, float *im) {
+	fft_transform(fft, re, im, fft->sin + fft->n);
+}
+
+void fft_inverse(const struct fft *fft, float *re, float *im) {
+	fft_transform(fft, re, im, fft->sin);
+}
+
+/*
+ * A 2n-point real transform is done as an n-point complex transform of the
+ * even samples (real part) and odd samples (imaginary part), whose spectra
+ * E and O are then separated by conjugate symmetry and recombined as
+ * X[k] = E[k] + e^(-i*pi*k/n) * O[k].
+ */
+void fft_real_forward(const struct fft *fft, const float *input, float *re, float *im) {
+	const unsigned int n = fft->n;
+	for(unsigned int i=0;i<n;++i) {
+		re[i] = input[2*i];
+		im[i] = input[2*i+1];
+	}
+	fft_forward(fft, re, im);
+	const float dc = re[0] + im[0], nyquist = re[0] - im[0];
+	for(unsigned int k=1;k<=n/2;++k) {
+		const unsigned int j = n - k;
+		const float er = (re[k] + re[j]) / 2, ei = (im[k] - im[j]) / 2;
+		const float or_ = (im[k] + im[j]) / 2, oi = (re[j] - re[k]) / 2;
+		const float wr = fft->rcos[k], wi = -fft->rsin[k];
+		const float tr = or_ * wr - oi * wi, ti = or_ * wi + oi * wr;
+		/* X[n-k] = conj(E[k]) - conj(w^k O[k]) since w^(n-k) = -conj(w^k) */
+		re[k] = er + tr;
+		im[k] = ei + ti;
+		re[j] = er - tr;
+		im[j] = ti - ei;
+	}
+	re[0] = dc;
+	im[0] = nyquist;
+}
+
+void fft_real_inverse(const struct fft *fft, float *re, float *im, float *output) {
+	const unsigned int n = fft->n;
+	const float dc = re[0], nyquist = im[0];
+	for(unsigned int k=1;k<=n/2;++k) {
+		const unsigned int j = n - k;
+		const float er = re[k] + re[j], ei = im[k] - im[j];
+		const float dr = re[k] - re[j], di = im[k] + im[j];
+		const float wr = fft->rcos[k], wi = fft->rsin[k];
+		const float or_ = dr * wr - di * wi, oi = dr * wi + di * wr;
+		/* Z[k] = E[k] + i*O[k], Z[n-k] = conj(E[k]) + i*conj(O[k]) */
+		re[k] = er - oi;
+		im[k] = ei + or_;
+		re[j] = er + oi;
+		im[j] = or_ - ei;
+	}
+	re[0] = dc + nyquist;
+	im[0] = dc - nyquist;
+	fft_inverse(fft, re, im);
+	for(unsigned int i=0;i<n;++i) {
+		output[2*i] = re[i];
+		output[2*i+1] = im[i];
+	}
+}
+
+void fft_destroy(struct fft *fft) {
+	free(fft->cos);
+	free(fft->sin);
+	free(fft->rcos);
+	free(fft->rsin);
+	free(fft->bitrev);
+	fft->cos = fft->sin = fft->rcos = fft->rsin = NULL;
+	fft->bitrev = NULL;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2013 Jeremy Pepper
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of crossfeed nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FFT_H
+#define FFT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Radix-2 FFT on split real/imaginary arrays. fft_init sets up complex
+ * transforms of n = 2^log2n points, and real transforms of 2n points.
+ *
+ * The real transforms pack their n+1 distinct bins into n complex values
+ * the way vDSP_fft_zrip does: re[0] holds the DC bin and im[0] the Nyquist
+ * bin, both of which are purely real.
+ *
+ * No transform is scaled, so a forward transform followed by an inverse one
+ * multiplies the input by the number of points.
+ */
+struct fft {
+	unsigned int n;
+	unsigned int log2n;
+	float *cos;
+	float *sin;
+	float *rcos;
+	float *rsin;
+	unsigned int *bitrev;
+};
+
+int fft_init(struct fft *fft, unsigned int log2n);
+void fft_forward(const struct fft *fft, float *re, float *im);
+void fft_inverse(const struct fft *fft, float *re, float *im);
+void fft_real_forward(const struct fft *fft, const float *input, float *re, float *im);
+void fft_real_inverse(const struct fft *fft, float *re, float *im, float *output);
+void fft_destroy(struct fft *fft);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
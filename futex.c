@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2012 Jeremy Pepper
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of message_queue nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "futex.h"
+#include <errno.h>
+#include <stdint.h>
+
+#ifdef __linux__
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+void futex_wait(unsigned int *addr, unsigned int value) {
+	while(syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0) &&
+	      errno == EINTR);
+}
+
+void futex_wake(unsigned int *addr, int count) {
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+void futex_wait_shared(unsigned int *addr, unsigned int value) {
+	while(syscall(SYS_futex, addr, FUTEX_WAIT, value, NULL, NULL, 0) &&
+	      errno == EINTR);
+}
+
+void futex_wake_shared(unsigned int *addr, int count) {
+	syscall(SYS_futex, addr, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+#else
+#include <pthread.h>
+
+#define FUTEX_BUCKETS 16
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} buckets[FUTEX_BUCKETS];
+static pthread_once_t buckets_once = PTHREAD_ONCE_INIT;
+
+static void buckets_init(void) {
+	for(unsigned int i=0;i<FUTEX_BUCKETS;++i) {
+		pthread_mutex_init(&buckets[i].lock, NULL);
+		pthread_cond_init(&buckets[i].cond, NULL);
+	}
+}
+
+static inline unsigned int bucket_index(unsigned int *addr) {
+	return ((uintptr_t)addr / sizeof(unsigned int)) % FUTEX_BUCKETS;
+}
+
+/*
+ * The value is checked with the bucket's lock held, and wakers take the same
+ * lock after changing it, so a wakeup can't slip in between the check and
+ * the wait.
+ */
+void futex_wait(unsigned int *addr, unsigned int value) {
+	const unsigned int i = bucket_index(addr);
+	pthread_once(&buckets_once, buckets_init);
+	pthread_mutex_lock(&buckets[i].lock);
+	if(__atomic_load_n(addr, __ATOMIC_ACQUIRE) == value)
+		pthread_cond_wait(&buckets[i].cond, &buckets[i].lock);
+	pthread_mutex_unlock(&buckets[i].lock);
+}
+
+void futex_wake(unsigned int *addr, int count) {
+	const unsigned int i = bucket_index(addr);
+	(void)count;
+	pthread_once(&buckets_once, buckets_init);
+	pthread_mutex_lock(&buckets[i].lock);
+	/* other addresses share the condition variable, so wake everyone */
+	pthread_cond_broadcast(&buckets[i].cond);
+	pthread_mutex_unlock(&buckets[i].lock);
+}
+
+void futex_wait_shared(unsigned int *addr, unsigned int value) {
+	futex_wait(addr, value);
+}
+
+void futex_wake_shared(unsigned int *addr, int count) {
+	futex_wake(addr, count);
+}
+#endif
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2012 Jeremy Pepper
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of message_queue nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FUTEX_H
+#define FUTEX_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Blocks the caller while *addr holds value, until futex_wake is called on
+ * addr. Wakeups may be spurious, so callers must recheck their condition.
+ * On Linux this is the futex syscall; elsewhere it falls back to a small
+ * table of mutexes and condition variables hashed by address.
+ */
+void futex_wait(unsigned int *addr, unsigned int value);
+
+/* Wakes up to count threads blocked in futex_wait on addr */
+void futex_wake(unsigned int *addr, int count);
+
+/*
+ * Like futex_wait and futex_wake, but for addresses in memory shared between
+ * processes. Outside Linux these only work within one process.
+ */
+void futex_wait_shared(unsigned int *addr, unsigned int value);
+void futex_wake_shared(unsigned int *addr, int count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2013 Jeremy Pepper
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of crossfeed nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "kernel_design.h"
+#include "fft.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define DESIGN_MIN_LOG2 8
+#define DESIGN_MAX_PASSES 10000
+
+/*
+ * The target response and scratch space for one design, in the packed
+ * layout of fft_real_forward.
+ */
+struct design {
+	struct fft fft;
+	unsigned int len;
+	float *target_re;
+	float *target_im;
+	float *buffer;
+	float *re;
+	float *im;
+};
+
+static void design_target(struct design *design, int samplerate, const float *reference,
+                          unsigned int reference_len, int reference_rate) {
+	const unsigned int n = design->fft.n;
+	for(unsigned int i=0;i<=n;++i) {
+		const double freq = (double)i * samplerate / (2 * n);
+		double re = 1, im = 0;
+		if(freq <= reference_rate / 2.) {
+			re = 0;
+			for(unsigned int t=0;t<reference_len;++t) {
+				re += reference[t] * cos(2 * M_PI * freq * t / reference_rate);
+				im -= reference[t] * sin(2 * M_PI * freq * t / reference_rate);
+			}
+		}
+		if(i == n) {
+			design->target_im[0] = re;
+		} else {
+			design->target_re[i] = re;
+			if(i)
+				design->target_im[i] = im;
+		}
+	}
+}
+
+static double design_error(struct design *design, const float *kernel) {
+	const unsigned int n = design->fft.n;
+	double error = 0;
+	memcpy(design->buffer, kernel, sizeof(float) * design->len);
+	memset(design->buffer + design->len, 0, sizeof(float) * (2 * n - design->len));
+	fft_real_forward(&design->fft, design->buffer, design->re, design->im);
+	for(unsigned int i=0;i<n;++i) {
+		const double err_re = design->re[i] - design->target_re[i];
+		const double err_im = design->im[i] - design->target_im[i];
+		error += err_re*err_re + err_im*err_im;
+	}
+	return error / n;
+}
+
+double kernel_design(float *kernel, unsigned int len, int samplerate,
+                     const float *reference, unsigned int reference_len, int reference_rate) {
+	const float delta = 0.00001;
+	struct design design;
+	unsigned int log2n = DESIGN_MIN_LOG2, pass = 0;
+	float *next, *slope;
+	float mu = 0.2;
+	double err = -1;
+	if(!len || samplerate <= 0 || reference_rate <= 0)
+		return -1;
+	while((1u << log2n) < len)
+		++log2n;
+	if(fft_init(&design.fft, log2n))
+		return -1;
+	design.len = len;
+	design.target_re = malloc(sizeof(float) * design.fft.n * 6 + sizeof(float) * len * 2);
+	if(!design.target_re)
+		goto done;
+	design.target_im = design.target_re + design.fft.n;
+	design.buffer = design.target_im + design.fft.n;
+	design.re = design.buffer + design.fft.n * 2;
+	design.im = design.re + design.fft.n;
+	next = design.im + design.fft.n;
+	slope = next + len;
+	design_target(&design, samplerate, reference, reference_len, reference_rate);
+	/* start from a kernel that doesn't crossfeed at all */
+	memset(kernel, 0, sizeof(float) * len);
+	kernel[0] = 1;
+	err = design_error(&design, kernel);
+	while(err >= 1. / (1 << 24) && mu >= 1. / (1 << 24) && pass++ < DESIGN_MAX_PASSES) {
+		double new_err;
+		memcpy(next, kernel, sizeof(float) * len);
+		for(unsigned int i=0;i<len;++i) {
+			next[i] += delta;
+			slope[i] = (design_error(&design, next) - err) / delta;
+			next[i] = kernel[i];
+		}
+		for(unsigned int i=0;i<len;++i) {
+			next[i] -= slope[i] * mu;
+		}
+		new_err = design_error(&design, next);
+		if(new_err < err) {
+			memcpy(kernel, next, sizeof(float) * len);
+			err = new_err;
+		} else {
+			mu /= 2;
+		}
+	}
+	free(design.target_re);
+done:
+	fft_destroy(&design.fft);
+	return err;
+}
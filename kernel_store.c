@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2013 Jeremy Pepper
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of crossfeed nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "kernel_store.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static uint32_t crc32_update(uint32_t crc, const void *data, size_t size) {
+	const unsigned char *p = data;
+	crc = ~crc;
+	for(size_t i=0;i<size;++i) {
+		crc ^= p[i];
+		for(unsigned int b=0;b<8;++b) {
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+		}
+	}
+	return ~crc;
+}
+
+static int kernel_store_check(const struct kernel_store *store) {
+	const struct kernel_store_header *header = store->header;
+	const size_t data = sizeof(struct kernel_store_header) +
+	                    sizeof(struct kernel_store_entry) * (size_t)header->count;
+	if(memcmp(header->magic, KERNEL_STORE_MAGIC, 8) || header->version != KERNEL_STORE_VERSION)
+		return -1;
+	if(header->size != store->size || data > store->size)
+		return -1;
+	for(unsigned int i=0;i<header->count;++i) {
+		const struct kernel_store_entry *entry = &store->entries[i];
+		if(entry->offset < data || entry->offset > store->size || entry->offset % sizeof(float) ||
+		   entry->len > (store->size - entry->offset) / sizeof(float) ||
+		   (entry->sections && entry->len != entry->sections * 5))
+			return -1;
+	}
+	if(crc32_update(0, header + 1, store->size - sizeof(struct kernel_store_header)) != header->checksum)
+		return -1;
+	return 0;
+}
+
+int kernel_store_open(struct kernel_store *store, const char *path) {
+	struct stat st;
+	int fd;
+	memset(store, 0, sizeof(struct kernel_store));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+	return -1;
+#endif
+	fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return -1;
+	if(fstat(fd, &st) || st.st_size < (off_t)sizeof(struct kernel_store_header)) {
+		close(fd);
+		return -1;
+	}
+	store->size = st.st_size;
+	store->map = mmap(NULL, store->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(store->map == MAP_FAILED) {
+		store->map = NULL;
+		return -1;
+	}
+	store->header = store->map;
+	store->entries = (const struct kernel_store_entry *)(store->header + 1);
+	if(kernel_store_check(store)) {
+		kernel_store_close(store);
+		return -1;
+	}
+	return 0;
+}
+
+void kernel_store_close(struct kernel_store *store) {
+	if(store->map)
+		munmap(store->map, store->size);
+	memset(store, 0, sizeof(struct kernel_store));
+}
+
+const struct kernel_store_entry *kernel_store_find(const struct kernel_store *store,
+                                                   uint32_t samplerate, uint32_t itd,
+                                                   uint32_t corner) {
+	for(unsigned int i=0;i<store->header->count;++i) {
+		const struct kernel_store_entry *entry = &store->entries[i];
+		if(entry->samplerate == samplerate &&
+		   (!itd || entry->itd == itd) &&
+		   (!corner || entry->corner == corner))
+			return entry;
+	}
+	return NULL;
+}
+
+int kernel_store_write(const char *path, const struct kernel_store_entry *entries,
+                       const float *const *taps, unsigned int count) {
+	struct kernel_store_header header = {KERNEL_STORE_MAGIC, KERNEL_STORE_VERSION, count, 0, 0};
+	struct kernel_store_entry *table;
+	char tmp_path[4096];
+	size_t offset = sizeof(struct kernel_store_header) + sizeof(struct kernel_store_entry) * count;
+	FILE *file;
+	int rv = -1;
+	table = malloc(sizeof(struct kernel_store_entry) * (count ? count : 1));
+	if(!table)
+		return -1;
+	for(unsigned int i=0;i<count;++i) {
+		table[i] = entries[i];
+		table[i].offset = offset;
+		offset += sizeof(float) * entries[i].len;
+	}
+	if(offset > UINT32_MAX)
+		goto done;
+	header.size = offset;
+	header.checksum = crc32_update(0, table, sizeof(struct kernel_store_entry) * count);
+	for(unsigned int i=0;i<count;++i) {
+		header.checksum = crc32_update(header.checksum, taps[i], sizeof(float) * entries[i].len);
+	}
+	/* write next to the destination and rename, so readers never map a partial store */
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	file = fopen(tmp_path, "wb");
+	if(!file)
+		goto done;
+	if(fwrite(&header, sizeof(header), 1, file) == 1 &&
+	   fwrite(table, sizeof(struct kernel_store_entry), count, file) == count)
+		rv = 0;
+	for(unsigned int i=0;i<count && !rv;++i) {
+		if(fwrite(taps[i], sizeof(float), entries[i].len, file) != entries[i].len)
+			rv = -1;
+	}
+	if(fclose(file) || rv || rename(tmp_path, path)) {
+		remove(tmp_path);
+		rv = -1;
+	}
+done:
+	free(table);
+	return rv;
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2013 Jeremy Pepper
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of crossfeed nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef KERNEL_STORE_H
+#define KERNEL_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A kernel store is a file holding designed kernels for any number of sample
+ * rates and design parameters, laid out so it can be used straight from a
+ * read-only mapping: a header, an array of entries, then the taps of every
+ * kernel as native floats. All fields are little-endian, and the checksum is
+ * the CRC-32 of everything after the header.
+ *
+ * An entry is either a FIR kernel, or, if sections isn't 0, a biquad cascade
+ * for crossfeed_init_iir whose taps are the sections' five coefficients each.
+ */
+#define KERNEL_STORE_MAGIC "XFKERNEL"
+#define KERNEL_STORE_VERSION 2
+
+struct kernel_store_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t count;
+	uint32_t size;
+	uint32_t checksum;
+};
+
+struct kernel_store_entry {
+	uint32_t samplerate;
+	/* the interaural delay in microseconds and corner frequency in Hz the
+	   kernel was designed for, or 0 if unknown */
+	uint32_t itd;
+	uint32_t corner;
+	/* the mid channel delay in samples to pass to crossfeed_init_kernel, or
+	   for a cascade the side channel delay to pass to crossfeed_init_iir */
+	uint32_t delay;
+	uint32_t len;
+	uint32_t sections;
+	/* byte offset of the taps from the start of the store */
+	uint32_t offset;
+};
+
+struct kernel_store {
+	void *map;
+	size_t size;
+	const struct kernel_store_header *header;
+	const struct kernel_store_entry *entries;
+};
+
+/* Maps a store and checks its header, layout and checksum */
+int kernel_store_open(struct kernel_store *store, const char *path);
+void kernel_store_close(struct kernel_store *store);
+
+/*
+ * Returns the first entry for samplerate whose itd and corner match, where 0
+ * matches anything, or NULL if there is none.
+ */
+const struct kernel_store_entry *kernel_store_find(const struct kernel_store *store,
+                                                   uint32_t samplerate, uint32_t itd,
+                                                   uint32_t corner);
+
+static inline const float *kernel_store_taps(const struct kernel_store *store,
+                                             const struct kernel_store_entry *entry) {
+	return (const float *)((const char *)store->map + entry->offset);
+}
+
+/*
+ * Writes count kernels to a new store at path. The offset of each entry is
+ * filled in here; taps[i] holds the taps for entries[i].
+ */
+int kernel_store_write(const char *path, const struct kernel_store_entry *entries,
+                       const float *const *taps, unsigned int count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -28,12 +28,19 @@
  */
 
 #include "message_queue.h"
+#include "futex.h"
 #include <inttypes.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define HUGE_PAGE_SIZE (2*1024*1024)
 
 union padding {
 	char chardata;
@@ -66,158 +73,492 @@ static inline int max(int x, int y) {
 	return x > y ? x : y;
 }
 
-int message_queue_init(struct message_queue *queue, int message_size, int max_depth) {
-    int i;
+#ifdef MESSAGE_QUEUE_FUTEX
+/* A counting semaphore in a futex word: the count is the number of posts not yet waited for */
+static int queue_sem_init(message_queue_sem *sem, const void *id) {
+	(void)id;
+	*sem = 0;
+	return 0;
+}
+
+/* Shared queues need the slower futex calls that work across processes */
+static void queue_sem_wait(const struct message_queue *queue, message_queue_sem *sem) {
+	for(;;) {
+		unsigned int count = __atomic_load_n(sem, __ATOMIC_ACQUIRE);
+		if(count && __sync_bool_compare_and_swap(sem, count, count - 1))
+			return;
+		if(count)
+			continue;
+		if(queue->flags & MESSAGE_QUEUE_SHARED)
+			futex_wait_shared(sem, 0);
+		else
+			futex_wait(sem, 0);
+	}
+}
+
+static void queue_sem_post(const struct message_queue *queue, message_queue_sem *sem) {
+	__sync_fetch_and_add(sem, 1);
+	if(queue->flags & MESSAGE_QUEUE_SHARED)
+		futex_wake_shared(sem, 1);
+	else
+		futex_wake(sem, 1);
+}
+
+static void queue_sem_destroy(message_queue_sem *sem) {
+	(void)sem;
+}
+#else
+static int queue_sem_init(message_queue_sem *sem, const void *id) {
 	char sem_name[128];
-	queue->message_size = pad_size(message_size);
-	queue->max_depth = round_to_pow2(max_depth);
-	queue->memory = malloc(queue->message_size * max_depth);
+	snprintf(sem_name, 128, "%d_%p", getpid(), id);
+	sem_name[127] = '\0';
+	do {
+		*sem = sem_open(sem_name, O_CREAT | O_EXCL, 0600, 0);
+	} while(*sem == SEM_FAILED && errno == EINTR);
+	if(*sem == SEM_FAILED)
+		return -1;
+	sem_unlink(sem_name);
+	return 0;
+}
+
+static void queue_sem_wait(const struct message_queue *queue, message_queue_sem *sem) {
+	(void)queue;
+	while(sem_wait(*sem) && errno == EINTR);
+}
+
+static void queue_sem_post(const struct message_queue *queue, message_queue_sem *sem) {
+	(void)queue;
+	sem_post(*sem);
+}
+
+static void queue_sem_destroy(message_queue_sem *sem) {
+	sem_close(*sem);
+}
+#endif
+
+static inline void cpu_relax(void) {
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	__asm__ __volatile__("yield");
+#else
+	__sync_synchronize();
+#endif
+}
+
+/*
+ * Called while a slot is still being published by another thread. Spins for
+ * the queue's spin count, then yields or parks according to its strategy.
+ * Records which stage the wait had reached when the slot became ready.
+ */
+static message_queue_slot wait_for_slot(struct message_queue *queue, message_queue_slot *slot, int empty) {
+	unsigned int spins = 0;
+	int stage = MESSAGE_QUEUE_WAIT_SPIN;
+	message_queue_slot cur;
+	while(cur = __atomic_load_n(slot, __ATOMIC_ACQUIRE), (cur != 0) == empty) {
+		if(queue->wait_strategy == MESSAGE_QUEUE_WAIT_SPIN || spins < queue->wait_spins) {
+			++spins;
+			cpu_relax();
+		} else if(queue->wait_strategy == MESSAGE_QUEUE_WAIT_YIELD) {
+			stage = MESSAGE_QUEUE_WAIT_YIELD;
+			sched_yield();
+		} else {
+			stage = MESSAGE_QUEUE_WAIT_PARK;
+			usleep(10);
+		}
+	}
+	if(stage == MESSAGE_QUEUE_WAIT_SPIN)
+		__sync_fetch_and_add(&queue->wait_stats.spins, 1);
+	else if(stage == MESSAGE_QUEUE_WAIT_YIELD)
+		__sync_fetch_and_add(&queue->wait_stats.yields, 1);
+	else
+		__sync_fetch_and_add(&queue->wait_stats.parks, 1);
+	return cur;
+}
+
+static inline void *slot_message(const struct message_queue *queue, message_queue_slot slot) {
+	return (char *)queue->memory + slot - 1;
+}
+
+static inline message_queue_slot message_slot(const struct message_queue *queue, const void *message) {
+	return (const char *)message - (const char *)queue->memory + 1;
+}
+
+/* Returns the message in slot, waiting for its writer to store it if needed */
+static inline void *wait_for_message(struct message_queue *queue, message_queue_slot *slot) {
+	message_queue_slot cur = *slot;
+	return slot_message(queue, cur ? cur : wait_for_slot(queue, slot, 0));
+}
+
+/* Waits for the reader of slot to clear it */
+static inline void wait_for_empty(struct message_queue *queue, message_queue_slot *slot) {
+	if(*slot)
+		wait_for_slot(queue, slot, 1);
+}
+
+/*
+ * Hugepage-backed slabs come from mmap, preferring explicit huge pages and
+ * falling back to asking for transparent ones. Everything else is aligned
+ * to a cache line so that padded messages never share one.
+ */
+static void *alloc_memory(struct message_queue *queue) {
+	void *memory;
+	if(queue->flags & MESSAGE_QUEUE_HUGEPAGES) {
+		queue->memory_size = (queue->memory_size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+#ifdef MAP_HUGETLB
+		memory = mmap(NULL, queue->memory_size, PROT_READ | PROT_WRITE,
+		              MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if(memory != MAP_FAILED)
+			return memory;
+#endif
+		memory = mmap(NULL, queue->memory_size, PROT_READ | PROT_WRITE,
+		              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(memory == MAP_FAILED)
+			return NULL;
+#ifdef MADV_HUGEPAGE
+		madvise(memory, queue->memory_size, MADV_HUGEPAGE);
+#endif
+		return memory;
+	}
+	if(posix_memalign(&memory, CACHE_LINE_SIZE, queue->memory_size))
+		return NULL;
+	return memory;
+}
+
+static void free_memory(struct message_queue *queue) {
+	if(queue->flags & MESSAGE_QUEUE_HUGEPAGES)
+		munmap(queue->memory, queue->memory_size);
+	else
+		free(queue->memory);
+}
+
+int message_queue_init(struct message_queue *queue, int message_size, int max_depth) {
+	return message_queue_init_flags(queue, message_size, max_depth, 0);
+}
+
+/* Sets up the per-process parts of a queue structure */
+static void init_handle(struct message_queue *queue, int message_size, int max_depth, int flags) {
+	queue->flags = flags;
+	queue->wait_strategy = MESSAGE_QUEUE_WAIT_PARK;
+	queue->wait_spins = MESSAGE_QUEUE_DEFAULT_SPINS;
+	queue->wait_stats.spins = 0;
+	queue->wait_stats.yields = 0;
+	queue->wait_stats.parks = 0;
+	queue->message_size = message_size;
+	queue->max_depth = max_depth;
+	queue->mapping = NULL;
+	queue->mapping_size = 0;
+}
+
+/* Fills the freelist with every message and empties the queue */
+static void init_slots(struct message_queue *queue) {
+	for(unsigned int i=0;i<queue->max_depth;++i) {
+		queue->freelist[i] = (size_t)queue->message_size * i + 1;
+		queue->queue_data[i] = 0;
+	}
+	queue->control->allocator.blocked_readers = 0;
+	queue->control->allocator.free_blocks = queue->max_depth;
+	queue->control->allocator.allocpos = 0;
+	queue->control->allocator.freepos = 0;
+	queue->control->queue.blocked_readers = 0;
+	queue->control->queue.entries = 0;
+	queue->control->queue.readpos = 0;
+	queue->control->queue.writepos = 0;
+}
+
+int message_queue_init_flags(struct message_queue *queue, int message_size, int max_depth, int flags) {
+	message_size = pad_size(message_size);
+	if(flags & (MESSAGE_QUEUE_ALIGNED | MESSAGE_QUEUE_HUGEPAGES))
+		message_size = (message_size + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+	init_handle(queue, message_size, round_to_pow2(max_depth), flags & ~MESSAGE_QUEUE_SHARED);
+	queue->control = &queue->local;
+	queue->memory_size = (size_t)queue->message_size * queue->max_depth;
+	queue->memory = alloc_memory(queue);
 	if(!queue->memory)
 		goto error;
-	queue->freelist = malloc(sizeof(void *) * queue->max_depth);
+	queue->freelist = malloc(sizeof(message_queue_slot) * queue->max_depth);
 	if(!queue->freelist)
 		goto error_after_memory;
-	for(i=0;i<queue->max_depth;++i) {
-		queue->freelist[i] = queue->memory + (queue->message_size * i);
-	}
-	snprintf(sem_name, 128, "%d_%p", getpid(), &queue->allocator);
-	sem_name[127] = '\0';
-	do {
-		queue->allocator.sem = sem_open(sem_name, O_CREAT | O_EXCL, 0600, 0);
-	} while(queue->allocator.sem == SEM_FAILED && errno == EINTR);
-	if(queue->allocator.sem == SEM_FAILED)
-		goto error_after_freelist;
-	sem_unlink(sem_name);
-	queue->allocator.blocked_readers = 0;
-	queue->allocator.free_blocks = queue->max_depth;
-	queue->allocator.allocpos = 0;
-	queue->allocator.freepos = 0;
-	queue->queue_data = malloc(sizeof(void *) * queue->max_depth);
+	queue->queue_data = malloc(sizeof(message_queue_slot) * queue->max_depth);
 	if(!queue->queue_data)
-		goto error_after_alloc_sem;
-	for(i=0;i<queue->max_depth;++i) {
-		queue->queue_data[i] = NULL;
-	}
-	queue->queue.blocked_readers = 0;
-	snprintf(sem_name, 128, "%d_%p", getpid(), queue);
-	sem_name[127] = '\0';
-	do {
-		queue->queue.sem = sem_open(sem_name, O_CREAT | O_EXCL, 0600, 0);
-	} while(queue->queue.sem == SEM_FAILED && errno == EINTR);
-	if(queue->queue.sem == SEM_FAILED)
+		goto error_after_freelist;
+	init_slots(queue);
+	if(queue_sem_init(&queue->control->allocator.sem, &queue->control->allocator))
 		goto error_after_queue;
-	sem_unlink(sem_name);
-	queue->queue.entries = 0;
-	queue->queue.readpos = 0;
-	queue->queue.writepos = 0;
+	if(queue_sem_init(&queue->control->queue.sem, queue))
+		goto error_after_alloc_sem;
 	return 0;
 
+error_after_alloc_sem:
+	queue_sem_destroy(&queue->control->allocator.sem);
 error_after_queue:
 	free(queue->queue_data);
-error_after_alloc_sem:
-	sem_close(queue->allocator.sem);
 error_after_freelist:
 	free(queue->freelist);
 error_after_memory:
-	free(queue->memory);
+	free_memory(queue);
 error:
 	return -1;
 }
 
+#ifdef MESSAGE_QUEUE_FUTEX
+#define SHARED_MAGIC "MSGQUEUE"
+#define SHARED_VERSION 1
+
+/*
+ * The start of a shared queue's mapping. Everything after it is found by
+ * offset, since each process maps the file at a different address. magic is
+ * written last, so a process that sees it sees a finished queue.
+ */
+struct shared_header {
+	char magic[8];
+	unsigned int version;
+	unsigned int message_size;
+	unsigned int max_depth;
+	size_t size;
+	size_t control;
+	size_t freelist;
+	size_t queue_data;
+	size_t memory;
+};
+
+static inline size_t round_up(size_t x, size_t to) {
+	return (x + to - 1) / to * to;
+}
+
+/* Points a queue structure at the parts of a shared mapping */
+static void map_shared(struct message_queue *queue, void *mapping, const struct shared_header *header) {
+	init_handle(queue, header->message_size, header->max_depth, MESSAGE_QUEUE_SHARED);
+	queue->mapping = mapping;
+	queue->mapping_size = header->size;
+	queue->control = (struct message_queue_control *)((char *)mapping + header->control);
+	queue->freelist = (message_queue_slot *)((char *)mapping + header->freelist);
+	queue->queue_data = (message_queue_slot *)((char *)mapping + header->queue_data);
+	queue->memory = (char *)mapping + header->memory;
+	queue->memory_size = (size_t)header->message_size * header->max_depth;
+}
+
+int message_queue_init_shared(struct message_queue *queue, int message_size, int max_depth, int fd) {
+	struct shared_header header = {"", SHARED_VERSION, pad_size(message_size), round_to_pow2(max_depth)};
+	void *mapping;
+	header.control = round_up(sizeof(struct shared_header), CACHE_LINE_SIZE);
+	header.freelist = header.control + sizeof(struct message_queue_control);
+	header.queue_data = header.freelist + sizeof(message_queue_slot) * header.max_depth;
+	header.memory = round_up(header.queue_data + sizeof(message_queue_slot) * header.max_depth, CACHE_LINE_SIZE);
+	header.size = round_up(header.memory + (size_t)header.message_size * header.max_depth, sysconf(_SC_PAGESIZE));
+	if(ftruncate(fd, header.size))
+		return -1;
+	mapping = mmap(NULL, header.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(mapping == MAP_FAILED)
+		return -1;
+	map_shared(queue, mapping, &header);
+	init_slots(queue);
+	queue_sem_init(&queue->control->allocator.sem, NULL);
+	queue_sem_init(&queue->control->queue.sem, NULL);
+	memcpy(mapping, &header, sizeof(header));
+	__sync_synchronize();
+	memcpy(mapping, SHARED_MAGIC, sizeof(header.magic));
+	return 0;
+}
+
+int message_queue_attach(struct message_queue *queue, int fd) {
+	struct shared_header header;
+	struct stat st;
+	void *mapping;
+	if(fstat(fd, &st) || (size_t)st.st_size < sizeof(header))
+		return -1;
+	if(pread(fd, &header, sizeof(header), 0) != sizeof(header))
+		return -1;
+	if(memcmp(header.magic, SHARED_MAGIC, sizeof(header.magic)) ||
+	   header.version != SHARED_VERSION || header.size > (size_t)st.st_size)
+		return -1;
+	mapping = mmap(NULL, header.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(mapping == MAP_FAILED)
+		return -1;
+	map_shared(queue, mapping, &header);
+	return 0;
+}
+#else
+int message_queue_init_shared(struct message_queue *queue, int message_size, int max_depth, int fd) {
+	(void)queue; (void)message_size; (void)max_depth; (void)fd;
+	return -1;
+}
+
+int message_queue_attach(struct message_queue *queue, int fd) {
+	(void)queue; (void)fd;
+	return -1;
+}
+#endif
+
 void *message_queue_message_alloc(struct message_queue *queue) {
-	if(__sync_fetch_and_add(&queue->allocator.free_blocks, -1) > 0) {
-		unsigned int pos = __sync_fetch_and_add(&queue->allocator.allocpos, 1) % queue->max_depth;
-		void *rv = queue->freelist[pos];
-		while(!rv) {
-			usleep(10); __sync_synchronize();
-			rv = queue->freelist[pos];
-		}
-		queue->freelist[pos] = NULL;
+	if(__sync_fetch_and_add(&queue->control->allocator.free_blocks, -1) > 0) {
+		unsigned int pos = __sync_fetch_and_add(&queue->control->allocator.allocpos, 1) % queue->max_depth;
+		void *rv = wait_for_message(queue, &queue->freelist[pos]);
+		queue->freelist[pos] = 0;
 		return rv;
 	}
-	__sync_fetch_and_add(&queue->allocator.free_blocks, 1);
+	__sync_fetch_and_add(&queue->control->allocator.free_blocks, 1);
 	return NULL;
 }
 
 void *message_queue_message_alloc_blocking(struct message_queue *queue) {
 	void *rv = message_queue_message_alloc(queue);
 	while(!rv) {
-		__sync_fetch_and_add(&queue->allocator.blocked_readers, 1);
+		__sync_fetch_and_add(&queue->control->allocator.blocked_readers, 1);
 		rv = message_queue_message_alloc(queue);
 		if(rv) {
-			__sync_fetch_and_add(&queue->allocator.blocked_readers, -1);
+			__sync_fetch_and_add(&queue->control->allocator.blocked_readers, -1);
 			return rv;
 		}
-		while(sem_wait(queue->allocator.sem) && errno == EINTR);
+		queue_sem_wait(queue, &queue->control->allocator.sem);
 		rv = message_queue_message_alloc(queue);
 	}
 	return rv;
 }
 
 void message_queue_message_free(struct message_queue *queue, void *message) {
-	unsigned int pos = __sync_fetch_and_add(&queue->allocator.freepos, 1) % queue->max_depth;
-	void *cur = queue->freelist[pos];
-	while(cur) {
-		usleep(10); __sync_synchronize();
-		cur = queue->freelist[pos];
+	unsigned int pos = __sync_fetch_and_add(&queue->control->allocator.freepos, 1) % queue->max_depth;
+	wait_for_empty(queue, &queue->freelist[pos]);
+	queue->freelist[pos] = message_slot(queue, message);
+	__sync_fetch_and_add(&queue->control->allocator.free_blocks, 1);
+	if(queue->control->allocator.blocked_readers) {
+		__sync_fetch_and_add(&queue->control->allocator.blocked_readers, -1);
+		queue_sem_post(queue, &queue->control->allocator.sem);
 	}
-	queue->freelist[pos] = message;
-	__sync_fetch_and_add(&queue->allocator.free_blocks, 1);
-	if(queue->allocator.blocked_readers) {
-		__sync_fetch_and_add(&queue->allocator.blocked_readers, -1);
-		sem_post(queue->allocator.sem);
+}
+
+unsigned int message_queue_message_alloc_n(struct message_queue *queue, void **messages,
+                                           unsigned int count) {
+	int available = __sync_fetch_and_add(&queue->control->allocator.free_blocks, -(int)count);
+	unsigned int got = available <= 0 ? 0 : (unsigned int)available < count ? (unsigned int)available : count;
+	unsigned int pos;
+	if(got < count)
+		__sync_fetch_and_add(&queue->control->allocator.free_blocks, count - got);
+	if(!got)
+		return 0;
+	pos = __sync_fetch_and_add(&queue->control->allocator.allocpos, got);
+	for(unsigned int i=0;i<got;++i) {
+		message_queue_slot *slot = &queue->freelist[(pos + i) % queue->max_depth];
+		void *rv = wait_for_message(queue, slot);
+		*slot = 0;
+		messages[i] = rv;
+	}
+	return got;
+}
+
+void message_queue_message_free_n(struct message_queue *queue, void **messages,
+                                  unsigned int count) {
+	unsigned int pos = __sync_fetch_and_add(&queue->control->allocator.freepos, count);
+	for(unsigned int i=0;i<count;++i) {
+		message_queue_slot *slot = &queue->freelist[(pos + i) % queue->max_depth];
+		wait_for_empty(queue, slot);
+		*slot = message_slot(queue, messages[i]);
+	}
+	__sync_fetch_and_add(&queue->control->allocator.free_blocks, count);
+	for(unsigned int i=0;i<count && queue->control->allocator.blocked_readers;++i) {
+		__sync_fetch_and_add(&queue->control->allocator.blocked_readers, -1);
+		queue_sem_post(queue, &queue->control->allocator.sem);
 	}
 }
 
 void message_queue_write(struct message_queue *queue, void *message) {
-	unsigned int pos = __sync_fetch_and_add(&queue->queue.writepos, 1) % queue->max_depth;
-	void *cur = queue->queue_data[pos];
-	while(cur) {
-		usleep(10); __sync_synchronize();
-		cur = queue->queue_data[pos];
+	unsigned int pos = __sync_fetch_and_add(&queue->control->queue.writepos, 1) % queue->max_depth;
+	wait_for_empty(queue, &queue->queue_data[pos]);
+	queue->queue_data[pos] = message_slot(queue, message);
+	__sync_fetch_and_add(&queue->control->queue.entries, 1);
+	if(queue->control->queue.blocked_readers) {
+		__sync_fetch_and_add(&queue->control->queue.blocked_readers, -1);
+		queue_sem_post(queue, &queue->control->queue.sem);
 	}
-	queue->queue_data[pos] = message;
-	__sync_fetch_and_add(&queue->queue.entries, 1);
-	if(queue->queue.blocked_readers) {
-		__sync_fetch_and_add(&queue->queue.blocked_readers, -1);
-		sem_post(queue->queue.sem);
+}
+
+void message_queue_write_n(struct message_queue *queue, void **messages, unsigned int count) {
+	unsigned int pos = __sync_fetch_and_add(&queue->control->queue.writepos, count);
+	for(unsigned int i=0;i<count;++i) {
+		message_queue_slot *slot = &queue->queue_data[(pos + i) % queue->max_depth];
+		wait_for_empty(queue, slot);
+		*slot = message_slot(queue, messages[i]);
+	}
+	__sync_fetch_and_add(&queue->control->queue.entries, count);
+	for(unsigned int i=0;i<count && queue->control->queue.blocked_readers;++i) {
+		__sync_fetch_and_add(&queue->control->queue.blocked_readers, -1);
+		queue_sem_post(queue, &queue->control->queue.sem);
 	}
 }
 
+unsigned int message_queue_tryread_n(struct message_queue *queue, void **messages,
+                                     unsigned int count) {
+	int available = __sync_fetch_and_add(&queue->control->queue.entries, -(int)count);
+	unsigned int got = available <= 0 ? 0 : (unsigned int)available < count ? (unsigned int)available : count;
+	unsigned int pos;
+	if(got < count)
+		__sync_fetch_and_add(&queue->control->queue.entries, count - got);
+	if(!got)
+		return 0;
+	pos = __sync_fetch_and_add(&queue->control->queue.readpos, got);
+	for(unsigned int i=0;i<got;++i) {
+		message_queue_slot *slot = &queue->queue_data[(pos + i) % queue->max_depth];
+		void *rv = wait_for_message(queue, slot);
+		*slot = 0;
+		messages[i] = rv;
+	}
+	return got;
+}
+
+unsigned int message_queue_read_n(struct message_queue *queue, void **messages,
+                                  unsigned int count) {
+	unsigned int got = message_queue_tryread_n(queue, messages, count);
+	if(got || !count)
+		return got;
+	messages[0] = message_queue_read(queue);
+	return 1 + message_queue_tryread_n(queue, messages + 1, count - 1);
+}
+
 void *message_queue_tryread(struct message_queue *queue) {
-	if(__sync_fetch_and_add(&queue->queue.entries, -1) > 0) {
-		unsigned int pos = __sync_fetch_and_add(&queue->queue.readpos, 1) % queue->max_depth;
-		void *rv = queue->queue_data[pos];
-		while(!rv) {
-			usleep(10); __sync_synchronize();
-			rv = queue->queue_data[pos];
-		}
-		queue->queue_data[pos] = NULL;
+	if(__sync_fetch_and_add(&queue->control->queue.entries, -1) > 0) {
+		unsigned int pos = __sync_fetch_and_add(&queue->control->queue.readpos, 1) % queue->max_depth;
+		void *rv = wait_for_message(queue, &queue->queue_data[pos]);
+		queue->queue_data[pos] = 0;
 		return rv;
 	}
-	__sync_fetch_and_add(&queue->queue.entries, 1);
+	__sync_fetch_and_add(&queue->control->queue.entries, 1);
 	return NULL;
 }
 
 void *message_queue_read(struct message_queue *queue) {
 	void *rv = message_queue_tryread(queue);
 	while(!rv) {
-		__sync_fetch_and_add(&queue->queue.blocked_readers, 1);
+		__sync_fetch_and_add(&queue->control->queue.blocked_readers, 1);
 		rv = message_queue_tryread(queue);
 		if(rv) {
-			__sync_fetch_and_add(&queue->queue.blocked_readers, -1);
+			__sync_fetch_and_add(&queue->control->queue.blocked_readers, -1);
 			return rv;
 		}
-		while(sem_wait(queue->queue.sem) && errno == EINTR);
+		queue_sem_wait(queue, &queue->control->queue.sem);
 		rv = message_queue_tryread(queue);
 	}
 	return rv;
 }
 
+void message_queue_set_wait(struct message_queue *queue, int strategy, unsigned int spins) {
+	queue->wait_strategy = strategy;
+	queue->wait_spins = spins;
+}
+
+void message_queue_wait_stats(struct message_queue *queue, struct message_queue_wait_stats *stats) {
+	stats->spins = __sync_fetch_and_add(&queue->wait_stats.spins, 0);
+	stats->yields = __sync_fetch_and_add(&queue->wait_stats.yields, 0);
+	stats->parks = __sync_fetch_and_add(&queue->wait_stats.parks, 0);
+}
+
 void message_queue_destroy(struct message_queue *queue) {
-	sem_close(queue->queue.sem);
+	if(queue->flags & MESSAGE_QUEUE_SHARED) {
+		munmap(queue->mapping, queue->mapping_size);
+		return;
+	}
+	queue_sem_destroy(&queue->control->queue.sem);
 	free(queue->queue_data);
-	sem_close(queue->allocator.sem);
+	queue_sem_destroy(&queue->control->allocator.sem);
 	free(queue->freelist);
-	free(queue->memory);
+	free_memory(queue);
 }
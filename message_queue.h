@@ -34,28 +34,103 @@
 #define CACHE_LINE_SIZE 64
 #endif
 
+#include <stddef.h>
+
+/*
+ * On Linux, blocked threads wait on a futex in the queue itself, so creating
+ * a queue makes no system calls. Elsewhere they wait on a named semaphore.
+ */
+#ifdef __linux__
+#define MESSAGE_QUEUE_FUTEX
+typedef unsigned int message_queue_sem;
+#else
 #include <semaphore.h>
+typedef sem_t *message_queue_sem;
+#endif
 
 /**
- * \brief Message queue structure
+ * \brief Pad every message to a multiple of CACHE_LINE_SIZE
  *
- * This structure is passed to all message_queue API calls
+ * With this flag each message starts on its own cache line.
  */
-struct message_queue {
-	unsigned int message_size;
-	unsigned int max_depth;
-	void *memory;
-	void **freelist;
-	void **queue_data;
+#define MESSAGE_QUEUE_ALIGNED 1
+
+/**
+ * \brief Back the message memory with huge pages where possible
+ *
+ * Implies MESSAGE_QUEUE_ALIGNED. Falls back to ordinary pages if no huge
+ * pages are available.
+ */
+#define MESSAGE_QUEUE_HUGEPAGES 2
+
+/**
+ * \brief Set on queues that live in shared memory
+ *
+ * Queues get this flag from message_queue_init_shared or
+ * message_queue_attach; it can't be passed to message_queue_init_flags.
+ */
+#define MESSAGE_QUEUE_SHARED 4
+
+/**
+ * \brief Wait for a slot that is mid-publish by spinning only
+ *
+ * Lowest latency, but burns a core for as long as the other thread is
+ * descheduled.
+ */
+#define MESSAGE_QUEUE_WAIT_SPIN 0
+
+/**
+ * \brief Spin, then call sched_yield until the slot is ready
+ */
+#define MESSAGE_QUEUE_WAIT_YIELD 1
+
+/**
+ * \brief Spin, then sleep in short intervals until the slot is ready
+ *
+ * This is the default.
+ */
+#define MESSAGE_QUEUE_WAIT_PARK 2
+
+/**
+ * \brief The number of spins before yielding or parking, unless changed
+ *        with message_queue_set_wait
+ */
+#define MESSAGE_QUEUE_DEFAULT_SPINS 200
+
+/**
+ * \brief How many slot waits ended in each stage of the wait strategy
+ *
+ * A wait counts towards the last stage it reached, so spins counts waits
+ * that never had to yield or park.
+ */
+struct message_queue_wait_stats {
+	unsigned long spins;
+	unsigned long yields;
+	unsigned long parks;
+};
+
+/**
+ * \brief A slot in the freelist or queue
+ *
+ * Slots hold the offset of a message from the start of the message memory
+ * plus one, or 0 when empty, so that they mean the same thing in every
+ * process that maps a shared queue.
+ */
+typedef size_t message_queue_slot;
+
+/**
+ * \brief The counters and wait points shared by every user of a queue
+ */
+struct message_queue_control {
 	struct {
-		sem_t *sem;
+		message_queue_sem sem;
 		unsigned int blocked_readers;
 		int free_blocks;
 		unsigned int allocpos __attribute__((aligned(CACHE_LINE_SIZE)));
 		unsigned int freepos __attribute__((aligned(CACHE_LINE_SIZE)));
 	} allocator __attribute__((aligned(CACHE_LINE_SIZE)));
 	struct {
-		sem_t *sem;
+		message_queue_sem sem;
 		unsigned int blocked_readers;
 		int entries;
 		unsigned int readpos __attribute__((aligned(CACHE_LINE_SIZE)));
@@ -63,6 +138,30 @@ struct message_queue {
 	} queue __attribute__((aligned(CACHE_LINE_SIZE)));
 };
 
+/**
+ * \brief Message queue structure
+ *
+ * This structure is passed to all message_queue API calls. For a queue in
+ * one process, control points at local; for a shared queue, control,
+ * freelist, queue_data and memory all point into the shared mapping.
+ */
+struct message_queue {
+	unsigned int message_size;
+	unsigned int max_depth;
+	void *memory;
+	size_t memory_size;
+	int flags;
+	int wait_strategy;
+	unsigned int wait_spins;
+	struct message_queue_wait_stats wait_stats;
+	message_queue_slot *freelist;
+	message_queue_slot *queue_data;
+	struct message_queue_control *control;
+	void *mapping;
+	size_t mapping_size;
+	struct message_queue_control local;
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -83,6 +182,60 @@ extern "C" {
  */
 int message_queue_init(struct message_queue *queue, int message_size, int max_depth);
 
+/**
+ * \brief Initialize a message queue structure with allocation flags
+ *
+ * Like message_queue_init, but flags may include MESSAGE_QUEUE_ALIGNED or
+ * MESSAGE_QUEUE_HUGEPAGES to control how message memory is laid out. Large
+ * messages allocated this way can carry bulk data, such as audio buffers,
+ * between threads without copying.
+ *
+ * \param queue pointer to the message queue structure to initialize
+ * \param message_size size in bytes of the largest message that will be sent
+ *        on this queue
+ * \param max_depth the maximum number of message to allow in the queue at
+ *        once. This will be rounded to the next highest power of two.
+ * \param flags a combination of the MESSAGE_QUEUE_ flags, or 0
+ *
+ * \return 0 if successful, or nonzero if an error occured
+ */
+int message_queue_init_flags(struct message_queue *queue, int message_size, int max_depth, int flags);
+
+/**
+ * \brief Initialize a message queue in shared memory
+ *
+ * This lays out the whole queue, including its messages, in the file
+ * referred to by fd, which would usually come from shm_open or
+ * memfd_create. The file is resized to fit. Other processes can then use
+ * the queue through message_queue_attach, so messages pass between
+ * processes without being copied. Only supported on Linux.
+ *
+ * \param queue pointer to the message queue structure to initialize
+ * \param message_size size in bytes of the largest message that will be sent
+ *        on this queue
+ * \param max_depth the maximum number of message to allow in the queue at
+ *        once. This will be rounded to the next highest power of two.
+ * \param fd an open, writable file descriptor for the shared memory
+ *
+ * \return 0 if successful, or nonzero if an error occured
+ */
+int message_queue_init_shared(struct message_queue *queue, int message_size, int max_depth, int fd);
+
+/**
+ * \brief Attach to a queue created with message_queue_init_shared
+ *
+ * The queue can be used as soon as this returns, by any number of threads in
+ * any number of processes. Each process calls message_queue_destroy on its
+ * own queue structure when done, which unmaps it without disturbing the
+ * others.
+ *
+ * \param queue pointer to the message queue structure to initialize
+ * \param fd an open, writable file descriptor for the shared memory
+ *
+ * \return 0 if successful, or nonzero if fd does not hold a queue
+ */
+int message_queue_attach(struct message_queue *queue, int fd);
+
 /**
  * \brief Allocate a new message
  *
@@ -110,6 +263,21 @@ void *message_queue_message_alloc(struct message_queue *queue);
  */
 void *message_queue_message_alloc_blocking(struct message_queue *queue);
 
+/**
+ * \brief Allocate several messages at once
+ *
+ * This reserves up to count messages with a single atomic operation instead
+ * of one per message. It does not block.
+ *
+ * \param queue pointer to the message queue to which the messages will be
+ *        written
+ * \param messages array receiving the allocated messages
+ * \param count the number of messages wanted
+ * \return the number of messages allocated, which may be less than count
+ */
+unsigned int message_queue_message_alloc_n(struct message_queue *queue, void **messages,
+                                           unsigned int count);
+
 /**
  * \brief Free a message
  *
@@ -123,6 +291,21 @@ void *message_queue_message_alloc_blocking(struct message_queue *queue);
  */
 void message_queue_message_free(struct message_queue *queue, void *message);
 
+/**
+ * \brief Free several messages at once
+ *
+ * Like message_queue_message_free, but reserves the freelist slots for all
+ * of the messages with one atomic operation and checks for blocked
+ * allocators once.
+ *
+ * \param queue pointer to the message queue from which the messages were
+ *        allocated
+ * \param messages the messages to free
+ * \param count the number of messages
+ */
+void message_queue_message_free_n(struct message_queue *queue, void **messages,
+                                  unsigned int count);
+
 /**
  * \brief Write a message to the queue
  *
@@ -134,6 +317,18 @@ void message_queue_message_free(struct message_queue *queue, void *message);
  */
 void message_queue_write(struct message_queue *queue, void *message);
 
+/**
+ * \brief Write several messages to the queue
+ *
+ * The messages are written in order into slots reserved with a single
+ * atomic operation, and blocked readers are woken once for the batch.
+ *
+ * \param queue pointer to the queue to which to write
+ * \param messages the messages to write
+ * \param count the number of messages
+ */
+void message_queue_write_n(struct message_queue *queue, void **messages, unsigned int count);
+
 /**
  * \brief Read a message from the queue if one is available
  *
@@ -154,10 +349,59 @@ void *message_queue_tryread(struct message_queue *queue);
  */
 void *message_queue_read(struct message_queue *queue);
 
+/**
+ * \brief Read up to count messages from the queue without blocking
+ *
+ * \param queue pointer to the queue from which to read
+ * \param messages array receiving the messages
+ * \param count the most messages to read
+ * \return the number of messages read, which may be zero
+ */
+unsigned int message_queue_tryread_n(struct message_queue *queue, void **messages,
+                                     unsigned int count);
+
+/**
+ * \brief Read up to count messages from the queue
+ *
+ * This blocks until at least one message is available, then returns it
+ * along with as many more as are ready, up to count.
+ *
+ * \param queue pointer to the queue from which to read
+ * \param messages array receiving the messages
+ * \param count the most messages to read
+ * \return the number of messages read
+ */
+unsigned int message_queue_read_n(struct message_queue *queue, void **messages,
+                                  unsigned int count);
+
+/**
+ * \brief Choose how to wait for a slot another thread is still publishing
+ *
+ * A reader can claim a slot just before its writer has stored the message
+ * in it, and likewise for the allocator's freelist. This sets what the
+ * waiting thread does meanwhile. It does not affect how a reader blocks on
+ * an empty queue.
+ *
+ * \param queue pointer to the message queue
+ * \param strategy one of the MESSAGE_QUEUE_WAIT_ constants
+ * \param spins the number of PAUSE-instruction spins before yielding or
+ *        parking. Ignored for MESSAGE_QUEUE_WAIT_SPIN.
+ */
+void message_queue_set_wait(struct message_queue *queue, int strategy, unsigned int spins);
+
+/**
+ * \brief Read the counters of how slot waits were resolved
+ *
+ * \param queue pointer to the message queue
+ * \param stats structure to receive the counters
+ */
+void message_queue_wait_stats(struct message_queue *queue, struct message_queue_wait_stats *stats);
+
 /**
  * \brief Destroy a message queue structure
  *
- * This frees any resources associated with the message queue.
+ * This frees any resources associated with the message queue. For a shared
+ * queue, it only unmaps this process's view of it.
  *
  * \param queue pointer to the message queue to destroy
  */
@@ -0,0 +1,342 @@
+/*
+ * Copyright (c) 2012 Jeremy Pepper
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of message_queue nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "message_queue.h"
+#include "spsc_queue.h"
+
+#define BENCH_DEPTH 64
+#define BENCH_MESSAGES 1000000
+#define BENCH_PACED_MESSAGES 20000
+#define BENCH_PACE_NS 20000
+#define BENCH_BATCH 16
+#define BENCH_WAKE_MESSAGES 5000
+#define BENCH_WAKE_NS 200000
+#define BENCH_CREATES 20000
+
+/* The queue operations the benchmark needs, so both queues run the same code */
+struct queue_ops {
+	const char *name;
+	int (*init)(void *queue, int message_size, int max_depth);
+	void *(*alloc)(void *queue);
+	void (*free)(void *queue, void *message);
+	void (*write)(void *queue, void *message);
+	void *(*read)(void *queue);
+	void (*destroy)(void *queue);
+	/* batch variants, or NULL if the queue has none */
+	unsigned int (*alloc_n)(void *queue, void **messages, unsigned int count);
+	void (*free_n)(void *queue, void **messages, unsigned int count);
+	void (*write_n)(void *queue, void **messages, unsigned int count);
+	unsigned int (*read_n)(void *queue, void **messages, unsigned int count);
+	/* slot wait counters, or NULL if the queue has none */
+	void (*wait_stats)(void *queue, struct message_queue_wait_stats *stats);
+};
+
+static int mq_spin_init(void *queue, int message_size, int max_depth) {
+	if(message_queue_init(queue, message_size, max_depth))
+		return -1;
+	message_queue_set_wait(queue, MESSAGE_QUEUE_WAIT_SPIN, 0);
+	return 0;
+}
+static int mq_yield_init(void *queue, int message_size, int max_depth) {
+	if(message_queue_init(queue, message_size, max_depth))
+		return -1;
+	message_queue_set_wait(queue, MESSAGE_QUEUE_WAIT_YIELD, MESSAGE_QUEUE_DEFAULT_SPINS);
+	return 0;
+}
+static void mq_wait_stats(void *queue, struct message_queue_wait_stats *stats) {
+	message_queue_wait_stats(queue, stats);
+}
+static int mq_init(void *queue, int message_size, int max_depth) {
+	return message_queue_init(queue, message_size, max_depth);
+}
+static void *mq_alloc(void *queue) { return message_queue_message_alloc_blocking(queue); }
+static void mq_free(void *queue, void *message) { message_queue_message_free(queue, message); }
+static void mq_write(void *queue, void *message) { message_queue_write(queue, message); }
+static void *mq_read(void *queue) { return message_queue_read(queue); }
+static void mq_destroy(void *queue) { message_queue_destroy(queue); }
+static unsigned int mq_alloc_n(void *queue, void **messages, unsigned int count) {
+	return message_queue_message_alloc_n(queue, messages, count);
+}
+static void mq_free_n(void *queue, void **messages, unsigned int count) {
+	message_queue_message_free_n(queue, messages, count);
+}
+static void mq_write_n(void *queue, void **messages, unsigned int count) {
+	message_queue_write_n(queue, messages, count);
+}
+static unsigned int mq_read_n(void *queue, void **messages, unsigned int count) {
+	return message_queue_read_n(queue, messages, count);
+}
+
+static int spsc_init(void *queue, int message_size, int max_depth) {
+	return spsc_queue_init(queue, message_size, max_depth);
+}
+static void *spsc_alloc(void *queue) { return spsc_queue_message_alloc_blocking(queue); }
+static void spsc_free(void *queue, void *message) { spsc_queue_message_free(queue, message); }
+static void spsc_write(void *queue, void *message) { spsc_queue_write(queue, message); }
+static void *spsc_read(void *queue) { return spsc_queue_read(queue); }
+static void spsc_destroy(void *queue) { spsc_queue_destroy(queue); }
+
+static const struct queue_ops queues[] = {
+	{"mpmc", mq_init, mq_alloc, mq_free, mq_write, mq_read, mq_destroy,
+	 mq_alloc_n, mq_free_n, mq_write_n, mq_read_n, mq_wait_stats},
+	{"mpmc-spin", mq_spin_init, mq_alloc, mq_free, mq_write, mq_read, mq_destroy,
+	 NULL, NULL, NULL, NULL, mq_wait_stats},
+	{"mpmc-yld", mq_yield_init, mq_alloc, mq_free, mq_write, mq_read, mq_destroy,
+	 NULL, NULL, NULL, NULL, mq_wait_stats},
+	{"spsc", spsc_init, spsc_alloc, spsc_free, spsc_write, spsc_read, spsc_destroy,
+	 NULL, NULL, NULL, NULL, NULL}
+};
+
+struct message {
+	uint64_t sent;
+	int last;
+};
+
+struct run {
+	const struct queue_ops *ops;
+	void *queue;
+	unsigned int count;
+	unsigned int pace;
+	unsigned int batch;
+	uint64_t *latency;
+};
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void *consumer_threadproc(void *data) {
+	struct run *run = data;
+	void *messages[BENCH_BATCH];
+	for(unsigned int i=0;i<run->count;) {
+		unsigned int got = 1;
+		if(run->batch > 1)
+			got = run->ops->read_n(run->queue, messages, run->batch);
+		else
+			messages[0] = run->ops->read(run->queue);
+		for(unsigned int j=0;j<got;++j) {
+			run->latency[i++] = now_ns() - ((struct message *)messages[j])->sent;
+		}
+		if(run->batch > 1)
+			run->ops->free_n(run->queue, messages, got);
+		else
+			run->ops->free(run->queue, messages[0]);
+	}
+	return data;
+}
+
+/* Allocates up to count messages, blocking until at least one is free */
+static unsigned int alloc_batch(const struct run *run, void **messages, unsigned int count) {
+	unsigned int got = run->ops->alloc_n(run->queue, messages, count);
+	if(got)
+		return got;
+	messages[0] = run->ops->alloc(run->queue);
+	return 1;
+}
+
+static int compare_u64(const void *a, const void *b) {
+	const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Sends run->count messages to the consumer, sleeping run->pace nanoseconds
+ * between them if it is nonzero. With a batch size above 1, messages are
+ * allocated and written up to that many at a time.
+ */
+static void produce(struct run *run) {
+	void *messages[BENCH_BATCH];
+	struct timespec delay = {0, run->pace};
+	for(unsigned int i=0;i<run->count;) {
+		unsigned int got = 1;
+		if(run->batch > 1)
+			got = alloc_batch(run, messages, run->count - i < run->batch ? run->count - i : run->batch);
+		else
+			messages[0] = run->ops->alloc(run->queue);
+		for(unsigned int j=0;j<got;++j) {
+			((struct message *)messages[j])->sent = now_ns();
+		}
+		if(run->batch > 1)
+			run->ops->write_n(run->queue, messages, got);
+		else
+			run->ops->write(run->queue, messages[0]);
+		i += got;
+		if(run->pace)
+			nanosleep(&delay, NULL);
+	}
+}
+
+/* Prints the throughput and the distribution of send-to-receive latency */
+static void report(const char *name, const char *mode, unsigned int count, uint64_t elapsed, uint64_t *latency) {
+	qsort(latency, count, sizeof(uint64_t), &compare_u64);
+	printf("%-9s %-6s %10.3f %9.1f %9.1f %9.1f %9.1f", name, mode,
+	       count / (elapsed / 1e9) / 1e6,
+	       latency[count / 2] / 1e3, latency[count / 100 * 99] / 1e3,
+	       latency[count / 1000 * 999] / 1e3, latency[count - 1] / 1e3);
+}
+
+/*
+ * Sends count messages from this thread to a consumer thread and reports on
+ * them. A long enough pace leaves the consumer asleep for every message, so
+ * the latency is the cost of waking it.
+ */
+static void bench(const struct queue_ops *ops, const char *mode, unsigned int count,
+                  unsigned int pace, unsigned int batch) {
+	union {
+		struct message_queue mpmc;
+		struct spsc_queue spsc;
+	} queue;
+	struct run run = {ops, &queue, count, pace, batch, malloc(sizeof(uint64_t) * count)};
+	char name[32];
+	pthread_t consumer;
+	uint64_t start, elapsed;
+	if(!run.latency || ops->init(&queue, sizeof(struct message), BENCH_DEPTH)) {
+		fprintf(stderr, "%s: initialization failed\n", ops->name);
+		free(run.latency);
+		return;
+	}
+	pthread_create(&consumer, NULL, &consumer_threadproc, &run);
+	start = now_ns();
+	produce(&run);
+	pthread_join(consumer, NULL);
+	elapsed = now_ns() - start;
+	if(batch > 1)
+		snprintf(name, sizeof(name), "%s/%u", ops->name, batch);
+	else
+		snprintf(name, sizeof(name), "%s", ops->name);
+	report(name, mode, count, elapsed, run.latency);
+	if(ops->wait_stats) {
+		struct message_queue_wait_stats stats;
+		ops->wait_stats(&queue, &stats);
+		printf("  %lu/%lu/%lu", stats.spins, stats.yields, stats.parks);
+	}
+	printf("\n");
+	ops->destroy(&queue);
+	free(run.latency);
+}
+
+#ifdef MESSAGE_QUEUE_FUTEX
+/*
+ * Like bench, but the consumer is a child process that attaches to a queue
+ * in a memfd. The latencies come back through a shared anonymous mapping.
+ */
+static void bench_process(const char *mode, unsigned int count, unsigned int pace) {
+	struct message_queue queue;
+	struct run run = {&queues[0], &queue, count, pace, 1};
+	const size_t latency_size = sizeof(uint64_t) * count;
+	uint64_t start, elapsed;
+	pid_t child;
+	int fd = memfd_create("queue-bench", 0);
+	if(fd < 0)
+		return;
+	run.latency = mmap(NULL, latency_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(run.latency == MAP_FAILED || message_queue_init_shared(&queue, sizeof(struct message), BENCH_DEPTH, fd)) {
+		fprintf(stderr, "mpmc-shm: initialization failed\n");
+		close(fd);
+		return;
+	}
+	start = now_ns();
+	child = fork();
+	if(child == 0) {
+		struct message_queue attached;
+		if(message_queue_attach(&attached, fd))
+			_exit(1);
+		run.queue = &attached;
+		consumer_threadproc(&run);
+		message_queue_destroy(&attached);
+		_exit(0);
+	}
+	if(child > 0) {
+		int status;
+		produce(&run);
+		waitpid(child, &status, 0);
+		elapsed = now_ns() - start;
+		if(WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+			report("mpmc-shm", mode, count, elapsed, run.latency);
+			printf("\n");
+		} else {
+			fprintf(stderr, "mpmc-shm: consumer failed\n");
+		}
+	}
+	message_queue_destroy(&queue);
+	munmap(run.latency, latency_size);
+	close(fd);
+}
+#endif
+
+/* Prints how many queues per second can be created and destroyed */
+static void bench_create(const struct queue_ops *ops) {
+	union {
+		struct message_queue mpmc;
+		struct spsc_queue spsc;
+	} queue;
+	uint64_t start = now_ns(), elapsed;
+	for(unsigned int i=0;i<BENCH_CREATES;++i) {
+		if(ops->init(&queue, sizeof(struct message), BENCH_DEPTH)) {
+			fprintf(stderr, "%s: initialization failed after %u queues\n", ops->name, i);
+			return;
+		}
+		ops->destroy(&queue);
+	}
+	elapsed = now_ns() - start;
+	printf("%-9s %10.0f creates/sec, %.2fus each\n", ops->name,
+	       BENCH_CREATES / (elapsed / 1e9), elapsed / 1e3 / BENCH_CREATES);
+}
+
+int main(void) {
+	printf("queue     mode    Mmsgs/sec   p50(us)   p99(us) p99.9(us)   max(us)  slot waits (spin/yield/park)\n");
+	for(unsigned int q=0;q<sizeof(queues)/sizeof(queues[0]);++q) {
+		bench(&queues[q], "burst", BENCH_MESSAGES, 0, 1);
+		bench(&queues[q], "paced", BENCH_PACED_MESSAGES, BENCH_PACE_NS, 1);
+		bench(&queues[q], "wake", BENCH_WAKE_MESSAGES, BENCH_WAKE_NS, 1);
+		if(queues[q].read_n)
+			bench(&queues[q], "burst", BENCH_MESSAGES, 0, BENCH_BATCH);
+	}
+#ifdef MESSAGE_QUEUE_FUTEX
+	bench_process("burst", BENCH_MESSAGES, 0);
+	bench_process("wake", BENCH_WAKE_MESSAGES, BENCH_WAKE_NS);
+#endif
+	printf("\n");
+	for(unsigned int q=0;q<sizeof(queues)/sizeof(queues[0]);++q) {
+		bench_create(&queues[q]);
+	}
+	return 0;
+}
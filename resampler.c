@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) 2013 Jeremy Pepper
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of crossfeed nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "resampler.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RESAMPLER_X86
+#define RESAMPLER_TARGET(isa) __attribute__((target(isa)))
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define RESAMPLER_NEON
+#endif
+
+/*
+ * Where the filter is 6dB down, as a fraction of the lower rate's Nyquist
+ * frequency, and the beta of its Kaiser window, which puts the stopband
+ * about 100dB down. With RESAMPLER_TAPS taps the transition is about 3kHz
+ * wide at 44.1kHz, so it is over by the Nyquist frequency.
+ */
+#define RESAMPLER_CUTOFF 0.93
+#define RESAMPLER_BETA 10
+/* Rows are padded to a multiple of this many taps for the SIMD dot products */
+#define RESAMPLER_ALIGN 16
+
+/*
+ * Each writes the dot products of a bank row with the left and right
+ * history, taps long, to output[0] and output[1].
+ */
+static void dot_scalar(const float *row, const float *left, const float *right, unsigned int taps,
+                       float *output) {
+	float l = 0, r = 0;
+	for(unsigned int j=0;j<taps;++j) {
+		l += row[j] * left[j];
+		r += row[j] * right[j];
+	}
+	output[0] = l;
+	output[1] = r;
+}
+
+#ifdef RESAMPLER_X86
+RESAMPLER_TARGET("sse2")
+static void dot_sse2(const float *row, const float *left, const float *right, unsigned int taps,
+                     float *output) {
+	__m128 l0 = _mm_setzero_ps(), l1 = _mm_setzero_ps();
+	__m128 r0 = _mm_setzero_ps(), r1 = _mm_setzero_ps();
+	__m128 sum;
+	for(unsigned int j=0;j<taps;j+=8) {
+		const __m128 c0 = _mm_loadu_ps(row + j), c1 = _mm_loadu_ps(row + j + 4);
+		l0 = _mm_add_ps(l0, _mm_mul_ps(c0, _mm_loadu_ps(left + j)));
+		l1 = _mm_add_ps(l1, _mm_mul_ps(c1, _mm_loadu_ps(left + j + 4)));
+		r0 = _mm_add_ps(r0, _mm_mul_ps(c0, _mm_loadu_ps(right + j)));
+		r1 = _mm_add_ps(r1, _mm_mul_ps(c1, _mm_loadu_ps(right + j + 4)));
+	}
+	l0 = _mm_add_ps(l0, l1);
+	r0 = _mm_add_ps(r0, r1);
+	/* l0+l2, r0+r2, l1+l3, r1+r3, then the halves added together */
+	sum = _mm_add_ps(_mm_unpacklo_ps(l0, r0), _mm_unpackhi_ps(l0, r0));
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	_mm_storel_pi((__m64 *)output, sum);
+}
+
+RESAMPLER_TARGET("avx2,fma")
+static void dot_avx2(const float *row, const float *left, const float *right, unsigned int taps,
+                     float *output) {
+	__m256 l0 = _mm256_setzero_ps(), l1 = _mm256_setzero_ps();
+	__m256 r0 = _mm256_setzero_ps(), r1 = _mm256_setzero_ps();
+	__m128 l, r, sum;
+	for(unsigned int j=0;j<taps;j+=16) {
+		const __m256 c0 = _mm256_loadu_ps(row + j), c1 = _mm256_loadu_ps(row + j + 8);
+		l0 = _mm256_fmadd_ps(c0, _mm256_loadu_ps(left + j), l0);
+		l1 = _mm256_fmadd_ps(c1, _mm256_loadu_ps(left + j + 8), l1);
+		r0 = _mm256_fmadd_ps(c0, _mm256_loadu_ps(right + j), r0);
+		r1 = _mm256_fmadd_ps(c1, _mm256_loadu_ps(right + j + 8), r1);
+	}
+	l0 = _mm256_add_ps(l0, l1);
+	r0 = _mm256_add_ps(r0, r1);
+	l = _mm_add_ps(_mm256_castps256_ps128(l0), _mm256_extractf128_ps(l0, 1));
+	r = _mm_add_ps(_mm256_castps256_ps128(r0), _mm256_extractf128_ps(r0, 1));
+	sum = _mm_add_ps(_mm_unpacklo_ps(l, r), _mm_unpackhi_ps(l, r));
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	_mm_storel_pi((__m64 *)output, sum);
+}
+#endif
+
+#ifdef RESAMPLER_NEON
+static void dot_neon(const float *row, const float *left, const float *right, unsigned int taps,
+                     float *output) {
+	float32x4_t l0 = vdupq_n_f32(0), l1 = vdupq_n_f32(0);
+	float32x4_t r0 = vdupq_n_f32(0), r1 = vdupq_n_f32(0);
+	float32x2_t l, r;
+	for(unsigned int j=0;j<taps;j+=8) {
+		const float32x4_t c0 = vld1q_f32(row + j), c1 = vld1q_f32(row + j + 4);
+		l0 = vmlaq_f32(l0, c0, vld1q_f32(left + j));
+		l1 = vmlaq_f32(l1, c1, vld1q_f32(left + j + 4));
+		r0 = vmlaq_f32(r0, c0, vld1q_f32(right + j));
+		r1 = vmlaq_f32(r1, c1, vld1q_f32(right + j + 4));
+	}
+	l0 = vaddq_f32(l0, l1);
+	r0 = vaddq_f32(r0, r1);
+	l = vadd_f32(vget_low_f32(l0), vget_high_f32(l0));
+	r = vadd_f32(vget_low_f32(r0), vget_high_f32(r0));
+	vst1_f32(output, vpadd_f32(l, r));
+}
+#endif
+
+static unsigned int gcd(unsigned int a, unsigned int b) {
+	while(b) {
+		const unsigned int t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/* The zeroth-order modified Bessel function of the first kind */
+static double bessel_i0(double x) {
+	double sum = 1, term = 1;
+	for(unsigned int k=1;term > sum * 1e-12;++k) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+	}
+	return sum;
+}
+
+/*
+ * Fills the bank from a windowed sinc at from*phases Hz, centered on the
+ * middle of its taps*phases samples. Row p takes every phases'th sample
+ * starting at p, and is normalized to unity gain at DC so that no phase
+ * stands out from the rest.
+ */
+static void resampler_design(resampler_t *resampler, int from, int to) {
+	const unsigned int len = resampler->taps * resampler->phases;
+	const double center = len / 2;
+	const double cutoff = RESAMPLER_CUTOFF * (to < from ? to : from) /
+	                      (2. * from * resampler->phases);
+	for(unsigned int p=0;p<resampler->phases;++p) {
+		float *row = resampler->bank + p * resampler->taps;
+		double sum = 0;
+		for(unsigned int j=0;j<resampler->taps;++j) {
+			const double x = p + (double)j * resampler->phases - center;
+			const double w = x / center;
+			double h = x ? sin(2 * M_PI * cutoff * x) / (M_PI * x) : 2 * cutoff;
+			h *= w > -1 && w < 1 ? bessel_i0(RESAMPLER_BETA * sqrt(1 - w*w)) : 0;
+			row[resampler->taps - 1 - j] = h;
+			sum += h;
+		}
+		for(unsigned int j=0;j<resampler->taps;++j) {
+			row[j] /= sum;
+		}
+	}
+}
+
+int resampler_init(resampler_t *resampler, int from, int to) {
+	unsigned int g, lower;
+	memset(resampler, 0, sizeof(resampler_t));
+	if(from <= 0 || to <= 0)
+		return -1;
+	g = gcd(from, to);
+	resampler->phases = to / g;
+	resampler->step = from / g;
+	if(resampler->phases > RESAMPLER_MAX_PHASES)
+		return -1;
+	/* a lower output rate narrows the passband, so the filter spans more input */
+	lower = to < from ? to : from;
+	resampler->taps = ((unsigned long long)RESAMPLER_TAPS * from + lower - 1) / lower;
+	resampler->taps = (resampler->taps + RESAMPLER_ALIGN - 1) & ~(RESAMPLER_ALIGN - 1);
+	resampler->bank = malloc(sizeof(float) * resampler->taps * resampler->phases);
+	resampler->left = calloc(resampler->taps - 1 + RESAMPLER_BLOCK, sizeof(float));
+	resampler->right = calloc(resampler->taps - 1 + RESAMPLER_BLOCK, sizeof(float));
+	if(!resampler->bank || !resampler->left || !resampler->right) {
+		resampler_destroy(resampler);
+		return -1;
+	}
+	resampler_design(resampler, from, to);
+	/* the first output is centered on the first input frame, past the zeroed history */
+	resampler->time = (resampler->taps - 1) * resampler->phases + resampler->taps * resampler->phases / 2;
+	resampler->dot = dot_scalar;
+#ifdef RESAMPLER_X86
+	if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		resampler->dot = dot_avx2;
+	else if(__builtin_cpu_supports("sse2"))
+		resampler->dot = dot_sse2;
+#endif
+#ifdef RESAMPLER_NEON
+	resampler->dot = dot_neon;
+#endif
+	return 0;
+}
+
+void resampler_destroy(resampler_t *resampler) {
+	free(resampler->right);
+	free(resampler->left);
+	free(resampler->bank);
+	resampler->right = resampler->left = resampler->bank = NULL;
+}
+
+unsigned int resampler_max_output(const resampler_t *resampler, unsigned int frames) {
+	const unsigned int blocks = (frames + RESAMPLER_BLOCK - 1) / RESAMPLER_BLOCK;
+	return ((unsigned long long)frames * resampler->phases) / resampler->step + blocks;
+}
+
+/*
+ * Runs frames frames of input, or of silence if input is NULL, through the
+ * filter a block at a time, writing outputs until limit have been produced
+ * in all.
+ */
+static unsigned int resampler_run(resampler_t *resampler, const float *input, unsigned int frames,
+                                  float *output, unsigned long long limit) {
+	const unsigned int history = resampler->taps - 1;
+	unsigned int written = 0;
+	while(frames && resampler->produced < limit) {
+		const unsigned int n = frames < RESAMPLER_BLOCK ? frames : RESAMPLER_BLOCK;
+		const unsigned int end = (history + n) * resampler->phases;
+		float *left = resampler->left + history, *right = resampler->right + history;
+		if(input) {
+			for(unsigned int i=0;i<n;++i) {
+				left[i] = input[i*2];
+				right[i] = input[i*2+1];
+			}
+			input += n*2;
+		} else {
+			memset(left, 0, sizeof(float) * n);
+			memset(right, 0, sizeof(float) * n);
+		}
+		for(;resampler->time < end && resampler->produced < limit;resampler->time += resampler->step) {
+			const unsigned int i = resampler->time / resampler->phases - history;
+			const unsigned int p = resampler->time % resampler->phases;
+			resampler->dot(resampler->bank + p * resampler->taps, resampler->left + i,
+			               resampler->right + i, resampler->taps, output + written*2);
+			++written;
+			++resampler->produced;
+		}
+		resampler->time -= n * resampler->phases;
+		memmove(resampler->left, resampler->left + n, sizeof(float) * history);
+		memmove(resampler->right, resampler->right + n, sizeof(float) * history);
+		frames -= n;
+	}
+	return written;
+}
+
+unsigned int resampler_process(resampler_t *resampler, const float *input, unsigned int frames,
+                               float *output) {
+	resampler->consumed += frames;
+	return resampler_run(resampler, input, frames, output, ~0ULL);
+}
+
+unsigned int resampler_flush(resampler_t *resampler, unsigned int frames, float *output) {
+	const unsigned long long total = (resampler->consumed * resampler->phases + resampler->step - 1) /
+	                                 resampler->step;
+	return resampler_run(resampler, NULL, frames, output, total);
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2013 Jeremy Pepper
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of crossfeed nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Rates convert by the ratio phases/step in lowest terms, so phases is
+ * limited to keep the filter bank small; 44.1kHz to 96kHz needs 320.
+ * RESAMPLER_TAPS is the filter's length in samples at the lower of the two
+ * rates, and RESAMPLER_BLOCK the most input frames handled in one pass.
+ */
+#define RESAMPLER_MAX_PHASES 2048
+#define RESAMPLER_TAPS 96
+#define RESAMPLER_BLOCK 1024
+
+/*
+ * A streaming polyphase resampler for interleaved stereo. bank holds one
+ * row of taps coefficients for each of the phases positions between input
+ * samples, reversed so that each output is a dot product with the history.
+ * left[] and right[] are linear history buffers like crossfeed_t's: taps-1
+ * frames carried over, followed by up to RESAMPLER_BLOCK new ones. time is
+ * the position of the next output in 1/phases of an input frame, counted
+ * from the start of the history. dot is the widest dot product the CPU
+ * can run.
+ */
+typedef struct resampler_s {
+	float *bank;
+	float *left;
+	float *right;
+	unsigned int phases;
+	unsigned int step;
+	unsigned int taps;
+	unsigned int time;
+	unsigned long long consumed;
+	unsigned long long produced;
+	void (*dot)(const float *row, const float *left, const float *right, unsigned int taps,
+	            float *output);
+} resampler_t;
+
+/*
+ * Sets up conversion from one rate to another. The filter's passband ends a
+ * little short of the lower rate's Nyquist frequency, and its delay is
+ * compensated, so output frame k lines up with input time k*from/to. Fails
+ * if the ratio needs more than RESAMPLER_MAX_PHASES phases.
+ */
+int resampler_init(resampler_t *resampler, int from, int to);
+void resampler_destroy(resampler_t *resampler);
+/* The most output frames a call with frames input frames can produce */
+unsigned int resampler_max_output(const resampler_t *resampler, unsigned int frames);
+/*
+ * Resamples frames frames of input and returns the number of frames written
+ * to output, which holds at least resampler_max_output(frames).
+ */
+unsigned int resampler_process(resampler_t *resampler, const float *input, unsigned int frames,
+                               float *output);
+/*
+ * Pushes up to frames frames of silence through after the end of the input,
+ * stopping once output has covered all of the input, and returns the number
+ * of frames written. Call it until it returns 0; the whole stream then has
+ * ceil(input frames * to / from) output frames.
+ */
+unsigned int resampler_flush(resampler_t *resampler, unsigned int frames, float *output);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
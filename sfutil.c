@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2013 Jeremy Pepper
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of crossfeed nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "cautil.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_SAMPLERATE 44100
+#define DEFAULT_BUFFER_FRAMES 512
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t period_ns(const struct Player *player) {
+	return player->bufferFrames * 1000000000ull / player->samplerate;
+}
+
+static void record_timing(struct PlayerTiming *timing, uint64_t ns, uint64_t period) {
+	unsigned int bucket = 63 - __builtin_clzll(ns | 1);
+	if(bucket >= PLAYER_TIMING_BUCKETS)
+		bucket = PLAYER_TIMING_BUCKETS - 1;
+	++timing->histogram[bucket];
+	++timing->callbacks;
+	timing->total_ns += ns;
+	if(ns > timing->max_ns)
+		timing->max_ns = ns;
+	if(ns > period)
+		++timing->overruns;
+}
+
+/*
+ * Stands in for the output device: decodes a buffer, hands it to the event
+ * handler the way a render callback would, and then waits for the next
+ * period if the clock is running in real time. Only the handler is timed.
+ */
+static void *render_threadproc(void *data) {
+	struct Player *player = data;
+	const uint64_t period = period_ns(player);
+	struct PlayerEvent evt = {
+		.player = player,
+		.type = PLAYER_RENDER,
+		.left = player->left,
+		.right = player->right,
+		.size = player->bufferFrames
+	};
+	struct timespec deadline;
+	uint64_t next = now_ns();
+	while(!player->stopping) {
+		sf_count_t read = sf_readf_float(player->file, player->buffer, player->bufferFrames);
+		uint64_t start;
+		if(read <= 0)
+			break;
+		if(player->channels == 1) {
+			for(sf_count_t i=0;i<read;++i) {
+				player->left[i] = player->right[i] = player->buffer[i];
+			}
+		} else {
+			for(sf_count_t i=0;i<read;++i) {
+				player->left[i] = player->buffer[i*2];
+				player->right[i] = player->buffer[i*2+1];
+			}
+		}
+		for(unsigned int i=read;i<player->bufferFrames;++i) {
+			player->left[i] = player->right[i] = 0;
+		}
+		start = now_ns();
+		player->handleEvent(&evt);
+		record_timing(&player->timing, now_ns() - start, period);
+		if(player->realtime) {
+			next += period;
+			deadline.tv_sec = next / 1000000000ull;
+			deadline.tv_nsec = next % 1000000000ull;
+			while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL));
+		}
+	}
+	if(!player->stopping && player->playing) {
+		player->playing = 0;
+		evt.type = PLAYER_DONE;
+		player->handleEvent(&evt);
+	}
+	return data;
+}
+
+OSStatus CAInitPlayer(struct Player *player, PlayerEventHandler eventHandler) {
+	if(!eventHandler)
+		return -1;
+	memset(player, 0, sizeof(*player));
+	player->handleEvent = eventHandler;
+	player->samplerate = DEFAULT_SAMPLERATE;
+	player->bufferFrames = DEFAULT_BUFFER_FRAMES;
+	player->realtime = 1;
+	return 0;
+}
+
+void CAConfigureSimulation(struct Player *player, int samplerate, unsigned int bufferFrames, int realtime) {
+	player->samplerate = samplerate;
+	player->bufferFrames = bufferFrames;
+	player->realtime = realtime;
+}
+
+/*
+ * The simulated device doesn't resample, so a file at another rate plays at
+ * the device's rate. That changes its pitch but not the cost of rendering.
+ */
+OSStatus CAPlayFile(struct Player *player, const char *path) {
+	SF_INFO info = {0};
+	player->file = sf_open(path, SFM_READ, &info);
+	if(!player->file)
+		return -1;
+	if(info.channels > 2)
+		goto close_file;
+	player->channels = info.channels;
+	player->samples = info.frames;
+	player->buffer = malloc(sizeof(float) * player->bufferFrames * info.channels);
+	player->left = malloc(sizeof(float) * player->bufferFrames);
+	player->right = malloc(sizeof(float) * player->bufferFrames);
+	if(!player->buffer || !player->left || !player->right)
+		goto free_buffers;
+	player->stopping = 0;
+	player->playing = 1;
+	if(pthread_create(&player->thread, NULL, &render_threadproc, player)) {
+		player->playing = 0;
+		fprintf(stderr, "Failed to start playback\n");
+		goto free_buffers;
+	}
+	player->rendering = 1;
+	return 0;
+free_buffers:
+	free(player->right);
+	free(player->left);
+	free(player->buffer);
+	player->right = player->left = player->buffer = NULL;
+close_file:
+	sf_close(player->file);
+	player->file = NULL;
+	return -1;
+}
+
+/* Does nothing unless a CAPlayFile call started a render thread */
+void CAStopPlayback(struct Player *player) {
+	if(!player->rendering)
+		return;
+	player->stopping = 1;
+	pthread_join(player->thread, NULL);
+	player->rendering = 0;
+	player->playing = 0;
+	free(player->right);
+	free(player->left);
+	free(player->buffer);
+	player->right = player->left = player->buffer = NULL;
+	sf_close(player->file);
+	player->file = NULL;
+}
+
+void CADestroyPlayer(struct Player *player) {
+	CAStopPlayback(player);
+}
+
+void CAPrintTiming(struct Player *player, FILE *out) {
+	const struct PlayerTiming *timing = &player->timing;
+	const uint64_t period = period_ns(player);
+	unsigned long peak = 0;
+	if(!timing->callbacks)
+		return;
+	fprintf(out, "%lu render events of %u frames at %dHz, deadline %.1fus\n",
+	        timing->callbacks, player->bufferFrames, player->samplerate, period / 1e3);
+	fprintf(out, "mean %.2fus, max %.2fus (%.1f%% of deadline), %lu overruns\n",
+	        timing->total_ns / 1e3 / timing->callbacks, timing->max_ns / 1e3,
+	        timing->max_ns * 100.0 / period, timing->overruns);
+	for(unsigned int i=0;i<PLAYER_TIMING_BUCKETS;++i) {
+		if(timing->histogram[i] > peak)
+			peak = timing->histogram[i];
+	}
+	for(unsigned int i=0;i<PLAYER_TIMING_BUCKETS;++i) {
+		if(!timing->histogram[i])
+			continue;
+		fprintf(out, "%10.2fus - %10.2fus %9lu ", (i ? 1ull << i : 0) / 1e3, (2ull << i) / 1e3,
+		        timing->histogram[i]);
+		for(unsigned long n=0;n<(timing->histogram[i]*40+peak-1)/peak;++n) {
+			fputc('#', out);
+		}
+		fputc('\n', out);
+	}
+}
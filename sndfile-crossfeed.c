@@ -28,29 +28,991 @@
  */
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <math.h>
+#include <sys/stat.h>
 #include <sndfile.h>
 #include "crossfeed.h"
+#include "message_queue.h"
+#include "audio_pool.h"
+#include "wavmap.h"
+#include "resampler.h"
 
-int main(int argc, char *argv[]) {
-	char *in_filename = argv[1];
-	char *out_filename = argv[2];
+/* The rate files are filtered at when there's no kernel for their own */
+#define FALLBACK_SAMPLERATE 96000
+#define BLOCK_FRAMES 1024
+#define CHUNK_FRAMES 65536
+#define PIPELINE_DEPTH 4
+/* Output is always stereo 24-bit PCM, written packed by crossfeed_filter_convert */
+#define OUTPUT_FRAME_SIZE 6
+
+/*
+ * A chunk of the file filtered independently by a worker. input holds prime
+ * frames from the end of the previous chunk followed by frames new ones;
+ * running the prime frames through a fresh filter first reproduces the
+ * state the serial filter would have at the start of the chunk. output
+ * receives packed 24-bit frames, and start is the first new frame's
+ * position in the file, which seeds the chunk's dither.
+ */
+struct job {
+	float *input;
+	float *output;
+	unsigned long long start;
+	unsigned int prime;
+	unsigned int frames;
+	int samplerate;
+	int failed;
+	int done;
+};
+
+/*
+ * The queues connecting the pipeline stages, the pools their audio blocks
+ * come from, and the time each stage spent waiting. Input and output blocks
+ * come from separate pools so that the reader can't starve the filter of
+ * output blocks. A block with no frames marks the end of the file. After a
+ * short write the writer keeps draining its queue without writing.
+ */
+struct pipeline {
+	SNDFILE *in_file;
+	SNDFILE *out_file;
+	struct audio_pool input_pool;
+	struct audio_pool output_pool;
+	struct message_queue read_queue;
+	struct message_queue write_queue;
+	double read_stall;
+	double filter_stall;
+	double write_stall;
+	int write_failed;
+};
+
+static struct message_queue work_queue, done_queue;
+static unsigned int block_frames = BLOCK_FRAMES;
+static int pipelined;
+static int dither;
+static int filter_rate;
+static int resample_back;
+
+/*
+ * The rates a file goes through: it is read at input, filtered at filter
+ * and written at output, and resampled in between where these differ.
+ */
+struct rates {
+	int input;
+	int filter;
+	int output;
+};
+
+/*
+ * A stream's filter and the resamplers around it: up converts the input to
+ * the rate being filtered at, and down converts the result to the output
+ * rate. Resampled audio passes through buf and obuf BLOCK_FRAMES input
+ * frames at a time, so memory stays bounded whatever the ratio, and is
+ * converted to packed 24-bit in the same pass as the filter or, when
+ * resampling back, the last resampler. consumed and produced count input
+ * and output frames, to trim the output to the input's length at the end.
+ */
+struct stage {
+	crossfeed_t filter;
+	struct crossfeed_output out;
+	resampler_t up;
+	resampler_t down;
+	int resample_up;
+	int resample_down;
+	float *buf;
+	float *obuf;
+	struct rates rates;
+	unsigned long long consumed;
+	unsigned long long produced;
+};
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void post(struct message_queue *queue, void *data) {
+	void **msg = message_queue_message_alloc_blocking(queue);
+	*msg = data;
+	message_queue_write(queue, msg);
+}
+
+static void *receive(struct message_queue *queue) {
+	void **msg = message_queue_read(queue);
+	void *data = *msg;
+	message_queue_message_free(queue, msg);
+	return data;
+}
+
+/* Like receive, but adds the time spent waiting to *stall */
+static void *receive_timed(struct message_queue *queue, double *stall) {
+	double start = now();
+	void *data = receive(queue);
+	*stall += now() - start;
+	return data;
+}
+
+/* Like audio_pool_alloc, but adds the time spent waiting to *stall */
+static struct audio_block *alloc_timed(struct audio_pool *pool, double *stall) {
+	double start = now();
+	struct audio_block *block = audio_pool_alloc(pool);
+	*stall += now() - start;
+	return block;
+}
+
+/*
+ * Picks the rates for a file at samplerate. It is filtered at -R's rate if
+ * one was given, or else at its own rate, or at FALLBACK_SAMPLERATE if
+ * there is no kernel for that. It is written at the rate it was filtered at
+ * when -R was given without -b, and otherwise at its own rate.
+ */
+static int choose_rates(struct rates *rates, int samplerate) {
+	crossfeed_t filter;
+	rates->input = samplerate;
+	rates->filter = filter_rate ? filter_rate : samplerate;
+	if(crossfeed_init(&filter, rates->filter)) {
+		if(filter_rate || crossfeed_init(&filter, FALLBACK_SAMPLERATE)) {
+			fprintf(stderr, "Filter not available for %dHz\n", rates->filter);
+			return -1;
+		}
+		rates->filter = FALLBACK_SAMPLERATE;
+	}
+	crossfeed_destroy(&filter);
+	rates->output = filter_rate && !resample_back ? rates->filter : samplerate;
+	return 0;
+}
+
+static void stage_destroy(struct stage *stage) {
+	crossfeed_destroy(&stage->filter);
+	resampler_destroy(&stage->up);
+	resampler_destroy(&stage->down);
+	free(stage->obuf);
+	free(stage->buf);
+}
+
+/*
+ * The most frames stage_process can write for frames input frames, or
+ * stage_flush for BLOCK_FRAMES
+ */
+static unsigned int stage_max_output(const struct stage *stage, unsigned int frames) {
+	const unsigned int blocks = (frames + BLOCK_FRAMES - 1) / BLOCK_FRAMES;
+	unsigned int n = frames < BLOCK_FRAMES ? frames : BLOCK_FRAMES;
+	if(!stage->resample_up)
+		return frames;
+	n = resampler_max_output(&stage->up, n);
+	if(stage->resample_down)
+		n = resampler_max_output(&stage->down, n);
+	return blocks * n;
+}
+
+static int stage_init(struct stage *stage, const struct rates *rates) {
+	memset(stage, 0, sizeof(struct stage));
+	stage->rates = *rates;
+	if(crossfeed_init(&stage->filter, rates->filter))
+		return -1;
+	crossfeed_output_init(&stage->out, CROSSFEED_FORMAT_S24, dither);
+	if(rates->input == rates->filter)
+		return 0;
+	if(resampler_init(&stage->up, rates->input, rates->filter)) {
+		fprintf(stderr, "Can't resample %dHz to %dHz\n", rates->input, rates->filter);
+		goto fail;
+	}
+	stage->resample_up = 1;
+	stage->buf = malloc(sizeof(float) * resampler_max_output(&stage->up, BLOCK_FRAMES) * 2);
+	if(!stage->buf)
+		goto fail;
+	if(rates->output == rates->filter)
+		return 0;
+	if(resampler_init(&stage->down, rates->filter, rates->output)) {
+		fprintf(stderr, "Can't resample %dHz to %dHz\n", rates->filter, rates->output);
+		goto fail;
+	}
+	stage->resample_down = 1;
+	stage->obuf = malloc(sizeof(float) * stage_max_output(stage, BLOCK_FRAMES) * 2);
+	if(!stage->obuf)
+		goto fail;
+	return 0;
+fail:
+	stage_destroy(stage);
+	return -1;
+}
+
+/*
+ * Filters frames frames of buf, at the rate being filtered at, into output,
+ * and returns the number of frames written
+ */
+static unsigned int stage_emit(struct stage *stage, unsigned int frames, unsigned char *output) {
+	if(!stage->resample_down) {
+		crossfeed_filter_convert(&stage->filter, stage->buf, output, frames, &stage->out);
+		return frames;
+	}
+	crossfeed_filter(&stage->filter, stage->buf, stage->buf, frames);
+	frames = resampler_process(&stage->down, stage->buf, frames, stage->obuf);
+	crossfeed_convert(stage->obuf, output, frames, &stage->out);
+	return frames;
+}
+
+/*
+ * Filters and resamples frames frames of input into packed 24-bit output,
+ * which holds stage_max_output(frames), and returns the number of frames
+ * written. Without resampling, this is just crossfeed_filter_convert.
+ */
+static unsigned int stage_process(struct stage *stage, const float *input, unsigned int frames,
+                                  unsigned char *output) {
+	unsigned int written = 0;
+	if(!stage->resample_up) {
+		crossfeed_filter_convert(&stage->filter, input, output, frames, &stage->out);
+		return frames;
+	}
+	stage->consumed += frames;
+	while(frames) {
+		const unsigned int n = frames < BLOCK_FRAMES ? frames : BLOCK_FRAMES;
+		const unsigned int resampled = resampler_process(&stage->up, input, n, stage->buf);
+		written += stage_emit(stage, resampled, output + written * OUTPUT_FRAME_SIZE);
+		input += n*2;
+		frames -= n;
+	}
+	stage->produced += written;
+	return written;
+}
+
+/*
+ * Writes what is still held in the resamplers after the end of the input
+ * to output, which holds stage_max_output(BLOCK_FRAMES), and returns the
+ * number of frames written. Call it until it returns 0; the output then has
+ * as many frames as the input at the output rate, rounded up.
+ */
+static unsigned int stage_flush(struct stage *stage, unsigned char *output) {
+	const unsigned long long total = (stage->consumed * stage->rates.output + stage->rates.input - 1) /
+	                                 stage->rates.input;
+	unsigned int frames = 0;
+	if(!stage->resample_up)
+		return 0;
+	while(!frames && stage->produced < total) {
+		const unsigned int n = resampler_flush(&stage->up, BLOCK_FRAMES, stage->buf);
+		if(n) {
+			frames = stage_emit(stage, n, output);
+		} else if(stage->resample_down) {
+			frames = resampler_flush(&stage->down, resampler_max_output(&stage->up, BLOCK_FRAMES),
+			                         stage->obuf);
+			crossfeed_convert(stage->obuf, output, frames, &stage->out);
+		} else {
+			break;
+		}
+	}
+	if(frames > total - stage->produced)
+		frames = total - stage->produced;
+	stage->produced += frames;
+	return frames;
+}
+
+static void *worker_threadproc(void *data) {
+	float scratch[BLOCK_FRAMES*2];
+	struct job *job;
+	struct crossfeed_output out;
+	crossfeed_t filter;
+	while((job = receive(&work_queue))) {
+		job->failed = crossfeed_init(&filter, job->samplerate);
+		if(!job->failed) {
+			crossfeed_output_init(&out, CROSSFEED_FORMAT_S24, dither);
+			crossfeed_output_seed(&out, job->start);
+			/* long store kernels can need more priming than a chunk's output holds */
+			for(unsigned int i=0;i<job->prime;i+=BLOCK_FRAMES) {
+				const unsigned int frames = job->prime - i < BLOCK_FRAMES ? job->prime - i : BLOCK_FRAMES;
+				crossfeed_filter(&filter, job->input + i*2, scratch, frames);
+			}
+			crossfeed_filter_convert(&filter, job->input + job->prime*2, job->output, job->frames,
+			                         &out);
+			crossfeed_destroy(&filter);
+		}
+		post(&done_queue, job);
+	}
+	return data;
+}
+
+static int process_serial(SNDFILE *in_file, SNDFILE *out_file, const struct rates *rates) {
+	struct stage stage;
+	float *buf;
+	unsigned char *obuf;
+	sf_count_t read;
+	unsigned int frames;
+	int rv = -1;
+	if(stage_init(&stage, rates))
+		return -1;
+	buf = malloc(sizeof(float) * block_frames * 2);
+	obuf = malloc(OUTPUT_FRAME_SIZE *
+	              stage_max_output(&stage, block_frames > BLOCK_FRAMES ? block_frames : BLOCK_FRAMES));
+	if(!buf || !obuf)
+		goto done;
+	while((read = sf_read_float(in_file, buf, block_frames*2)) > 0) {
+		frames = stage_process(&stage, buf, read/2, obuf);
+		if(sf_write_raw(out_file, obuf, OUTPUT_FRAME_SIZE * frames) != OUTPUT_FRAME_SIZE * frames)
+			goto done;
+	}
+	while((frames = stage_flush(&stage, obuf))) {
+		if(sf_write_raw(out_file, obuf, OUTPUT_FRAME_SIZE * frames) != OUTPUT_FRAME_SIZE * frames)
+			goto done;
+	}
+	rv = 0;
+done:
+	stage_destroy(&stage);
+	free(obuf);
+	free(buf);
+	return rv;
+}
+
+static void *reader_threadproc(void *data) {
+	struct pipeline *pipeline = data;
+	struct audio_block *block;
+	do {
+		sf_count_t read;
+		block = alloc_timed(&pipeline->input_pool, &pipeline->read_stall);
+		read = sf_read_float(pipeline->in_file, block->samples, pipeline->input_pool.frames_per_block*2);
+		block->frames = read > 0 ? read / 2 : 0;
+		post(&pipeline->read_queue, block);
+	} while(block->frames);
+	return data;
+}
+
+static void *writer_threadproc(void *data) {
+	struct pipeline *pipeline = data;
+	struct audio_block *block;
+	while((block = receive_timed(&pipeline->write_queue, &pipeline->write_stall))->frames) {
+		const sf_count_t bytes = OUTPUT_FRAME_SIZE * block->frames;
+		if(!pipeline->write_failed && sf_write_raw(pipeline->out_file, block->samples, bytes) != bytes)
+			pipeline->write_failed = 1;
+		audio_pool_free(&pipeline->output_pool, block);
+	}
+	audio_pool_free(&pipeline->input_pool, block);
+	return data;
+}
+
+/*
+ * Reads, filters and writes on separate threads so that the filter never
+ * waits on I/O unless the disk can't keep up, and reports how long each
+ * stage was left waiting on the others. Audio is read into and written from
+ * pooled blocks that are passed along by pointer, so nothing is allocated or
+ * copied between stages once the pool is set up. Output blocks hold packed
+ * 24-bit frames, and are sized for the most a block of input can turn into
+ * after resampling.
+ */
+static int process_pipelined(SNDFILE *in_file, SNDFILE *out_file, const char *name,
+                             const struct rates *rates) {
+	struct pipeline pipeline = {in_file, out_file};
+	pthread_t reader, writer;
+	struct audio_block *input, *output;
+	struct stage stage;
+	unsigned int output_frames;
+	double start;
+	int rv = -1;
+	if(stage_init(&stage, rates))
+		return -1;
+	output_frames = stage_max_output(&stage, block_frames > BLOCK_FRAMES ? block_frames : BLOCK_FRAMES);
+	/* in float frames, which the pool's blocks are measured in */
+	output_frames = (output_frames * OUTPUT_FRAME_SIZE + sizeof(float) * 2 - 1) / (sizeof(float) * 2);
+	if(audio_pool_init(&pipeline.input_pool, block_frames, PIPELINE_DEPTH, MESSAGE_QUEUE_HUGEPAGES))
+		goto destroy_stage;
+	if(audio_pool_init(&pipeline.output_pool, output_frames, PIPELINE_DEPTH, MESSAGE_QUEUE_HUGEPAGES))
+		goto destroy_input_pool;
+	if(message_queue_init(&pipeline.read_queue, sizeof(struct audio_block *), PIPELINE_DEPTH))
+		goto destroy_output_pool;
+	if(message_queue_init(&pipeline.write_queue, sizeof(struct audio_block *), PIPELINE_DEPTH))
+		goto destroy_read_queue;
+	start = now();
+	if(pthread_create(&writer, NULL, &writer_threadproc, &pipeline))
+		goto destroy_write_queue;
+	if(pthread_create(&reader, NULL, &reader_threadproc, &pipeline)) {
+		input = audio_pool_alloc(&pipeline.input_pool);
+		input->frames = 0;
+		post(&pipeline.write_queue, input);
+		pthread_join(writer, NULL);
+		goto destroy_write_queue;
+	}
+	while((input = receive_timed(&pipeline.read_queue, &pipeline.filter_stall))->frames) {
+		output = alloc_timed(&pipeline.output_pool, &pipeline.filter_stall);
+		output->frames = stage_process(&stage, input->samples, input->frames,
+		                               (unsigned char *)output->samples);
+		audio_pool_free(&pipeline.input_pool, input);
+		/* an empty block would end the file, and a resampler can hold a whole block back */
+		if(output->frames)
+			post(&pipeline.write_queue, output);
+		else
+			audio_pool_free(&pipeline.output_pool, output);
+	}
+	while(1) {
+		output = alloc_timed(&pipeline.output_pool, &pipeline.filter_stall);
+		output->frames = stage_flush(&stage, (unsigned char *)output->samples);
+		if(!output->frames) {
+			audio_pool_free(&pipeline.output_pool, output);
+			break;
+		}
+		post(&pipeline.write_queue, output);
+	}
+	post(&pipeline.write_queue, input);
+	pthread_join(reader, NULL);
+	pthread_join(writer, NULL);
+	fprintf(stderr, "%s: %.3fs, stalled: read %.3fs, filter %.3fs, write %.3fs\n",
+	        name, now() - start, pipeline.read_stall, pipeline.filter_stall, pipeline.write_stall);
+	rv = pipeline.write_failed ? -1 : 0;
+destroy_write_queue:
+	message_queue_destroy(&pipeline.write_queue);
+destroy_read_queue:
+	message_queue_destroy(&pipeline.read_queue);
+destroy_output_pool:
+	audio_pool_destroy(&pipeline.output_pool);
+destroy_input_pool:
+	audio_pool_destroy(&pipeline.input_pool);
+destroy_stage:
+	stage_destroy(&stage);
+	return rv;
+}
+
+/*
+ * Reads chunks in order and hands them to the workers, keeping up to
+ * 2*threads chunks in flight, and writes them back out in the same order.
+ */
+static int process_parallel(SNDFILE *in_file, SNDFILE *out_file, unsigned int threads,
+                            int samplerate) {
+	const unsigned int depth = threads * 2;
+	unsigned int history, head = 0, tail = 0, carry = 0, started;
+	unsigned long long position = 0;
+	int eof = 0, failed = 0, rv = -1;
+	crossfeed_t filter;
+	struct job *jobs;
+	float *carried;
+	pthread_t *workers;
+	if(crossfeed_init(&filter, samplerate))
+		return -1;
+	history = crossfeed_history(&filter);
+	crossfeed_destroy(&filter);
+	jobs = calloc(depth, sizeof(struct job));
+	workers = calloc(threads, sizeof(pthread_t));
+	/* a one-tap kernel has no history, but malloc(0) may return NULL */
+	carried = malloc(sizeof(float) * (history ? history : 1) * 2);
+	if(!jobs || !workers || !carried)
+		goto done;
+	for(unsigned int i=0;i<depth;++i) {
+		jobs[i].input = malloc(sizeof(float) * (history + CHUNK_FRAMES) * 2);
+		jobs[i].output = malloc(sizeof(float) * CHUNK_FRAMES * 2);
+		if(!jobs[i].input || !jobs[i].output)
+			goto free_jobs;
+	}
+	if(message_queue_init(&work_queue, sizeof(struct job *), depth + threads))
+		goto free_jobs;
+	if(message_queue_init(&done_queue, sizeof(struct job *), depth))
+		goto destroy_work_queue;
+	/* carry on with however many workers could be started */
+	for(started=0;started<threads;++started) {
+		if(pthread_create(&workers[started], NULL, &worker_threadproc, NULL))
+			break;
+	}
+	if(!started)
+		goto destroy_done_queue;
+	while(1) {
+		while(!eof && head - tail < depth) {
+			struct job *job = &jobs[head % depth];
+			sf_count_t read;
+			memcpy(job->input, carried, sizeof(float) * carry * 2);
+			read = sf_read_float(in_file, job->input + carry*2, CHUNK_FRAMES*2);
+			if(read <= 0) {
+				eof = 1;
+				break;
+			}
+			job->start = position;
+			job->prime = carry;
+			job->frames = read / 2;
+			position += job->frames;
+			job->samplerate = samplerate;
+			job->done = 0;
+			carry = job->prime + job->frames < history ? job->prime + job->frames : history;
+			memcpy(carried, job->input + (job->prime + job->frames - carry)*2,
+			       sizeof(float) * carry * 2);
+			post(&work_queue, job);
+			++head;
+		}
+		if(head == tail)
+			break;
+		while(!jobs[tail % depth].done) {
+			((struct job *)receive(&done_queue))->done = 1;
+		}
+		failed |= jobs[tail % depth].failed;
+		if(!failed) {
+			const sf_count_t bytes = OUTPUT_FRAME_SIZE * jobs[tail % depth].frames;
+			failed = sf_write_raw(out_file, jobs[tail % depth].output, bytes) != bytes;
+		}
+		++tail;
+	}
+	for(unsigned int i=0;i<started;++i) {
+		post(&work_queue, NULL);
+	}
+	for(unsigned int i=0;i<started;++i) {
+		pthread_join(workers[i], NULL);
+	}
+	rv = failed ? -1 : 0;
+destroy_done_queue:
+	message_queue_destroy(&done_queue);
+destroy_work_queue:
+	message_queue_destroy(&work_queue);
+free_jobs:
+	for(unsigned int i=0;i<depth;++i) {
+		free(jobs[i].input);
+		free(jobs[i].output);
+	}
+done:
+	free(carried);
+	free(workers);
+	free(jobs);
+	return rv;
+}
+
+/*
+ * A range of frames of a mapped file filtered by one thread. As with chunks,
+ * up to history frames before start are run through the filter first.
+ */
+struct mapped_range {
+	const struct wavmap *in;
+	struct wavmap *out;
+	uint64_t start;
+	uint64_t end;
+	int failed;
+};
+
+/*
+ * Returns frames frames of in starting at pos as interleaved floats. Aligned
+ * float data is returned in place; anything else is converted into buf.
+ */
+static const float *mapped_read(const struct wavmap *in, uint64_t pos, unsigned int frames, float *buf) {
+	const unsigned char *src = in->data + pos * 2 * (in->bits / 8);
+	if(in->format == WAVMAP_FLOAT) {
+		if(!((uintptr_t)src & (sizeof(float) - 1)))
+			return (const float *)src;
+		memcpy(buf, src, sizeof(float) * frames * 2);
+		return buf;
+	}
+	switch(in->bits) {
+	case 16:
+		for(unsigned int i=0;i<frames*2;++i, src+=2) {
+			buf[i] = (int16_t)(src[0] | (src[1] << 8)) * (1.0f / 0x8000);
+		}
+		break;
+	case 24:
+		for(unsigned int i=0;i<frames*2;++i, src+=3) {
+			buf[i] = (int32_t)((src[0] << 8) | (src[1] << 16) | ((uint32_t)src[2] << 24)) * (1.0f / 0x80000000);
+		}
+		break;
+	case 32:
+		for(unsigned int i=0;i<frames*2;++i, src+=4) {
+			buf[i] = (int32_t)(src[0] | (src[1] << 8) | (src[2] << 16) | ((uint32_t)src[3] << 24)) * (1.0f / 0x80000000);
+		}
+		break;
+	}
+	return buf;
+}
+
+static void *mapped_threadproc(void *data) {
+	struct mapped_range *range = data;
+	float buf[BLOCK_FRAMES*2], obuf[BLOCK_FRAMES*2];
+	struct crossfeed_output out;
+	crossfeed_t filter;
+	uint64_t pos;
+	range->failed = crossfeed_init(&filter, range->in->samplerate);
+	if(range->failed)
+		return data;
+	crossfeed_output_init(&out, CROSSFEED_FORMAT_S24, dither);
+	crossfeed_output_seed(&out, range->start);
+	pos = range->start - (range->start < crossfeed_history(&filter) ?
+	                      range->start : crossfeed_history(&filter));
+	while(pos < range->end) {
+		const uint64_t limit = pos < range->start ? range->start : range->end;
+		const unsigned int frames = limit - pos < BLOCK_FRAMES ? limit - pos : BLOCK_FRAMES;
+		const float *input = mapped_read(range->in, pos, frames, buf);
+		/* the priming run before start is only needed for the filter's state */
+		if(pos >= range->start)
+			crossfeed_filter_convert(&filter, input, range->out->data + pos * OUTPUT_FRAME_SIZE,
+			                         frames, &out);
+		else
+			crossfeed_filter(&filter, (float *)input, obuf, frames);
+		pos += frames;
+	}
+	crossfeed_destroy(&filter);
+	return data;
+}
+
+/*
+ * Filters a mapped stereo WAV file straight into a mapped 24-bit output
+ * file. Threads write disjoint ranges of the output, so no reordering is
+ * needed.
+ */
+static int process_mapped(const struct wavmap *in, const char *out_filename, unsigned int threads) {
+	struct mapped_range *ranges;
+	pthread_t *workers;
+	struct wavmap out;
+	crossfeed_t filter;
+	unsigned int started;
+	int rv = -1;
+	if(crossfeed_init(&filter, in->samplerate))
+		return -1;
+	crossfeed_destroy(&filter);
+	if(wavmap_create(&out, out_filename, 2, in->samplerate, 24, in->frames)) {
+		fprintf(stderr, "Error opening `%s': %s\n", out_filename, strerror(errno));
+		return -1;
+	}
+	ranges = calloc(threads, sizeof(struct mapped_range));
+	workers = calloc(threads, sizeof(pthread_t));
+	if(!ranges || !workers)
+		goto done;
+	for(unsigned int i=0;i<threads;++i) {
+		ranges[i].in = in;
+		ranges[i].out = &out;
+		ranges[i].start = in->frames * i / threads;
+		ranges[i].end = in->frames * (i + 1) / threads;
+	}
+	/* ranges left over when a thread can't be started are filtered here */
+	for(started=1;started<threads;++started) {
+		if(pthread_create(&workers[started], NULL, &mapped_threadproc, &ranges[started]))
+			break;
+	}
+	for(unsigned int i=started;i<threads;++i) {
+		mapped_threadproc(&ranges[i]);
+	}
+	mapped_threadproc(&ranges[0]);
+	rv = 0;
+	for(unsigned int i=1;i<started;++i) {
+		pthread_join(workers[i], NULL);
+	}
+	for(unsigned int i=0;i<threads;++i) {
+		rv |= ranges[i].failed ? -1 : 0;
+	}
+done:
+	free(workers);
+	free(ranges);
+	if(wavmap_close(&out)) {
+		fprintf(stderr, "Error writing `%s': %s\n", out_filename, strerror(errno));
+		rv = -1;
+	}
+	return rv;
+}
+
+/*
+ * Filters one file, serially or split across threads, and returns the
+ * number of frames processed or -1 on error. Files that need resampling
+ * are streamed through a stage on one thread, or pipelined with -p.
+ */
+static sf_count_t process_file(const char *in_filename, const char *out_filename,
+                               unsigned int threads, int *samplerate) {
 	SF_INFO info = {0};
 	SNDFILE *in_file, *out_file;
-	crossfeed_t filter;
-	float buf[2048], obuf[2048], tmp;
-	int read, i;
+	struct wavmap in;
+	struct rates rates;
+	int rv;
+	/* plain stereo WAV files are filtered in place unless pipelined I/O was asked for */
+	if(!pipelined && !wavmap_open(&in, in_filename)) {
+		if(in.channels == 2 && choose_rates(&rates, in.samplerate)) {
+			wavmap_close(&in);
+			return -1;
+		}
+		if(in.channels == 2 && rates.filter == in.samplerate && rates.output == in.samplerate) {
+			rv = process_mapped(&in, out_filename, threads);
+			wavmap_close(&in);
+			*samplerate = in.samplerate;
+			return rv ? -1 : (sf_count_t)in.frames;
+		}
+		wavmap_close(&in);
+	}
 	in_file = sf_open(in_filename, SFM_READ, &info);
+	if(!in_file) {
+		fprintf(stderr, "Error opening `%s': %s\n", in_filename, sf_strerror(NULL));
+		return -1;
+	}
+	/* the filter only takes interleaved stereo */
+	if(info.channels != 2) {
+		fprintf(stderr, "`%s' has %d channels, only stereo can be filtered\n", in_filename,
+		        info.channels);
+		sf_close(in_file);
+		return -1;
+	}
+	if(choose_rates(&rates, info.samplerate)) {
+		sf_close(in_file);
+		return -1;
+	}
+	info.samplerate = rates.output;
 	info.format = SF_FORMAT_WAV | SF_FORMAT_PCM_24;
 	out_file = sf_open(out_filename, SFM_WRITE, &info);
-	crossfeed_init(&filter, 96000);
-	while((read = sf_read_float(in_file, buf, 2048)) > 0) {
-		crossfeed_filter(&filter, buf, obuf, read/2);
-		for(i=0;i<read;++i) {
-			obuf[i] = obuf[i] > 1 ? 1 : (obuf[i] < -1 ? -1 : obuf[i]);
-		}
-		sf_write_float(out_file, obuf, read);
+	if(!out_file) {
+		fprintf(stderr, "Error opening `%s': %s\n", out_filename, sf_strerror(NULL));
+		sf_close(in_file);
+		return -1;
 	}
+	if(pipelined)
+		rv = process_pipelined(in_file, out_file, in_filename, &rates);
+	else if(threads > 1 && rates.filter == rates.input && rates.output == rates.input)
+		rv = process_parallel(in_file, out_file, threads, rates.filter);
+	else
+		rv = process_serial(in_file, out_file, &rates);
 	sf_close(out_file);
 	sf_close(in_file);
-	return EXIT_SUCCESS;
+	*samplerate = rates.input;
+	return rv ? -1 : info.frames;
+}
+
+/* A file for a batch worker; an empty in path tells the worker to exit */
+struct file_job {
+	char in[PATH_MAX];
+	char out[PATH_MAX];
+};
+
+struct batch_stats {
+	unsigned int files;
+	unsigned int failed;
+	double seconds;
+};
+
+/* The output paths already queued from one directory */
+struct output_names {
+	char **names;
+	unsigned int count;
+};
+
+static struct message_queue file_queue;
+/* Files batch_add passed over; only the queueing thread touches this */
+static unsigned int batch_skipped;
+
+static void *batch_threadproc(void *data) {
+	struct batch_stats *stats = data;
+	while(1) {
+		struct file_job *job = message_queue_read(&file_queue);
+		sf_count_t frames;
+		int samplerate;
+		if(!job->in[0]) {
+			message_queue_message_free(&file_queue, job);
+			break;
+		}
+		frames = process_file(job->in, job->out, 1, &samplerate);
+		if(frames < 0) {
+			++stats->failed;
+		} else {
+			++stats->files;
+			stats->seconds += (double)frames / samplerate;
+		}
+		message_queue_message_free(&file_queue, job);
+	}
+	return data;
+}
+
+static int output_taken(const struct output_names *taken, const char *name) {
+	for(unsigned int i=0;taken && i<taken->count;++i) {
+		if(!strcmp(taken->names[i], name))
+			return 1;
+	}
+	return 0;
+}
+
+static void output_take(struct output_names *taken, const char *name) {
+	char **names;
+	if(!taken)
+		return;
+	names = realloc(taken->names, sizeof(char *) * (taken->count + 1));
+	if(!names)
+		return;
+	taken->names = names;
+	if((taken->names[taken->count] = strdup(name)))
+		++taken->count;
+}
+
+/*
+ * Queues every stereo file libsndfile can read under in for filtering into
+ * the same relative path under out, creating directories as needed. The
+ * extension is replaced by .wav, unless another file in the same directory,
+ * such as song.mp3 next to song.flac, already took that name, in which case
+ * it is kept in front of .wav. Anything else is counted as skipped.
+ */
+static void batch_add(const char *in, const char *out, struct output_names *taken) {
+	struct stat st;
+	if(stat(in, &st))
+		return;
+	if(S_ISREG(st.st_mode)) {
+		struct file_job *job;
+		const char *base = strrchr(out, '/');
+		const char *ext = strrchr(base ? base : out, '.');
+		char name[PATH_MAX];
+		SF_INFO info = {0};
+		/* directories hold more than audio, so this is checked before queueing */
+		SNDFILE *probe = sf_open(in, SFM_READ, &info);
+		if(!probe) {
+			++batch_skipped;
+			return;
+		}
+		sf_close(probe);
+		if(info.channels != 2) {
+			fprintf(stderr, "Skipping `%s': %d channels, only stereo can be filtered\n", in,
+			        info.channels);
+			++batch_skipped;
+			return;
+		}
+		snprintf(name, PATH_MAX, "%.*s.wav", (int)(ext ? ext - out : (int)strlen(out)), out);
+		if(output_taken(taken, name))
+			snprintf(name, PATH_MAX, "%s.wav", out);
+		if(output_taken(taken, name)) {
+			fprintf(stderr, "Skipping `%s': `%s' is already being written\n", in, name);
+			++batch_skipped;
+			return;
+		}
+		output_take(taken, name);
+		job = message_queue_message_alloc_blocking(&file_queue);
+		snprintf(job->in, PATH_MAX, "%s", in);
+		snprintf(job->out, PATH_MAX, "%s", name);
+		message_queue_write(&file_queue, job);
+	} else if(S_ISDIR(st.st_mode)) {
+		char in_buf[PATH_MAX], out_buf[PATH_MAX];
+		struct output_names names = {0};
+		struct dirent *ent;
+		DIR *dir = opendir(in);
+		if(!dir)
+			return;
+		if(mkdir(out, 0777) && errno != EEXIST) {
+			fprintf(stderr, "Error creating `%s': %s\n", out, strerror(errno));
+			closedir(dir);
+			return;
+		}
+		while((ent = readdir(dir))) {
+			if(strcmp(".", ent->d_name) == 0 ||
+			   strcmp("..", ent->d_name) == 0 ||
+			   strcmp(".DS_Store", ent->d_name) == 0 ||
+			   strncmp("._", ent->d_name, 2) == 0)
+				continue;
+			snprintf(in_buf, PATH_MAX, "%s/%s", in, ent->d_name);
+			snprintf(out_buf, PATH_MAX, "%s/%s", out, ent->d_name);
+			batch_add(in_buf, out_buf, &names);
+		}
+		closedir(dir);
+		for(unsigned int i=0;i<names.count;++i) {
+			free(names.names[i]);
+		}
+		free(names.names);
+	}
+}
+
+static int process_batch(const char *in, const char *out, unsigned int threads) {
+	pthread_t *workers = calloc(threads, sizeof(pthread_t));
+	struct batch_stats *stats = calloc(threads, sizeof(struct batch_stats));
+	struct batch_stats total = {0};
+	double start = now(), elapsed;
+	unsigned int started;
+	if(!workers || !stats || message_queue_init(&file_queue, sizeof(struct file_job), threads * 4)) {
+		free(stats);
+		free(workers);
+		return -1;
+	}
+	for(started=0;started<threads;++started) {
+		if(pthread_create(&workers[started], NULL, &batch_threadproc, &stats[started]))
+			break;
+	}
+	if(!started) {
+		fprintf(stderr, "Failed to start batch workers\n");
+		message_queue_destroy(&file_queue);
+		free(stats);
+		free(workers);
+		return -1;
+	}
+	batch_skipped = 0;
+	batch_add(in, out, NULL);
+	for(unsigned int i=0;i<started;++i) {
+		struct file_job *job = message_queue_message_alloc_blocking(&file_queue);
+		job->in[0] = '\0';
+		message_queue_write(&file_queue, job);
+	}
+	for(unsigned int i=0;i<started;++i) {
+		pthread_join(workers[i], NULL);
+		total.files += stats[i].files;
+		total.failed += stats[i].failed;
+		total.seconds += stats[i].seconds;
+	}
+	elapsed = now() - start;
+	fprintf(stderr, "Processed %u files (%u failed, %u skipped), %.1fs of audio in %.1fs (%.1fx realtime)\n",
+	        total.files, total.failed, batch_skipped, total.seconds, elapsed,
+	        elapsed > 0 ? total.seconds / elapsed : 0);
+	message_queue_destroy(&file_queue);
+	free(stats);
+	free(workers);
+	return total.failed ? -1 : 0;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-j threads] [-p] [-d] [-B frames] [-k kernels] [-R rate [-b]] input output\n"
+	                "       %s -r [-j threads] [-p] [-d] [-B frames] [-k kernels] [-R rate [-b]] input-dir output-dir\n"
+	                "  -p         read, filter and write on separate threads\n"
+	                "  -d         add TPDF dither to the 24-bit output\n"
+	                "  -k kernels load kernels from a store written by designer\n"
+	                "  -B frames  frames per read and write (default %d)\n"
+	                "  -R rate    filter at rate, resampling files at other rates to it\n"
+	                "  -b         resample back to each file's own rate after filtering\n"
+	                "Files at rates without a kernel are filtered at %dHz and resampled back.\n",
+	        name, name, BLOCK_FRAMES, FALLBACK_SAMPLERATE);
+}
+
+int main(int argc, char *argv[]) {
+	const char *name = argc > 0 ? argv[0] : "sndfile-crossfeed";
+	char *in_filename = NULL, *out_filename = NULL;
+	unsigned int threads = 1;
+	int batch = 0, samplerate;
+	for(int i = 1; i < argc; ++i) {
+		if(strcmp("-j", argv[i]) == 0) {
+			if(++i >= argc || atoi(argv[i]) < 1) {
+				usage(name);
+				return EXIT_FAILURE;
+			}
+			threads = atoi(argv[i]);
+		} else if(strcmp("-B", argv[i]) == 0) {
+			if(++i >= argc || atoi(argv[i]) < 1) {
+				usage(name);
+				return EXIT_FAILURE;
+			}
+			block_frames = atoi(argv[i]);
+		} else if(strcmp("-k", argv[i]) == 0) {
+			if(++i >= argc) {
+				usage(name);
+				return EXIT_FAILURE;
+			}
+			if(crossfeed_load_kernels(argv[i])) {
+				fprintf(stderr, "Error loading kernels from `%s'\n", argv[i]);
+				return EXIT_FAILURE;
+			}
+		} else if(strcmp("-R", argv[i]) == 0) {
+			if(++i >= argc || atoi(argv[i]) < 1) {
+				usage(name);
+				return EXIT_FAILURE;
+			}
+			filter_rate = atoi(argv[i]);
+		} else if(strcmp("-b", argv[i]) == 0) {
+			resample_back = 1;
+		} else if(strcmp("-p", argv[i]) == 0) {
+			pipelined = 1;
+		} else if(strcmp("-d", argv[i]) == 0) {
+			dither = 1;
+		} else if(strcmp("-r", argv[i]) == 0) {
+			batch = 1;
+		} else if(!in_filename) {
+			in_filename = argv[i];
+		} else if(!out_filename) {
+			out_filename = argv[i];
+		} else {
+			usage(name);
+			return EXIT_FAILURE;
+		}
+	}
+	if(!out_filename) {
+		usage(name);
+		return EXIT_FAILURE;
+	}
+	if(batch)
+		return process_batch(in_filename, out_filename, threads) ? EXIT_FAILURE : EXIT_SUCCESS;
+	return process_file(in_filename, out_filename, threads, &samplerate) < 0 ?
+	       EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2012 Jeremy Pepper
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of message_queue nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "spsc_queue.h"
+#include "futex.h"
+#include <stdint.h>
+#include <stdlib.h>
+
+static inline uint32_t round_to_pow2(uint32_t x) {
+	x--;
+	x |= x >> 1;
+	x |= x >> 2;
+	x |= x >> 4;
+	x |= x >> 8;
+	x |= x >> 16;
+	x++;
+	return x;
+}
+
+static inline unsigned int pad_size(unsigned int size) {
+	const unsigned int align = sizeof(void *) > sizeof(double) ? sizeof(void *) : sizeof(double);
+	return (size + align - 1) / align * align;
+}
+
+static int ring_init(struct spsc_ring *ring, unsigned int depth) {
+	ring->slots = malloc(sizeof(void *) * depth);
+	if(!ring->slots)
+		return -1;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->waiting, 0);
+	ring->cached_head = 0;
+	return 0;
+}
+
+/*
+ * Every queue holds max_depth messages in total, so neither ring can
+ * overflow and the writer never has to look at tail.
+ */
+static inline void ring_push(struct spsc_ring *ring, unsigned int mask, void *message) {
+	const unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	ring->slots[head & mask] = message;
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	/*
+	 * Pairs with the fence in ring_pop_blocking, so either the reader sees the
+	 * new head or this sees it waiting. A reader only sleeps on an empty
+	 * ring, so only the write that ends that emptiness has to wake it.
+	 */
+	atomic_thread_fence(memory_order_seq_cst);
+	if(atomic_load_explicit(&ring->waiting, memory_order_acquire) &&
+	   atomic_load_explicit(&ring->tail, memory_order_relaxed) == head)
+		futex_wake((unsigned int *)&ring->head, 1);
+}
+
+static inline void *ring_pop(struct spsc_ring *ring, unsigned int mask) {
+	const unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	void *message;
+	if(tail == ring->cached_head) {
+		ring->cached_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		if(tail == ring->cached_head)
+			return NULL;
+	}
+	message = ring->slots[tail & mask];
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+	return message;
+}
+
+static void *ring_pop_blocking(struct spsc_ring *ring, unsigned int mask) {
+	void *message = ring_pop(ring, mask);
+	while(!message) {
+		const unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		atomic_store_explicit(&ring->waiting, 1, memory_order_release);
+		atomic_thread_fence(memory_order_seq_cst);
+		if(atomic_load_explicit(&ring->head, memory_order_relaxed) == tail)
+			futex_wait((unsigned int *)&ring->head, tail);
+		atomic_store_explicit(&ring->waiting, 0, memory_order_relaxed);
+		message = ring_pop(ring, mask);
+	}
+	return message;
+}
+
+int spsc_queue_init(struct spsc_queue *queue, int message_size, int max_depth) {
+	queue->message_size = pad_size(message_size);
+	queue->max_depth = round_to_pow2(max_depth);
+	queue->memory = malloc((size_t)queue->message_size * queue->max_depth);
+	if(!queue->memory)
+		goto error;
+	if(ring_init(&queue->freelist, queue->max_depth))
+		goto error_after_memory;
+	if(ring_init(&queue->queue, queue->max_depth))
+		goto error_after_freelist;
+	for(unsigned int i=0;i<queue->max_depth;++i) {
+		queue->freelist.slots[i] = (char *)queue->memory + (size_t)queue->message_size * i;
+	}
+	atomic_init(&queue->freelist.head, queue->max_depth);
+	return 0;
+
+error_after_freelist:
+	free(queue->freelist.slots);
+error_after_memory:
+	free(queue->memory);
+error:
+	return -1;
+}
+
+void *spsc_queue_message_alloc(struct spsc_queue *queue) {
+	return ring_pop(&queue->freelist, queue->max_depth - 1);
+}
+
+void *spsc_queue_message_alloc_blocking(struct spsc_queue *queue) {
+	return ring_pop_blocking(&queue->freelist, queue->max_depth - 1);
+}
+
+void spsc_queue_message_free(struct spsc_queue *queue, void *message) {
+	ring_push(&queue->freelist, queue->max_depth - 1, message);
+}
+
+void spsc_queue_write(struct spsc_queue *queue, void *message) {
+	ring_push(&queue->queue, queue->max_depth - 1, message);
+}
+
+void *spsc_queue_tryread(struct spsc_queue *queue) {
+	return ring_pop(&queue->queue, queue->max_depth - 1);
+}
+
+void *spsc_queue_read(struct spsc_queue *queue) {
+	return ring_pop_blocking(&queue->queue, queue->max_depth - 1);
+}
+
+void spsc_queue_destroy(struct spsc_queue *queue) {
+	free(queue->queue.slots);
+	free(queue->freelist.slots);
+	free(queue->memory);
+}
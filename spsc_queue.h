@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2012 Jeremy Pepper
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of message_queue nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+
+#ifdef __cplusplus
+#include <atomic>
+typedef std::atomic<unsigned int> spsc_atomic_uint;
+#else
+#include <stdatomic.h>
+typedef atomic_uint spsc_atomic_uint;
+#endif
+
+/**
+ * \brief A ring of message pointers with one writer and one reader
+ *
+ * head is only written by the writer and tail only by the reader. The
+ * reader keeps its last view of head in cached_head so that it only touches
+ * the writer's cache line when it runs out of messages. waiting is set by a
+ * reader about to block on head.
+ */
+struct spsc_ring {
+	spsc_atomic_uint head __attribute__((aligned(CACHE_LINE_SIZE)));
+	spsc_atomic_uint tail __attribute__((aligned(CACHE_LINE_SIZE)));
+	unsigned int cached_head;
+	spsc_atomic_uint waiting __attribute__((aligned(CACHE_LINE_SIZE)));
+	void **slots;
+};
+
+/**
+ * \brief Single-producer, single-consumer message queue structure
+ *
+ * This has the same interface as message_queue, but only one thread may
+ * allocate and write messages and only one thread may read and free them.
+ * Messages flow to the reader through one ring and back to the writer
+ * through another, so neither side needs read-modify-write operations, and
+ * a blocked reader sleeps on a futex instead of a named semaphore.
+ */
+struct spsc_queue {
+	unsigned int message_size;
+	unsigned int max_depth;
+	void *memory;
+	struct spsc_ring freelist;
+	struct spsc_ring queue;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \brief Initialize a single-producer, single-consumer queue
+ *
+ * \param queue pointer to the queue structure to initialize
+ * \param message_size size in bytes of the largest message that will be sent
+ *        on this queue
+ * \param max_depth the maximum number of messages to allow in the queue at
+ *        once. This will be rounded to the next highest power of two.
+ *
+ * \return 0 if successful, or nonzero if an error occured
+ */
+int spsc_queue_init(struct spsc_queue *queue, int message_size, int max_depth);
+
+/**
+ * \brief Allocate a new message, or return NULL if none are free
+ *
+ * Only the writing thread may call this.
+ */
+void *spsc_queue_message_alloc(struct spsc_queue *queue);
+
+/**
+ * \brief Allocate a new message, blocking until one is freed if necessary
+ *
+ * Only the writing thread may call this.
+ */
+void *spsc_queue_message_alloc_blocking(struct spsc_queue *queue);
+
+/**
+ * \brief Return a message to the writer for reuse
+ *
+ * Only the reading thread may call this.
+ */
+void spsc_queue_message_free(struct spsc_queue *queue, void *message);
+
+/**
+ * \brief Write a message to the queue
+ *
+ * Only the writing thread may call this.
+ */
+void spsc_queue_write(struct spsc_queue *queue, void *message);
+
+/**
+ * \brief Read a message from the queue if one is available
+ *
+ * Only the reading thread may call this.
+ *
+ * \return pointer to the next message, or NULL if the queue is empty
+ */
+void *spsc_queue_tryread(struct spsc_queue *queue);
+
+/**
+ * \brief Read a message from the queue, blocking until one is available
+ *
+ * Only the reading thread may call this.
+ */
+void *spsc_queue_read(struct spsc_queue *queue);
+
+/**
+ * \brief Destroy a queue, freeing its resources
+ */
+void spsc_queue_destroy(struct spsc_queue *queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
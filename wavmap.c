@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2013 Jeremy Pepper
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of crossfeed nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "wavmap.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define WAVE_FORMAT_PCM 1
+#define WAVE_FORMAT_IEEE_FLOAT 3
+#define WAVE_FORMAT_EXTENSIBLE 0xFFFE
+#define HEADER_SIZE 44
+
+static inline uint32_t get_le32(const unsigned char *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint16_t get_le16(const unsigned char *p) {
+	return p[0] | (p[1] << 8);
+}
+
+static inline void put_le32(unsigned char *p, uint32_t x) {
+	p[0] = x; p[1] = x >> 8; p[2] = x >> 16; p[3] = x >> 24;
+}
+
+static inline void put_le16(unsigned char *p, uint16_t x) {
+	p[0] = x; p[1] = x >> 8;
+}
+
+static int wavmap_parse(struct wavmap *wav) {
+	const unsigned char *p = wav->map, *end = p + wav->size;
+	unsigned int tag = 0, block_align = 0;
+	if(wav->size < 12 || memcmp(p, "RIFF", 4) || memcmp(p + 8, "WAVE", 4))
+		return -1;
+	p += 12;
+	while(end - p >= 8) {
+		const uint32_t size = get_le32(p + 4);
+		const unsigned char *body = p + 8;
+		if(!memcmp(p, "fmt ", 4)) {
+			if(size < 16 || end - body < 16)
+				return -1;
+			tag = get_le16(body);
+			wav->channels = get_le16(body + 2);
+			wav->samplerate = get_le32(body + 4);
+			block_align = get_le16(body + 12);
+			wav->bits = get_le16(body + 14);
+			if(tag == WAVE_FORMAT_EXTENSIBLE) {
+				if(size < 40 || end - body < 40)
+					return -1;
+				tag = get_le16(body + 24);
+			}
+		} else if(!memcmp(p, "data", 4)) {
+			/* streamed files may leave the size unset, so trust the file length */
+			const uint64_t avail = end - body;
+			if(!tag || !wav->channels || block_align != wav->channels * (wav->bits / 8))
+				return -1;
+			if(tag == WAVE_FORMAT_PCM && wav->bits != 16 && wav->bits != 24 && wav->bits != 32)
+				return -1;
+			if(tag == WAVE_FORMAT_IEEE_FLOAT && wav->bits != 32)
+				return -1;
+			if(tag != WAVE_FORMAT_PCM && tag != WAVE_FORMAT_IEEE_FLOAT)
+				return -1;
+			wav->format = tag == WAVE_FORMAT_PCM ? WAVMAP_PCM : WAVMAP_FLOAT;
+			wav->data = (unsigned char *)body;
+			wav->frames = (size < avail ? size : avail) / block_align;
+			return 0;
+		}
+		if(end - body < size + (size & 1))
+			return -1;
+		p = body + size + (size & 1);
+	}
+	return -1;
+}
+
+int wavmap_open(struct wavmap *wav, const char *path) {
+	struct stat st;
+	int fd;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+	return -1;
+#endif
+	memset(wav, 0, sizeof(struct wavmap));
+	fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return -1;
+	if(fstat(fd, &st) || !S_ISREG(st.st_mode) || !st.st_size) {
+		close(fd);
+		return -1;
+	}
+	wav->size = st.st_size;
+	wav->map = mmap(NULL, wav->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(wav->map == MAP_FAILED) {
+		wav->map = NULL;
+		return -1;
+	}
+	if(wavmap_parse(wav)) {
+		wavmap_close(wav);
+		return -1;
+	}
+	madvise(wav->map, wav->size, MADV_SEQUENTIAL);
+	return 0;
+}
+
+int wavmap_create(struct wavmap *wav, const char *path, unsigned int channels,
+                  unsigned int samplerate, unsigned int bits, uint64_t frames) {
+	const unsigned int block_align = channels * (bits / 8);
+	const uint64_t data_size = frames * block_align;
+	unsigned char *header;
+	int fd;
+	memset(wav, 0, sizeof(struct wavmap));
+	if(data_size > UINT32_MAX - HEADER_SIZE)
+		return -1;
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if(fd < 0)
+		return -1;
+	wav->size = HEADER_SIZE + data_size;
+	/*
+	 * Allocate the blocks now: writing to a hole in a shared mapping on a full
+	 * disk raises SIGBUS instead of returning an error.
+	 */
+	if((errno = posix_fallocate(fd, 0, wav->size))) {
+		close(fd);
+		return -1;
+	}
+	wav->map = mmap(NULL, wav->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(wav->map == MAP_FAILED) {
+		wav->map = NULL;
+		return -1;
+	}
+	header = wav->map;
+	memcpy(header, "RIFF", 4);
+	put_le32(header + 4, wav->size - 8);
+	memcpy(header + 8, "WAVEfmt ", 8);
+	put_le32(header + 16, 16);
+	put_le16(header + 20, WAVE_FORMAT_PCM);
+	put_le16(header + 22, channels);
+	put_le32(header + 24, samplerate);
+	put_le32(header + 28, samplerate * block_align);
+	put_le16(header + 32, block_align);
+	put_le16(header + 34, bits);
+	memcpy(header + 36, "data", 4);
+	put_le32(header + 40, data_size);
+	wav->data = header + HEADER_SIZE;
+	wav->frames = frames;
+	wav->channels = channels;
+	wav->samplerate = samplerate;
+	wav->bits = bits;
+	wav->format = WAVMAP_PCM;
+	wav->writable = 1;
+	return 0;
+}
+
+int wavmap_close(struct wavmap *wav) {
+	int rv = 0;
+	if(wav->map) {
+		if(wav->writable && msync(wav->map, wav->size, MS_SYNC))
+			rv = -1;
+		if(munmap(wav->map, wav->size))
+			rv = -1;
+	}
+	wav->map = NULL;
+	return rv;
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2013 Jeremy Pepper
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of crossfeed nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef WAVMAP_H
+#define WAVMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum wavmap_format {
+	WAVMAP_PCM,
+	WAVMAP_FLOAT
+};
+
+/*
+ * A memory-mapped WAV file holding uncompressed little-endian PCM or 32-bit
+ * float samples. data points at the first frame.
+ */
+struct wavmap {
+	void *map;
+	size_t size;
+	unsigned char *data;
+	uint64_t frames;
+	unsigned int channels;
+	unsigned int samplerate;
+	unsigned int bits;
+	enum wavmap_format format;
+	int writable;
+};
+
+/*
+ * Maps an existing file for reading. Fails for anything but 16/24/32-bit
+ * PCM or 32-bit float WAV files, so callers can fall back to another
+ * reader.
+ */
+int wavmap_open(struct wavmap *wav, const char *path);
+
+/*
+ * Creates a WAV file sized for frames frames of the given PCM format, writes
+ * its header and maps it for writing. The file's blocks are allocated up
+ * front, so this fails with errno set if the disk can't hold it.
+ */
+int wavmap_create(struct wavmap *wav, const char *path, unsigned int channels,
+                  unsigned int samplerate, unsigned int bits, uint64_t frames);
+
+/*
+ * Unmaps the file, first writing a created file back to disk. Fails with
+ * errno set if that write fails.
+ */
+int wavmap_close(struct wavmap *wav);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif